@@ -0,0 +1,143 @@
+`include "types.sv"
+`include "dual_port_ram.v"
+
+// Bulk IN endpoint streaming application data to the host through a FIFO.
+// An IN is answered with up to a full packet of whatever the FIFO holds and
+// only NAKed when it is empty. Sent bytes stay in the FIFO until the host
+// ACKs them, and an unacknowledged packet is resent as it was
+module bulk_in_endpoint(
+    input logic reset, clk48,
+    input logic bus_reset,
+
+    // An IN transaction to this endpoint
+    input logic txn_active,
+    input Pid pid,
+
+    input logic handshake_complete,
+
+    // INs are STALLed while halted. toggle_reset restarts the data toggle
+    // at DATA0
+    input logic halt,
+    input logic toggle_reset,
+
+    output Handshake handshake_out,
+    output logic handshake_out_valid,
+
+    output Pid data_out_pid,
+    output logic [7:0]data_out,
+    output logic data_out_last,
+    output logic data_out_empty,
+    output logic data_out_valid,
+    input logic data_out_ack,
+
+    // Application side. in_data is taken on clocks with both in_valid and
+    // in_ready set
+    input logic [7:0]in_data,
+    input logic in_valid,
+    output logic in_ready
+);
+
+localparam MAX_PACKET = 64;
+// Four packets
+localparam FIFO_ADDR_BITS = 8;
+localparam FIFO_BYTES = 1 << FIFO_ADDR_BITS;
+
+logic txn_active_last;
+logic txn_start;
+assign txn_start = txn_active && !txn_active_last;
+
+// Pointers carry a wrap bit. Bytes from rd_ptr to wr_ptr are waiting for
+// the host, and the packet being sent is read from tx_ptr
+logic [FIFO_ADDR_BITS:0]wr_ptr;
+logic [FIFO_ADDR_BITS:0]rd_ptr;
+logic [FIFO_ADDR_BITS:0]tx_ptr;
+logic [FIFO_ADDR_BITS:0]used;
+assign used = wr_ptr - rd_ptr;
+
+assign in_ready = used != FIFO_BYTES;
+
+// The packet offered to the host, fixed from the first IN that finds data
+// until it is ACKed
+logic tx_pending;
+logic [6:0]tx_len;
+logic [6:0]tx_count;
+
+// Data toggle of the packet offered
+Pid tx_toggle;
+
+logic acked;
+assign acked = txn_active &&
+               handshake_complete &&
+               pid == PID_ACK &&
+               tx_pending;
+
+always_ff @(posedge clk48) begin
+    if (reset)
+        txn_active_last <= 0;
+    else
+        txn_active_last <= txn_active;
+end
+
+always_ff @(posedge clk48) begin
+    if (reset || bus_reset) begin
+        wr_ptr <= 0;
+        rd_ptr <= 0;
+        tx_ptr <= 0;
+        tx_pending <= 0;
+        tx_len <= 0;
+        tx_count <= 0;
+        tx_toggle <= PID_DATA0;
+    end else begin
+        if (in_valid && in_ready)
+            wr_ptr <= wr_ptr + 1;
+
+        if (txn_start) begin
+            tx_ptr <= rd_ptr;
+            tx_count <= 0;
+            if (!tx_pending && used != 0) begin
+                tx_pending <= 1;
+                tx_len <= used > MAX_PACKET ? MAX_PACKET : used[6:0];
+            end
+        end else if (data_out_ack) begin
+            tx_ptr <= tx_ptr + 1;
+            tx_count <= tx_count + 1;
+        end else if (acked) begin
+            rd_ptr <= rd_ptr + tx_len;
+            tx_pending <= 0;
+            tx_toggle <= tx_toggle == PID_DATA0 ? PID_DATA1 : PID_DATA0;
+        end
+        if (toggle_reset)
+            tx_toggle <= PID_DATA0;
+    end
+end
+
+// Until the clock after txn_start neither is valid
+logic txn_ready;
+always_ff @(posedge clk48) begin
+    if (reset || !txn_active)
+        txn_ready <= 0;
+    else
+        txn_ready <= txn_active_last;
+end
+
+assign data_out_valid = txn_ready && tx_pending && !halt;
+assign handshake_out_valid = txn_ready && (!tx_pending || halt);
+assign handshake_out = halt ? HANDSHAKE_STALL : HANDSHAKE_NAK;
+
+assign data_out_pid = tx_toggle;
+assign data_out_last = tx_count == tx_len - 1;
+assign data_out_empty = 0;
+
+// The RAM output register follows tx_ptr a clock behind, well within the
+// 32 clocks the encoder takes for a byte
+simple_dual_port #(.ADDR_WIDTH(FIFO_ADDR_BITS), .DATA_WIDTH(8))
+    ram0(.clk(clk48),
+         .ena(1'b1),
+         .enb(1'b1),
+         .wea(in_valid && in_ready),
+         .addra(wr_ptr[FIFO_ADDR_BITS-1:0]),
+         .addrb(tx_ptr[FIFO_ADDR_BITS-1:0]),
+         .dia(in_data),
+         .dob(data_out));
+
+endmodule
@@ -0,0 +1,154 @@
+`include "types.sv"
+`include "dual_port_ram.v"
+
+// Bulk OUT endpoint streaming received packets to the application through
+// a FIFO. A packet is received behind the data the application has yet to
+// take and only becomes visible once it is ACKed, so the host is only
+// NAKed when the FIFO has no room for a full packet
+module bulk_out_endpoint(
+    input logic reset, clk48,
+    input logic bus_reset,
+
+    // An OUT transaction to this endpoint
+    input logic txn_active,
+    input Pid pid,
+
+    input logic data_complete,
+
+    // OUTs are STALLed while halted. toggle_reset restarts the data toggle
+    // at DATA0
+    input logic halt,
+    input logic toggle_reset,
+
+    input logic [7:0]data_in,
+    input logic data_in_valid,
+
+    output Handshake handshake_out,
+    output logic handshake_out_valid,
+
+    // Application side. out_data is taken on clocks with both out_valid
+    // and out_ready set
+    output logic [7:0]out_data,
+    output logic out_valid,
+    input logic out_ready
+);
+
+localparam MAX_PACKET = 64;
+// Payload and CRC16
+localparam MAX_DATA_BYTES = MAX_PACKET + 2;
+// Four packets
+localparam FIFO_ADDR_BITS = 8;
+localparam FIFO_BYTES = 1 << FIFO_ADDR_BITS;
+
+logic txn_active_last;
+logic txn_start;
+assign txn_start = txn_active && !txn_active_last;
+
+// Pointers carry a wrap bit. Bytes from rd_ptr to wr_ptr are ACKed and
+// waiting for the application; the packet being received is written from
+// wr_ptr on
+logic [FIFO_ADDR_BITS:0]wr_ptr;
+logic [FIFO_ADDR_BITS:0]rd_ptr;
+logic [FIFO_ADDR_BITS:0]used;
+assign used = wr_ptr - rd_ptr;
+
+// Whether the current transaction's packet fits, and its bytes so far,
+// saturating past the end of a packet
+logic rx_accept;
+logic [6:0]rx_count;
+
+// Data toggle of the next new packet
+Pid rx_toggle;
+
+logic commit;
+
+always_ff @(posedge clk48) begin
+    if (reset)
+        txn_active_last <= 0;
+    else
+        txn_active_last <= txn_active;
+end
+
+always_ff @(posedge clk48) begin
+    if (reset || bus_reset) begin
+        rx_accept <= 0;
+        rx_count <= 0;
+    end else if (txn_start) begin
+        rx_accept <= used <= FIFO_BYTES - MAX_DATA_BYTES;
+        rx_count <= 0;
+    end else if (txn_active && data_in_valid && rx_count != 'h7F)
+        rx_count <= rx_count + 1;
+end
+
+// The handshake is decided when the DATA packet ends and held until the
+// transaction does. A retransmitted packet, whose ACK the host missed, is
+// ACKed again and dropped
+always_ff @(posedge clk48) begin
+    if (reset || bus_reset || !txn_active) begin
+        handshake_out <= HANDSHAKE_NONE;
+        handshake_out_valid <= 0;
+        commit <= 0;
+    end else if (data_complete) begin
+        handshake_out_valid <= 1;
+        if (halt)
+            handshake_out <= HANDSHAKE_STALL;
+        else if (!rx_accept)
+            handshake_out <= HANDSHAKE_NAK;
+        else if (rx_count > MAX_DATA_BYTES)
+            handshake_out <= HANDSHAKE_STALL;
+        else
+            handshake_out <= HANDSHAKE_ACK;
+        commit <= !halt &&
+                  rx_accept &&
+                  rx_count <= MAX_DATA_BYTES &&
+                  pid == rx_toggle;
+    end else
+        commit <= 0;
+end
+
+// The RAM is read ahead into its output register, which holds out_data
+logic fetch;
+assign fetch = rd_ptr != wr_ptr && (!out_valid || out_ready);
+
+always_ff @(posedge clk48) begin
+    if (reset || bus_reset) begin
+        wr_ptr <= 0;
+        rd_ptr <= 0;
+        out_valid <= 0;
+        rx_toggle <= PID_DATA0;
+    end else begin
+        if (commit) begin
+            // Less the CRC
+            wr_ptr <= wr_ptr + rx_count - 2;
+            rx_toggle <= rx_toggle == PID_DATA0 ? PID_DATA1 : PID_DATA0;
+        end
+        if (toggle_reset)
+            rx_toggle <= PID_DATA0;
+        if (fetch) begin
+            rd_ptr <= rd_ptr + 1;
+            out_valid <= 1;
+        end else if (out_ready)
+            out_valid <= 0;
+    end
+end
+
+logic ram_write;
+assign ram_write = txn_active &&
+                   data_in_valid &&
+                   rx_accept &&
+                   rx_count < MAX_DATA_BYTES;
+
+logic [FIFO_ADDR_BITS-1:0]ram_write_addr;
+assign ram_write_addr = wr_ptr[FIFO_ADDR_BITS-1:0] + rx_count;
+
+simple_dual_port #(.ADDR_WIDTH(FIFO_ADDR_BITS), .DATA_WIDTH(8))
+    ram0(.clk(clk48),
+         .ena(1'b1),
+         .enb(fetch),
+         .wea(ram_write),
+         .addra(ram_write_addr),
+         .addrb(rd_ptr[FIFO_ADDR_BITS-1:0]),
+         .dia(data_in),
+         .dob(out_data));
+
+endmodule
@@ -0,0 +1,180 @@
+`ifndef USBFS_DESCRIPTOR_ENGINE
+`define USBFS_DESCRIPTOR_ENGINE
+
+`include "types.sv"
+`include "descriptor_rom.sv"
+
+// Data stage of a GET_DESCRIPTOR. The descriptor named by wValue is looked
+// up in the directory of descriptor_rom, a byte a clock, then sent from the
+// ROM in MAX_PACKET sized DATA packets starting at DATA1. At most wLength
+// bytes are sent, and the stage ends with a short packet, zero length if
+// need be, unless it ends on wLength in a full one. A packet is resent as
+// it was until the host ACKs it
+module descriptor_engine #(
+    // bMaxPacketSize0 of the device descriptor, up to 64
+    parameter MAX_PACKET = 64
+) (
+    input logic reset, clk48,
+
+    // Start looking up wValue, a descriptor type and index. The language ID
+    // of a string descriptor, in wIndex, is not checked
+    input logic lookup,
+    input logic [15:0]wValue,
+    input logic [15:0]wLength,
+
+    output logic busy,
+    output logic found,
+    output logic done,
+
+    // An IN of the data stage starts, and the host ACKed its packet
+    input logic txn_start,
+    input logic acked,
+
+    output Pid data_out_pid,
+    output logic [7:0]data_out,
+    output logic data_out_last,
+    output logic data_out_empty,
+    input logic data_out_ack
+);
+
+localparam DIRECTORY_ENTRY_BYTES = 6;
+
+typedef enum {
+    DESC_IDLE,
+    DESC_SEARCH,
+    DESC_FOUND,
+    DESC_MISSING
+} DescState;
+
+DescState desc_state;
+
+assign busy = desc_state == DESC_SEARCH;
+assign found = desc_state == DESC_FOUND;
+
+logic [9:0]rom_addr;
+logic [7:0]rom_data;
+
+logic [7:0]want_type;
+logic [7:0]want_index;
+logic [15:0]want_length;
+
+// The directory is read a byte a clock. The ROM output lags its address by
+// a clock, so the field of each byte read is carried along with it
+logic [9:0]search_addr;
+logic [2:0]search_field;
+logic entry_valid;
+logic [2:0]entry_field;
+
+logic [7:0]entry_type;
+logic [7:0]entry_index;
+logic [7:0]entry_offset_lo;
+logic [9:0]entry_offset;
+logic [7:0]entry_length_lo;
+logic [15:0]entry_length;
+assign entry_length = {rom_data, entry_length_lo};
+
+// The descriptor found, and how much of it the host gets
+logic [9:0]desc_offset;
+logic [15:0]xfer_len;
+
+always_ff @(posedge clk48) begin
+    if (reset) begin
+        desc_state <= DESC_IDLE;
+        want_type <= 0;
+        want_index <= 0;
+        want_length <= 0;
+        search_addr <= 0;
+        search_field <= 0;
+        entry_valid <= 0;
+        entry_field <= 0;
+        desc_offset <= 0;
+        xfer_len <= 0;
+    end else if (lookup) begin
+        desc_state <= DESC_SEARCH;
+        want_type <= wValue[15:8];
+        want_index <= wValue[7:0];
+        want_length <= wLength;
+        search_addr <= 0;
+        search_field <= 0;
+        entry_valid <= 0;
+    end else if (desc_state == DESC_SEARCH) begin
+        search_addr <= search_addr + 1;
+        search_field <= search_field == DIRECTORY_ENTRY_BYTES - 1 ? 0 : search_field + 1;
+        entry_valid <= 1;
+        entry_field <= search_field;
+
+        if (entry_valid)
+            case (entry_field)
+                3'd0:
+                    // End of the directory
+                    if (rom_data == 0)
+                        desc_state <= DESC_MISSING;
+                    else
+                        entry_type <= rom_data;
+                3'd1:
+                    entry_index <= rom_data;
+                3'd2:
+                    entry_offset_lo <= rom_data;
+                3'd3:
+                    entry_offset <= {rom_data[1:0], entry_offset_lo};
+                3'd4:
+                    entry_length_lo <= rom_data;
+                default:
+                    if (entry_type == want_type && entry_index == want_index) begin
+                        desc_state <= DESC_FOUND;
+                        desc_offset <= entry_offset;
+                        xfer_len <= entry_length < want_length ? entry_length : want_length;
+                    end
+            endcase
+    end
+end
+
+// The packet offered to the host starts sent bytes into the descriptor
+logic [15:0]sent;
+logic [15:0]remaining;
+logic [6:0]tx_len;
+logic [6:0]tx_count;
+logic [9:0]tx_ptr;
+assign remaining = xfer_len - sent;
+assign tx_len = remaining > MAX_PACKET ? MAX_PACKET : remaining[6:0];
+
+// Data toggle of the packet offered
+Pid tx_toggle;
+
+always_ff @(posedge clk48) begin
+    if (reset || lookup) begin
+        sent <= 0;
+        tx_ptr <= 0;
+        tx_count <= 0;
+        tx_toggle <= PID_DATA1;
+        done <= 0;
+    end else if (txn_start) begin
+        tx_ptr <= desc_offset + sent[9:0];
+        tx_count <= 0;
+    end else if (data_out_ack) begin
+        tx_ptr <= tx_ptr + 1;
+        tx_count <= tx_count + 1;
+    end else if (acked && found && !done) begin
+        sent <= sent + tx_len;
+        tx_toggle <= tx_toggle == PID_DATA0 ? PID_DATA1 : PID_DATA0;
+        if (tx_len != MAX_PACKET || sent + tx_len == want_length)
+            done <= 1;
+    end
+end
+
+assign data_out_pid = tx_toggle;
+assign data_out = rom_data;
+assign data_out_last = tx_count == tx_len - 1;
+assign data_out_empty = tx_len == 0;
+
+// As in bulk_in_endpoint, the ROM output register follows tx_ptr a clock
+// behind, well within the 32 clocks the encoder takes for a byte
+assign rom_addr = desc_state == DESC_SEARCH ? search_addr : tx_ptr;
+
+descriptor_rom rom0(.clk(clk48),
+                    .addra(rom_addr),
+                    .doa(rom_data));
+
+endmodule
+
+`endif
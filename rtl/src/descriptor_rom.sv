@@ -0,0 +1,118 @@
+`ifndef USBFS_DESCRIPTOR_ROM
+`define USBFS_DESCRIPTOR_ROM
+
+// Descriptor tables served by descriptor_engine, with the same interface as
+// single_port_rom: doa is registered and follows addra a clock behind
+//
+// The ROM starts with a directory of 6 byte entries, ended by an entry of
+// type 0:
+//   bDescriptorType, descriptor index, offset (LE16), length (LE16)
+// Offsets are byte addresses in the ROM. A configuration descriptor's length
+// is its wTotalLength, so the interfaces and endpoints are served with it
+module descriptor_rom(
+    input logic clk,
+    input logic [9:0]addra,
+    output logic [7:0]doa
+);
+
+localparam ROM_BYTES = 262;
+localparam ADDR_BITS = $clog2(ROM_BYTES);
+
+localparam logic [7:0] ROM [ROM_BYTES] = '{
+    // Directory
+    8'h01, 8'h00, 8'h24, 8'h00, 8'h12, 8'h00,  // device 0 at 36, 18 bytes
+    8'h02, 8'h00, 8'h36, 8'h00, 8'h20, 8'h00,  // configuration 0 at 54, 32 bytes
+    8'h03, 8'h00, 8'h56, 8'h00, 8'h04, 8'h00,  // string 0 at 86, 4 bytes
+    8'h03, 8'h01, 8'h5a, 8'h00, 8'h40, 8'h00,  // string 1 at 90, 64 bytes
+    8'h03, 8'h02, 8'h9a, 8'h00, 8'h6c, 8'h00,  // string 2 at 154, 108 bytes
+    8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00,  // End of the directory
+
+    // DEVICE
+    8'h12,              // bLength
+    8'h01,              // bDescriptorType
+    8'h10, 8'h01,       // bcdUSB 1.10
+    8'h00,              // bDeviceClass
+    8'h00,              // bDeviceSubClass
+    8'h00,              // bDeviceProtocol
+    8'h40,              // bMaxPacketSize0, MAX_PACKET of descriptor_engine
+    8'h83, 8'h04,       // idVendor
+    8'h2a, 8'h57,       // idProduct
+    8'h00, 8'h01,       // bcdDevice
+    8'h00,              // iManufacturer
+    8'h01,              // iProduct
+    8'h00,              // iSerialNumber
+    8'h01,              // bNumConfigurations
+
+    // CONFIGURATION, with its interface and endpoints
+    8'h09,              // bLength
+    8'h02,              // bDescriptorType
+    8'h20, 8'h00,       // wTotalLength
+    8'h01,              // bNumInterfaces
+    8'h01,              // bConfigurationValue
+    8'h00,              // iConfiguration
+    8'h80,              // bmAttributes, bus powered
+    8'h32,              // bMaxPower, 100 mA
+    8'h09,              // INTERFACE bLength
+    8'h04,              // bDescriptorType
+    8'h00,              // bInterfaceNumber
+    8'h00,              // bAlternateSetting
+    8'h02,              // bNumEndpoints
+    8'hff,              // bInterfaceClass, vendor specific
+    8'h00,              // bInterfaceSubClass
+    8'h00,              // bInterfaceProtocol
+    8'h02,              // iInterface
+    8'h07,              // ENDPOINT bLength
+    8'h05,              // bDescriptorType
+    8'h01,              // bEndpointAddress, OUT 1
+    8'h02,              // bmAttributes, bulk
+    8'h40, 8'h00,       // wMaxPacketSize
+    8'h00,              // bInterval
+    8'h07,              // ENDPOINT bLength
+    8'h05,              // bDescriptorType
+    8'h82,              // bEndpointAddress, IN 2
+    8'h02,              // bmAttributes, bulk
+    8'h40, 8'h00,       // wMaxPacketSize
+    8'h00,              // bInterval
+
+    // STRING 0, supported languages
+    8'h04,              // bLength
+    8'h03,              // bDescriptorType
+    8'h09, 8'h04,       // wLANGID[0], US English
+
+    // STRING 1, iProduct. Exactly one packet long
+    8'h40,              // bLength
+    8'h03,              // bDescriptorType
+    8'h75, 8'h00, 8'h73, 8'h00, 8'h62, 8'h00, 8'h66, 8'h00,  // "usbf"
+    8'h73, 8'h00, 8'h20, 8'h00, 8'h55, 8'h00, 8'h53, 8'h00,  // "s US"
+    8'h42, 8'h00, 8'h20, 8'h00, 8'h31, 8'h00, 8'h2e, 8'h00,  // "B 1."
+    8'h31, 8'h00, 8'h20, 8'h00, 8'h66, 8'h00, 8'h75, 8'h00,  // "1 fu"
+    8'h6c, 8'h00, 8'h6c, 8'h00, 8'h20, 8'h00, 8'h73, 8'h00,  // "ll s"
+    8'h70, 8'h00, 8'h65, 8'h00, 8'h65, 8'h00, 8'h64, 8'h00,  // "peed"
+    8'h20, 8'h00, 8'h64, 8'h00, 8'h65, 8'h00, 8'h76, 8'h00,  // " dev"
+    8'h69, 8'h00, 8'h63, 8'h00, 8'h65, 8'h00,                // "ice"
+
+    // STRING 2, iInterface. Two packets long
+    8'h6c,              // bLength
+    8'h03,              // bDescriptorType
+    8'h42, 8'h00, 8'h75, 8'h00, 8'h6c, 8'h00, 8'h6b, 8'h00,  // "Bulk"
+    8'h20, 8'h00, 8'h64, 8'h00, 8'h61, 8'h00, 8'h74, 8'h00,  // " dat"
+    8'h61, 8'h00, 8'h20, 8'h00, 8'h69, 8'h00, 8'h6e, 8'h00,  // "a in"
+    8'h74, 8'h00, 8'h65, 8'h00, 8'h72, 8'h00, 8'h66, 8'h00,  // "terf"
+    8'h61, 8'h00, 8'h63, 8'h00, 8'h65, 8'h00, 8'h2c, 8'h00,  // "ace,"
+    8'h20, 8'h00, 8'h4f, 8'h00, 8'h55, 8'h00, 8'h54, 8'h00,  // " OUT"
+    8'h20, 8'h00, 8'h65, 8'h00, 8'h6e, 8'h00, 8'h64, 8'h00,  // " end"
+    8'h70, 8'h00, 8'h6f, 8'h00, 8'h69, 8'h00, 8'h6e, 8'h00,  // "poin"
+    8'h74, 8'h00, 8'h20, 8'h00, 8'h31, 8'h00, 8'h20, 8'h00,  // "t 1 "
+    8'h61, 8'h00, 8'h6e, 8'h00, 8'h64, 8'h00, 8'h20, 8'h00,  // "and "
+    8'h49, 8'h00, 8'h4e, 8'h00, 8'h20, 8'h00, 8'h65, 8'h00,  // "IN e"
+    8'h6e, 8'h00, 8'h64, 8'h00, 8'h70, 8'h00, 8'h6f, 8'h00,  // "ndpo"
+    8'h69, 8'h00, 8'h6e, 8'h00, 8'h74, 8'h00, 8'h20, 8'h00,  // "int "
+    8'h32, 8'h00                                             // "2"
+};
+
+always_ff @(posedge clk)
+    doa <= addra < ROM_BYTES ? ROM[addra[ADDR_BITS-1:0]] : 0;
+
+endmodule
+
+`endif
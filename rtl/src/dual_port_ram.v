@@ -1,14 +1,23 @@
+`ifndef USBFS_DUAL_PORT_RAM
+`define USBFS_DUAL_PORT_RAM
 
-module simple_dual_port(
+// Simple dual port RAM: port a writes, port b reads with a clock of latency
+module simple_dual_port #(
+    parameter ADDR_WIDTH = 10,
+    parameter DATA_WIDTH = 8
+) (
     input clk,
     input ena,enb,
     input wea,
-    input [9:0]addra,addrb
-    input [7:0]dia,dob
+    input [ADDR_WIDTH-1:0]addra,addrb,
+    input [DATA_WIDTH-1:0]dia,
+    output [DATA_WIDTH-1:0]dob
 );
 
-reg [7:0] ram [1023:0];
-reg [7:0] doa,dob;
+reg [DATA_WIDTH-1:0] ram [(1<<ADDR_WIDTH)-1:0];
+reg [DATA_WIDTH-1:0] dob_reg;
+
+assign dob = dob_reg;
 
 always @(posedge clk) begin
     if (ena) begin
@@ -19,7 +28,9 @@ end
 
 always @(posedge clk) begin
     if (enb)
-        dob <= ram[addrb];
+        dob_reg <= ram[addrb];
 end
 
-endmodule
\ No newline at end of file
+endmodule
+
+`endif // USBFS_DUAL_PORT_RAM
@@ -1,5 +1,6 @@
 
 `include "types.sv"
+`include "descriptor_engine.sv"
 
 module ep0_handler(
     input logic reset, clk48,
@@ -16,7 +17,24 @@ module ep0_handler(
     input logic data_in_valid,
 
     output Handshake handshake_out,
-    output logic handshake_out_valid
+    output logic handshake_out_valid,
+
+    output Pid data_out_pid,
+    output logic [7:0]data_out,
+    output logic data_out_last,
+    output logic data_out_empty,
+    output logic data_out_valid,
+    input logic data_out_ack,
+
+    // Device state set by standard requests. Tokens to other addresses are
+    // ignored, halted bulk endpoints STALL, and toggle_reset restarts an
+    // endpoint's data toggle at DATA0
+    output logic [6:0]device_address,
+    output logic configured,
+    output logic ep1_halt,
+    output logic ep2_halt,
+    output logic ep1_toggle_reset,
+    output logic ep2_toggle_reset
 );
 
 typedef enum {
@@ -34,7 +52,34 @@ typedef enum {
     CTRL_NODATA_STATUS
 } CtrlState;
 
-CtrlState ctrl_state;
+CtrlState ctrl_state /*verilator public_flat_rd*/;
+
+// Token of the current transaction, latched the clock after txn_active
+// rises while the decoder still holds the PID
+logic txn_active_last;
+Pid txn_pid;
+logic txn_start;
+logic txn_end;
+assign txn_start = txn_active && !txn_active_last;
+assign txn_end = !txn_active && txn_active_last;
+
+always_ff @(posedge clk48) begin
+    if (reset) begin
+        txn_active_last <= 0;
+        txn_pid <= PID_INVALID;
+    end else begin
+        txn_active_last <= txn_active;
+        if (txn_start)
+            txn_pid <= pid;
+        else if (!txn_active)
+            txn_pid <= PID_INVALID;
+        else
+            txn_pid <= txn_pid;
+    end
+end
+
+logic setup_start;
+assign setup_start = txn_start && pid == PID_SETUP;
 
 logic sb_reset;
 logic sb_write_en;
@@ -47,7 +92,7 @@ logic [15:0]sb_wValue;
 logic [15:0]sb_wIndex;
 logic [15:0]sb_wLength;
 
-assign sb_reset = ctrl_state == CTRL_IDLE || reset;
+assign sb_reset = ctrl_state == CTRL_IDLE || setup_start || reset;
 assign sb_write_en = ctrl_state == CTRL_SETUP_DATA;
 
 setup_buffer sb0(.reset(sb_reset),
@@ -63,20 +108,299 @@ setup_buffer sb0(.reset(sb_reset),
                  .wIndex(sb_wIndex),
                  .wLength(sb_wLength));
 
-// Always ACK any transaction in a control transfer
-// The transaction SM handles Data Error conditions
-assign handshake_out = HANDSHAKE_ACK;
-assign handshake_out_valid = ctrl_state == CTRL_SETUP_HANDSHAKE;
-
+// The status stage completed in this transaction: the host's zero length
+// OUT was received, or it ACKed our zero length IN
+logic status_done;
 always_ff @(posedge clk48) begin
     if (reset)
-        ctrl_state <= CTRL_IDLE;
+        status_done <= 0;
     else
+        if (!txn_active)
+            status_done <= 0;
+        else if ((txn_pid == PID_OUT && data_complete) ||
+                 (txn_pid == PID_IN && handshake_complete && pid == PID_ACK &&
+                  ctrl_state != CTRL_IN_DATA))
+            status_done <= 1;
+        else
+            status_done <= status_done;
+end
+
+// Standard requests completed here. wIndex of the endpoint requests is the
+// endpoint address, ep0 being 0x00 or 0x80
+localparam EP1_OUT_ADDR = 16'h0001;
+localparam EP2_IN_ADDR = 16'h0082;
+localparam FEATURE_ENDPOINT_HALT = 16'h0000;
+
+logic std_request;
+logic std_htd;
+logic std_dth;
+assign std_request = sb_bmRequestTypeType == REQ_TYPE_TYPE_STANDARD;
+assign std_htd = std_request && sb_bmRequestTypeDPTD == REQ_TYPE_DIR_HTD;
+assign std_dth = std_request && sb_bmRequestTypeDPTD == REQ_TYPE_DIR_DTH;
+
+logic to_device;
+logic to_interface;
+logic to_endpoint;
+assign to_device = sb_bmRequestTypeRecipient == REQ_TYPE_RECIPIENT_DEVICE;
+assign to_interface = sb_bmRequestTypeRecipient == REQ_TYPE_RECIPIENT_INTERFACE &&
+                      sb_wIndex == 0;
+assign to_endpoint = sb_bmRequestTypeRecipient == REQ_TYPE_RECIPIENT_ENDPOINT &&
+                     (sb_wIndex == 16'h0000 ||
+                      sb_wIndex == 16'h0080 ||
+                      sb_wIndex == EP1_OUT_ADDR ||
+                      sb_wIndex == EP2_IN_ADDR);
+
+logic get_descriptor;
+logic get_status;
+logic get_configuration;
+logic set_address;
+logic set_configuration;
+logic clear_halt;
+logic set_halt;
+assign get_descriptor = std_dth && to_device && sb_bRequest == REQ_GET_DESCRIPTOR;
+assign get_status = std_dth && (to_device || to_interface || to_endpoint) &&
+                    sb_bRequest == REQ_GET_STATUS;
+assign get_configuration = std_dth && to_device && sb_bRequest == REQ_GET_CONFIGURATION;
+assign set_address = std_htd && to_device && sb_bRequest == REQ_SET_ADDRESS &&
+                     sb_wValue < 128 && sb_wIndex == 0;
+// The one configuration, or back to the address state
+assign set_configuration = std_htd && to_device && sb_bRequest == REQ_SET_CONFIGURATION &&
+                           sb_wValue <= 1;
+assign clear_halt = std_htd && to_endpoint && sb_bRequest == REQ_CLEAR_FEATURE &&
+                    sb_wValue == FEATURE_ENDPOINT_HALT;
+assign set_halt = std_htd && to_endpoint && sb_bRequest == REQ_SET_FEATURE &&
+                  sb_wValue == FEATURE_ENDPOINT_HALT;
+
+// Requests without a data stage take effect once their status stage
+// completes, SET_ADDRESS as the spec requires and the others alike. The
+// halt feature of ep0 is accepted and ignored
+logic nodata_supported;
+logic nodata_apply;
+assign nodata_supported = set_address ||
+                          set_configuration ||
+                          clear_halt ||
+                          set_halt;
+assign nodata_apply = ctrl_state == CTRL_NODATA_STATUS &&
+                      txn_end &&
+                      status_done &&
+                      nodata_supported;
+
+always_ff @(posedge clk48) begin
+    if (reset || bus_reset) begin
+        device_address <= 0;
+        configured <= 0;
+        ep1_halt <= 0;
+        ep2_halt <= 0;
+    end else if (nodata_apply) begin
+        if (set_address)
+            device_address <= sb_wValue[6:0];
+        if (set_configuration) begin
+            configured <= sb_wValue[0];
+            ep1_halt <= 0;
+            ep2_halt <= 0;
+        end
+        if ((clear_halt || set_halt) && sb_wIndex == EP1_OUT_ADDR)
+            ep1_halt <= set_halt;
+        if ((clear_halt || set_halt) && sb_wIndex == EP2_IN_ADDR)
+            ep2_halt <= set_halt;
+    end
+end
+
+// SET_CONFIGURATION and CLEAR_FEATURE(ENDPOINT_HALT) restart the data toggle
+assign ep1_toggle_reset = nodata_apply &&
+                          (set_configuration || (clear_halt && sb_wIndex == EP1_OUT_ADDR));
+assign ep2_toggle_reset = nodata_apply &&
+                          (set_configuration || (clear_halt && sb_wIndex == EP2_IN_ADDR));
+
+// An IN of the data stage starts, and the host ACKed its data
+logic data_txn_start;
+logic data_acked;
+assign data_txn_start = ctrl_state == CTRL_IN_DATA &&
+                        txn_start &&
+                        pid == PID_IN;
+assign data_acked = ctrl_state == CTRL_IN_DATA &&
+                    txn_active &&
+                    txn_pid == PID_IN &&
+                    handshake_complete &&
+                    pid == PID_ACK;
+
+// GET_STATUS and GET_CONFIGURATION data stages, a single DATA1 of up to
+// wLength bytes of the reply. Device status is bus powered without remote
+// wakeup, and interface status is reserved, so both are 0
+logic reply_valid;
+logic [15:0]reply;
+logic [1:0]reply_len;
+logic [1:0]reply_count;
+logic reply_done;
+
+assign reply_valid = get_status || get_configuration;
+
+always_comb begin
+    reply = 0;
+    reply_len = 2;
+    if (get_configuration) begin
+        reply = {15'b0, configured};
+        reply_len = 1;
+    end else if (sb_bmRequestTypeRecipient == REQ_TYPE_RECIPIENT_ENDPOINT)
+        reply = {15'b0, (sb_wIndex == EP1_OUT_ADDR && ep1_halt) ||
+                        (sb_wIndex == EP2_IN_ADDR && ep2_halt)};
+    if (sb_wLength < reply_len)
+        reply_len = sb_wLength[1:0];
+end
+
+always_ff @(posedge clk48) begin
+    if (reset || bus_reset || setup_start) begin
+        reply_count <= 0;
+        reply_done <= 0;
+    end else if (data_txn_start)
+        reply_count <= 0;
+    else if (data_out_ack && ctrl_state == CTRL_IN_DATA)
+        reply_count <= reply_count + 1;
+    else if (data_acked && reply_valid)
+        reply_done <= 1;
+end
+
+// GET_DESCRIPTOR data stages. The lookup runs while the SETUP is ACKed, so
+// it is long done by the first IN of a full speed host; one that comes
+// sooner is NAKed to its end, as its packet is placed when it starts
+logic desc_lookup;
+logic desc_busy;
+logic desc_early;
+logic desc_found;
+logic desc_done;
+
+Pid desc_data_pid;
+logic [7:0]desc_data;
+logic desc_data_last;
+logic desc_data_empty;
+
+assign desc_lookup = ctrl_state == CTRL_SETUP_DATA &&
+                     txn_active &&
+                     data_complete &&
+                     get_descriptor;
+
+descriptor_engine desc0(.reset(reset || bus_reset || setup_start),
+                        .clk48(clk48),
+                        .lookup(desc_lookup),
+                        .wValue(sb_wValue),
+                        .wLength(sb_wLength),
+                        .busy(desc_busy),
+                        .found(desc_found),
+                        .done(desc_done),
+                        .txn_start(data_txn_start),
+                        .acked(data_acked),
+                        .data_out_pid(desc_data_pid),
+                        .data_out(desc_data),
+                        .data_out_last(desc_data_last),
+                        .data_out_empty(desc_data_empty),
+                        .data_out_ack(data_out_ack && ctrl_state == CTRL_IN_DATA));
+
+always_ff @(posedge clk48) begin
+    if (reset || !txn_active)
+        desc_early <= 0;
+    else if (data_txn_start)
+        desc_early <= desc_busy;
+end
+
+// Responses to the current token. A request not completed here is STALLed
+// until the next SETUP, in its data stage or else its status stage. A
+// status stage IN is answered with a zero length DATA1
+always_comb begin
+    handshake_out = HANDSHAKE_NONE;
+    handshake_out_valid = 0;
+    data_out_valid = 0;
+
+    case (ctrl_state)
+        CTRL_SETUP_HANDSHAKE: begin
+            // Always ACK a SETUP. The transaction SM handles Data Error
+            // conditions
+            handshake_out = HANDSHAKE_ACK;
+            handshake_out_valid = 1;
+        end
+        CTRL_IN_DATA:
+            if (txn_pid == PID_IN) begin
+                if (desc_busy || desc_early) begin
+                    handshake_out = HANDSHAKE_NAK;
+                    handshake_out_valid = 1;
+                end else if (desc_found || reply_valid)
+                    data_out_valid = 1;
+                else begin
+                    handshake_out = HANDSHAKE_STALL;
+                    handshake_out_valid = 1;
+                end
+            end else if (txn_pid == PID_OUT) begin
+                // The host ended the data stage early
+                handshake_out = HANDSHAKE_ACK;
+                handshake_out_valid = 1;
+            end
+        CTRL_IN_STATUS:
+            if (txn_pid == PID_IN) begin
+                handshake_out = HANDSHAKE_STALL;
+                handshake_out_valid = 1;
+            end else if (txn_pid == PID_OUT) begin
+                handshake_out = HANDSHAKE_ACK;
+                handshake_out_valid = 1;
+            end
+        CTRL_OUT_DATA:
+            if (txn_pid == PID_IN ||
+                txn_pid == PID_OUT) begin
+                handshake_out = HANDSHAKE_STALL;
+                handshake_out_valid = 1;
+            end
+        CTRL_OUT_STATUS:
+            if (txn_pid == PID_IN)
+                data_out_valid = 1;
+            else if (txn_pid == PID_OUT) begin
+                handshake_out = HANDSHAKE_STALL;
+                handshake_out_valid = 1;
+            end
+        CTRL_NODATA_STATUS:
+            if (txn_pid == PID_IN && nodata_supported)
+                data_out_valid = 1;
+            else if (txn_pid == PID_IN || txn_pid == PID_OUT) begin
+                handshake_out = HANDSHAKE_STALL;
+                handshake_out_valid = 1;
+            end
+        default:
+            // No control transfer in progress
+            if (txn_pid == PID_IN ||
+                txn_pid == PID_OUT) begin
+                handshake_out = HANDSHAKE_NAK;
+                handshake_out_valid = 1;
+            end
+    endcase
+end
+
+always_comb begin
+    if (ctrl_state == CTRL_IN_DATA && desc_found) begin
+        data_out_pid = desc_data_pid;
+        data_out = desc_data;
+        data_out_last = desc_data_last;
+        data_out_empty = desc_data_empty;
+    end else if (ctrl_state == CTRL_IN_DATA) begin
+        data_out_pid = PID_DATA1;
+        data_out = reply_count == 0 ? reply[7:0] : reply[15:8];
+        data_out_last = reply_count == reply_len - 1;
+        data_out_empty = reply_len == 0;
+    end else begin
+        data_out_pid = PID_DATA1;
+        data_out = 0;
+        data_out_last = 1;
+        data_out_empty = 1;
+    end
+end
+
+always_ff @(posedge clk48) begin
+    if (reset || bus_reset)
+        ctrl_state <= CTRL_IDLE;
+    else if (setup_start)
+        // A SETUP always starts a new control transfer
+        ctrl_state <= CTRL_SETUP_DATA;
+    else begin
         ctrl_state <= ctrl_state;
         case (ctrl_state)
             CTRL_IDLE:
-                if (txn_active && pid == PID_SETUP)
-                    ctrl_state <= CTRL_SETUP_DATA;
+                ctrl_state <= CTRL_IDLE;
             CTRL_SETUP_DATA:
                 if (txn_active && data_complete)
                     ctrl_state <= CTRL_SETUP_HANDSHAKE;
@@ -84,7 +408,6 @@ always_ff @(posedge clk48) begin
                     ctrl_state <= CTRL_IDLE;
             CTRL_SETUP_HANDSHAKE:
                 if (!txn_active)
-                    // TODO: Go to write or read states
                     if (sb_wLength == 0)
                         ctrl_state <= CTRL_NODATA_STATUS;
                     else
@@ -92,17 +415,22 @@ always_ff @(posedge clk48) begin
                             ctrl_state <= CTRL_OUT_DATA;
                         else
                             ctrl_state <= CTRL_IN_DATA;
-            default:
-                ctrl_state <= CTRL_IDLE;
-            /*
             CTRL_IN_DATA:
-            CTRL_IN_STATUS:
-            CTRL_OUT_DATA:
-            CTRL_OUT_STATUS:
+                if (txn_end && (desc_done || reply_done))
+                    ctrl_state <= CTRL_IN_STATUS;
+                else if (txn_end && status_done)
+                    ctrl_state <= CTRL_IDLE;
+            CTRL_IN_STATUS,
+            CTRL_OUT_STATUS,
             CTRL_NODATA_STATUS:
-            */
+                if (txn_end && status_done)
+                    ctrl_state <= CTRL_IDLE;
+            CTRL_OUT_DATA:
+                ctrl_state <= CTRL_OUT_DATA;
+            default:
+                ctrl_state <= CTRL_IDLE;
         endcase
+    end
 end
 
 endmodule
-
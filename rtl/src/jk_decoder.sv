@@ -12,33 +12,78 @@ module jk_decoder (
 typedef enum {IDLE, SOP, SYNC, PAYLOAD, EOP} DecoderState;
 
 DecoderState decoder_state_next;
-DecoderState decoder_state;
+DecoderState decoder_state /*verilator public_flat_rd*/;
 
 localparam SAMPLE_CLK_PERIOD_FS = 4;
 
-logic [2:0]sample_counter, sample_counter_next;
-assign sample_counter_next = (decoder_state == IDLE ||
-                              decoder_state == EOP) ? 0 :
-                             decoder_state == SOP ? 2 :
-                             sample_counter < (SAMPLE_CLK_PERIOD_FS - 1) ? sample_counter + 1 :
-                                                                           0;
+// Phase within the bit of the bus_state_in taken on the next clock, 0 being
+// the first clock of its level. The bit is voted on from the
+// clocks at phases 1 to 3. SOP takes phase 2 of the first K
+logic [1:0]sample_counter, sample_counter_next;
+
+// Edge tracking. An edge seen a clock late stretches the current bit by
+// repeating phase 2, one seen a clock early shrinks the next bit by skipping
+// it. Either moves the sample points a clock, so they stay centred on bits
+// from a host a little off 12 Mbit/s. An edge at phase 2 is ambiguous and
+// left alone, as one in a bit of jitter would be
+logic bus_edge;
+logic dpll_stretch, dpll_stretch_next;
+logic dpll_shrink, dpll_shrink_next;
+
+always_comb begin
+    sample_counter_next = sample_counter + 1;
+    dpll_stretch_next = dpll_stretch;
+    dpll_shrink_next = dpll_shrink;
+
+    case (decoder_state)
+        IDLE, EOP: begin
+            sample_counter_next = 0;
+            dpll_stretch_next = 0;
+            dpll_shrink_next = 0;
+        end
+
+        SOP: sample_counter_next = SAMPLE_CLK_PERIOD_FS - 1;
+
+        default: begin
+            if (bus_edge && sample_counter == 1)
+                dpll_stretch_next = 1;
+            if (bus_edge && sample_counter == 3)
+                dpll_shrink_next = 1;
+
+            if (sample_counter == 1 && dpll_shrink) begin
+                sample_counter_next = 3;
+                dpll_shrink_next = 0;
+            end else if (sample_counter == 2 && dpll_stretch) begin
+                sample_counter_next = 2;
+                dpll_stretch_next = 0;
+            end
+        end
+    endcase
+end
 
 typedef enum logic [1:0] {SAMPLE_IDLE, SAMPLE_TAKE, SAMPLE_PROCESS, SAMPLE_PRESENT} SampleState;
 
+// The bit is taken with its last vote, and bit stuffing and the output
+// follow over the first two clocks of the next bit. Edge tracking never
+// repeats or skips any of the three
 SampleState sample_state;
-assign sample_state = sample_counter == 0 ? SAMPLE_TAKE :
-                      sample_counter == 1 ? SAMPLE_PROCESS :
-                      sample_counter == 2 ? SAMPLE_PRESENT :
+assign sample_state = sample_counter == 3 ? SAMPLE_TAKE :
+                      sample_counter == 0 ? SAMPLE_PROCESS :
+                      sample_counter == 1 ? SAMPLE_PRESENT :
                                             SAMPLE_IDLE;
 
 always_ff @(posedge clk48) begin
-    if (reset)
+    if (reset) begin
         sample_counter <= 0;
-    else
+        dpll_stretch <= 0;
+        dpll_shrink <= 0;
+    end else begin
         sample_counter <= sample_counter_next;
+        dpll_stretch <= dpll_stretch_next;
+        dpll_shrink <= dpll_shrink_next;
+    end
 end
 
-// TODO: Sample three times during the waveform and vote on the bit
 logic should_sample;
 always_comb begin
     if (reset)
@@ -61,21 +106,55 @@ assign bus_state_in = dp == 'b0 && dn == 'b0 ? BUS_IDLE :
                       dp == 'b0 && dn == 'b1 ? BUS_K :
                       BUS_INVALID;
 
+BusState bus_state_last;
+assign bus_edge = bus_state_in != bus_state_last;
+
+// Votes from phases 1 and 2. Phase 1 also stands in for a skipped phase 2
+BusState vote_early, vote_mid;
+BusState bus_state_voted;
+assign bus_state_voted = vote_early == vote_mid ? vote_early :
+                         vote_early == bus_state_in ? vote_early :
+                                                      vote_mid;
+
+always_ff @(posedge clk48) begin
+    if (reset) begin
+        bus_state_last <= BUS_IDLE;
+        vote_early <= BUS_IDLE;
+        vote_mid <= BUS_IDLE;
+    end else begin
+        bus_state_last <= bus_state_in;
+        if (decoder_state != SYNC && decoder_state != PAYLOAD) begin
+            vote_early <= bus_state_in;
+            vote_mid <= bus_state_in;
+        end else if (sample_counter == 1) begin
+            vote_early <= bus_state_in;
+            vote_mid <= bus_state_in;
+        end else if (sample_counter == 2)
+            vote_mid <= bus_state_in;
+    end
+end
+
 BusState sampled_bus_state;
 BusState last_sampled_bus_state;
 
-// Sample the bus_state_in when requested by the decoder state
+// Sample the bus_state_in when requested by the decoder state. The first K
+// is sampled again as the first bit of SYNC, once it has been voted on
 always_ff @(posedge clk48) begin
     if (reset) begin
         sampled_bus_state <= BUS_IDLE;
         last_sampled_bus_state <= BUS_IDLE;
     end else begin
-        if (should_sample) begin
-            sampled_bus_state <= bus_state_in;
-            if (decoder_state == SYNC || decoder_state == PAYLOAD)
+        if (decoder_state == SOP) begin
+            sampled_bus_state <= BUS_IDLE;
+            last_sampled_bus_state <= BUS_IDLE;
+        end else if (should_sample) begin
+            if (decoder_state == SYNC || decoder_state == PAYLOAD) begin
+                sampled_bus_state <= bus_state_voted;
                 last_sampled_bus_state <= sampled_bus_state;
-            else
+            end else begin
+                sampled_bus_state <= bus_state_in;
                 last_sampled_bus_state <= BUS_IDLE;
+            end
         end else begin
             sampled_bus_state <= sampled_bus_state;
             last_sampled_bus_state <= last_sampled_bus_state;
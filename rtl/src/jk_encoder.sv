@@ -12,7 +12,7 @@ module jk_encoder (
 
 typedef enum logic[1:0] {SYNC, PAYLOAD, EOP, COMPLETE} EncoderState;
 
-EncoderState encoder_state;
+EncoderState encoder_state /*verilator public_flat_rd*/;
 
 typedef enum logic[1:0] {WRITE_IDLE, WRITE_SE0, WRITE_J, WRITE_K} OutputState;
 
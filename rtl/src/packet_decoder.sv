@@ -19,8 +19,8 @@ module packet_decoder (
     output packet_eop
 );
 
-logic bus_bit_out;
-logic bus_bit_valid;
+logic bus_bit_out /*verilator public_flat_rd*/;
+logic bus_bit_valid /*verilator public_flat_rd*/;
 logic bus_bit_reset;
 logic bus_bit_sop;
 logic bus_bit_eop;
@@ -51,15 +51,9 @@ USBCRC5 crc5calc(.data_in(bus_bit_out),
                  .rst(crc_reset),
                  .clk(clk48));
 
-USBCRC16 crc16calc(.data_in(bus_bit_out),
-                   .crc_en(bus_bit_valid),
-                   .crc_out(crc16),
-                   .rst(crc_reset),
-                   .clk(clk48));
-
 typedef enum {WAIT, PID, PAYLOAD, EOP, COMPLETE} PacketState;
 
-PacketState packet_state;
+PacketState packet_state /*verilator public_flat_rd*/;
 
 
 logic [7:0]pid_buffer;
@@ -188,6 +182,25 @@ end
 localparam CRC5_RESIDUAL = 'hC;
 localparam CRC16_RESIDUAL = 'h800D;
 
+// The CRC16 is taken a byte at a time from the byte strobe, so it is only
+// enabled one clock in 32. Its residue is checked into a register, settled
+// a few clocks before EOP, which keeps the wide compare off packet_good.
+// Trailing bits short of a byte fail it, as they would the CRC
+USBCRC16_8 crc16calc(.data_in(byte_buffer),
+                     .crc_en(byte_valid),
+                     .crc_out(crc16),
+                     .rst(crc_reset),
+                     .clk(clk48));
+
+logic crc16_good /*verilator public_flat_rd*/;
+always_ff @(posedge clk48) begin
+    if (reset || crc_reset)
+        crc16_good <= 0;
+    else
+        crc16_good <= crc16 == CRC16_RESIDUAL &&
+                      byte_counter == 0;
+end
+
 logic crc_valid;
 
 always @(*) begin
@@ -203,7 +216,7 @@ always @(*) begin
 
         PID_DATA0,
         PID_DATA1: begin
-        crc_valid = crc16 == CRC16_RESIDUAL;
+        crc_valid = crc16_good;
         end
 
         PID_ACK,
@@ -8,6 +8,8 @@ module packet_encoder (
     input Pid pid,
     input [7:0]byte_in,
     input last_byte,
+    // Zero length DATA packet: the CRC follows the PID
+    input empty,
     output byte_ack,
     output dp, dn,
     output done
@@ -15,7 +17,7 @@ module packet_encoder (
 
 typedef enum logic[2:0] {PID, PAYLOAD, CRC_START, CRC, COMPLETE} EncoderState;
 
-EncoderState encoder_state;
+EncoderState encoder_state /*verilator public_flat_rd*/;
 
 logic jk_bit_out;
 logic jk_bit_ack;
@@ -144,6 +146,8 @@ always_ff @(posedge clk48) begin
             if (byte_counter == 7 && jk_bit_ack)
                 if (pid_is_handshake)
                     encoder_state <= COMPLETE;
+                else if (empty)
+                    encoder_state <= CRC_START;
                 else
                     encoder_state <= PAYLOAD;
         PAYLOAD:
@@ -26,9 +26,9 @@ assign bmRequestTypeRecipient = SetupRequestTypeRecipient'(buffer[0][4:0]);
 
 assign bRequest = SetupRequest'(buffer[1]);
 
-assign wValue = {buffer[3] << 8, buffer[2]};
-assign wIndex = {buffer[5] << 8, buffer[4]};
-assign wLength = {buffer[7] << 8, buffer[6]};
+assign wValue = {buffer[3], buffer[2]};
+assign wIndex = {buffer[5], buffer[4]};
+assign wLength = {buffer[7], buffer[6]};
 
 always @(posedge clk) begin
 
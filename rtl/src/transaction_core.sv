@@ -0,0 +1,413 @@
+`include "types.sv"
+`include "ep0_handler.sv"
+`include "bulk_out_endpoint.sv"
+`include "bulk_in_endpoint.sv"
+
+// Transaction and endpoint logic of transaction_sm, fed by the
+// packet_decoder output interface. As a Verilator top it lets protocol
+// tests inject decoded packets a byte at a time and skip the PHY
+module transaction_core (
+    input logic reset, clk48,
+
+    input logic bus_reset,
+    input logic bus_sop,
+    input logic [7:0]byte_out,
+    input logic byte_out_valid,
+    input Pid packet_pid_out,
+    input logic packet_pid_valid,
+    input logic [6:0]packet_addr,
+    input logic [3:0]packet_endp,
+    input logic [10:0]packet_frame,
+    input logic packet_good,
+    input logic packet_eop,
+
+    // packet_encoder interface. The encoder is held in reset while
+    // tx_active is low and sends a single packet once it is released
+    output logic tx_active,
+    output Pid tx_pid,
+    output logic [7:0]tx_byte,
+    output logic tx_last_byte,
+    output logic tx_empty,
+    input logic tx_byte_ack,
+    input logic tx_done,
+
+    // Endpoint 1 bulk OUT data, see bulk_out_endpoint
+    output logic [7:0]ep1_out_data,
+    output logic ep1_out_valid,
+    input logic ep1_out_ready,
+
+    // Endpoint 2 bulk IN data, see bulk_in_endpoint
+    input logic [7:0]ep2_in_data,
+    input logic ep2_in_valid,
+    output logic ep2_in_ready,
+
+    // The host has selected the configuration, see ep0_handler
+    output logic configured
+);
+
+typedef enum logic [3:0] {
+    TXN_IDLE,
+    TXN_TOKEN,
+
+    TXN_DATA_RECV_WAIT,
+    TXN_DATA_RECV,
+
+    TXN_DATA_SEND_WAIT,
+    TXN_DATA_SEND,
+
+    TXN_HANDSHAKE_SEND_WAIT,
+    TXN_HANDSHAKE_SEND,
+
+    TXN_HANDSHAKE_RECV_WAIT,
+    TXN_HANDSHAKE_RECV
+} TransactionState;
+
+TransactionState txn_state /*verilator public_flat_rd*/;
+
+logic token_complete;
+logic data_complete;
+logic handshake_complete;
+
+assign token_complete     = txn_state == TXN_TOKEN &&
+                            packet_good;
+assign data_complete      = txn_state == TXN_DATA_RECV &&
+                            packet_good;
+assign handshake_complete = txn_state == TXN_HANDSHAKE_RECV &&
+                            packet_good;
+
+// Tokens addressed to another device are ignored, as if they had been
+// corrupted
+logic [6:0]device_address /*verilator public_flat_rd*/;
+logic token_addressed;
+assign token_addressed = packet_addr == device_address;
+
+logic ep1_halt;
+logic ep2_halt;
+logic ep1_toggle_reset;
+logic ep2_toggle_reset;
+
+logic ep0_active;
+
+Handshake ep0_handshake;
+logic ep0_handshake_valid;
+
+Pid ep0_data_pid;
+logic [7:0]ep0_data;
+logic ep0_data_last;
+logic ep0_data_empty;
+logic ep0_data_valid;
+logic ep0_data_ack;
+
+ep0_handler ep0(.reset(reset),
+                .clk48(clk48),
+                .bus_reset(bus_reset),
+                .txn_active(ep0_active),
+                .pid(packet_pid_out),
+                .token_complete(token_complete),
+                .data_complete(data_complete),
+                .handshake_complete(handshake_complete),
+                .data_in(byte_out),
+                .data_in_valid(byte_out_valid),
+                .handshake_out(ep0_handshake),
+                .handshake_out_valid(ep0_handshake_valid),
+                .data_out_pid(ep0_data_pid),
+                .data_out(ep0_data),
+                .data_out_last(ep0_data_last),
+                .data_out_empty(ep0_data_empty),
+                .data_out_valid(ep0_data_valid),
+                .data_out_ack(ep0_data_ack),
+                .device_address(device_address),
+                .configured(configured),
+                .ep1_halt(ep1_halt),
+                .ep2_halt(ep2_halt),
+                .ep1_toggle_reset(ep1_toggle_reset),
+                .ep2_toggle_reset(ep2_toggle_reset));
+
+always_ff @(posedge clk48) begin
+    if (reset)
+        ep0_active <= 0;
+    else
+        if (txn_state == TXN_IDLE)
+            ep0_active <= 0;
+        else if (txn_state == TXN_TOKEN &&
+                 packet_good &&
+                 token_addressed &&
+                 (packet_pid_out == PID_SETUP ||
+                  packet_pid_out == PID_OUT ||
+                  packet_pid_out == PID_IN) &&
+                 packet_endp == 0)
+            ep0_active <= 1;
+        else
+            ep0_active <= ep0_active;
+end
+
+logic ep1_active;
+
+Handshake ep1_handshake;
+logic ep1_handshake_valid;
+
+// Only DATA packet bytes reach the endpoint, not the token's
+logic ep1_data_valid;
+assign ep1_data_valid = txn_state == TXN_DATA_RECV && byte_out_valid;
+
+bulk_out_endpoint ep1(.reset(reset),
+                      .clk48(clk48),
+                      .bus_reset(bus_reset),
+                      .txn_active(ep1_active),
+                      .pid(packet_pid_out),
+                      .data_complete(data_complete),
+                      .halt(ep1_halt),
+                      .toggle_reset(ep1_toggle_reset),
+                      .data_in(byte_out),
+                      .data_in_valid(ep1_data_valid),
+                      .handshake_out(ep1_handshake),
+                      .handshake_out_valid(ep1_handshake_valid),
+                      .out_data(ep1_out_data),
+                      .out_valid(ep1_out_valid),
+                      .out_ready(ep1_out_ready));
+
+always_ff @(posedge clk48) begin
+    if (reset)
+        ep1_active <= 0;
+    else
+        if (txn_state == TXN_IDLE)
+            ep1_active <= 0;
+        else if (txn_state == TXN_TOKEN &&
+                 packet_good &&
+                 token_addressed &&
+                 packet_pid_out == PID_OUT &&
+                 packet_endp == 1)
+            ep1_active <= 1;
+        else
+            ep1_active <= ep1_active;
+end
+
+logic ep2_active;
+
+Handshake ep2_handshake;
+logic ep2_handshake_valid;
+
+Pid ep2_data_pid;
+logic [7:0]ep2_data;
+logic ep2_data_last;
+logic ep2_data_empty;
+logic ep2_data_valid;
+logic ep2_data_ack;
+
+bulk_in_endpoint ep2(.reset(reset),
+                     .clk48(clk48),
+                     .bus_reset(bus_reset),
+                     .txn_active(ep2_active),
+                     .pid(packet_pid_out),
+                     .handshake_complete(handshake_complete),
+                     .halt(ep2_halt),
+                     .toggle_reset(ep2_toggle_reset),
+                     .handshake_out(ep2_handshake),
+                     .handshake_out_valid(ep2_handshake_valid),
+                     .data_out_pid(ep2_data_pid),
+                     .data_out(ep2_data),
+                     .data_out_last(ep2_data_last),
+                     .data_out_empty(ep2_data_empty),
+                     .data_out_valid(ep2_data_valid),
+                     .data_out_ack(ep2_data_ack),
+                     .in_data(ep2_in_data),
+                     .in_valid(ep2_in_valid),
+                     .in_ready(ep2_in_ready));
+
+always_ff @(posedge clk48) begin
+    if (reset)
+        ep2_active <= 0;
+    else
+        if (txn_state == TXN_IDLE)
+            ep2_active <= 0;
+        else if (txn_state == TXN_TOKEN &&
+                 packet_good &&
+                 token_addressed &&
+                 packet_pid_out == PID_IN &&
+                 packet_endp == 2)
+            ep2_active <= 1;
+        else
+            ep2_active <= ep2_active;
+end
+
+// Endpoint responses. A token to an endpoint that does not exist gets
+// none, and the host times out
+Handshake handshake;
+logic handshake_valid;
+logic data_valid;
+assign handshake = ep0_active ? ep0_handshake :
+                   ep1_active ? ep1_handshake :
+                   ep2_active ? ep2_handshake : HANDSHAKE_NONE;
+assign handshake_valid = ep0_active ? ep0_handshake_valid :
+                         ep1_active ? ep1_handshake_valid :
+                         ep2_active ? ep2_handshake_valid : 1;
+assign data_valid = (ep0_active && ep0_data_valid) ||
+                    (ep2_active && ep2_data_valid);
+
+logic [4:0] txn_endp;
+always_ff @(posedge clk48) begin
+    if (reset)
+        txn_endp <= 0;
+    else
+        if (txn_state == TXN_TOKEN &&
+            packet_good)
+            if (packet_pid_out == PID_SETUP)
+                txn_endp <= {1'b0, packet_endp};
+            else if (packet_pid_out == PID_OUT)
+                txn_endp <= {1'b0, packet_endp};
+            else if (packet_pid_out == PID_IN)
+                txn_endp <= {1'b1, packet_endp};
+            else
+                // In the case of a SOF or invalid PID
+                // the txn state machine will transition
+                // back to IDLE
+                txn_endp <= 0;
+        else if (txn_state == TXN_IDLE)
+            txn_endp <= 0;
+        else
+            txn_endp <= txn_endp;
+end
+
+localparam TURN_AROUND_COUNT = 18*4;
+logic [6:0]turn_around_counter;
+
+// Clocks in a SEND_WAIT state before the response is sent. The end of the
+// host's EOP (its first J) reaches a SEND_WAIT state 2 clocks later, the
+// SEND state follows SEND_DELAY_COUNT + 1 clocks after that and the
+// encoder's first SYNC K is on the bus the clock after, 10 clocks (2.5 bit
+// times) after the end of EOP. The USB inter-packet delay is 2 to 7.5 bit
+// times
+localparam SEND_DELAY_COUNT = 6;
+
+always_ff @(posedge clk48) begin
+    if (reset)
+        turn_around_counter <= 0;
+    else
+        if (txn_state == TXN_DATA_RECV_WAIT ||
+            txn_state == TXN_HANDSHAKE_RECV_WAIT ||
+            txn_state == TXN_DATA_SEND_WAIT ||
+            txn_state == TXN_HANDSHAKE_SEND_WAIT)
+            if (turn_around_counter == TURN_AROUND_COUNT)
+                turn_around_counter <= turn_around_counter;
+            else
+                turn_around_counter <= turn_around_counter + 1;
+        else
+            turn_around_counter <= 0;
+end
+
+logic send_ready;
+assign send_ready = turn_around_counter >= SEND_DELAY_COUNT;
+
+// Handshake being sent in TXN_HANDSHAKE_SEND
+Pid send_handshake_pid;
+
+always_ff @(posedge clk48) begin
+    if (reset)
+        send_handshake_pid <= PID_ACK;
+    else
+        if ((txn_state == TXN_DATA_SEND_WAIT ||
+             txn_state == TXN_HANDSHAKE_SEND_WAIT) &&
+            handshake_valid)
+            case (handshake)
+                HANDSHAKE_NAK:
+                    send_handshake_pid <= PID_NAK;
+                HANDSHAKE_STALL:
+                    send_handshake_pid <= PID_STALL;
+                default:
+                    send_handshake_pid <= PID_ACK;
+            endcase
+        else
+            send_handshake_pid <= send_handshake_pid;
+end
+
+assign tx_active = txn_state == TXN_DATA_SEND ||
+                   txn_state == TXN_HANDSHAKE_SEND;
+assign tx_pid = txn_state != TXN_DATA_SEND ? send_handshake_pid :
+                ep2_active ? ep2_data_pid : ep0_data_pid;
+assign tx_byte = ep2_active ? ep2_data : ep0_data;
+assign tx_last_byte = ep2_active ? ep2_data_last : ep0_data_last;
+assign tx_empty = ep2_active ? ep2_data_empty : ep0_data_empty;
+assign ep0_data_ack = txn_state == TXN_DATA_SEND && ep0_active && tx_byte_ack;
+assign ep2_data_ack = txn_state == TXN_DATA_SEND && ep2_active && tx_byte_ack;
+
+always_ff @(posedge clk48) begin
+    if (reset)
+        txn_state <= TXN_IDLE;
+    else
+        txn_state <= txn_state;
+        case (txn_state)
+            TXN_IDLE:
+                if (bus_sop)
+                    txn_state <= TXN_TOKEN;
+            TXN_TOKEN:
+                if (packet_eop)
+                    if (packet_good && token_addressed)
+                        if (packet_pid_out == PID_OUT ||
+                            packet_pid_out == PID_SETUP)
+                            // Device recv during the DATA stage
+                            txn_state <= TXN_DATA_RECV_WAIT;
+                        else if (packet_pid_out == PID_IN)
+                            // Device send during the DATA stage
+                            txn_state <= TXN_DATA_SEND_WAIT;
+                        else
+                            // Not a token packet
+                            txn_state <= TXN_IDLE;
+                    else
+                        // Erroneous packet, or a token for another device
+                        txn_state <= TXN_IDLE;
+
+            TXN_DATA_RECV_WAIT:
+                if (bus_sop)
+                    txn_state <= TXN_DATA_RECV;
+                else if (turn_around_counter == TURN_AROUND_COUNT)
+                    txn_state <= TXN_IDLE;
+
+            TXN_DATA_RECV:
+                if (packet_eop)
+                    if (packet_good)
+                        txn_state <= TXN_HANDSHAKE_SEND_WAIT;
+                    else
+                        // Note: No handshake on an error during the Data stage
+                        txn_state <= TXN_IDLE;
+
+
+            TXN_HANDSHAKE_SEND_WAIT:
+                if (handshake_valid && handshake == HANDSHAKE_NONE)
+                    txn_state <= TXN_IDLE;
+                else if (handshake_valid && send_ready)
+                    txn_state <= TXN_HANDSHAKE_SEND;
+
+            TXN_HANDSHAKE_SEND:
+                if (tx_done)
+                    txn_state <= TXN_IDLE;
+
+            TXN_DATA_SEND_WAIT:
+                if (data_valid && send_ready)
+                    txn_state <= TXN_DATA_SEND;
+                else if (handshake_valid && handshake == HANDSHAKE_NONE)
+                    txn_state <= TXN_IDLE;
+                else if (handshake_valid && send_ready)
+                    // NAK or STALL in place of data
+                    txn_state <= TXN_HANDSHAKE_SEND;
+
+            TXN_DATA_SEND:
+                if (tx_done)
+                    // The host ACKs the data
+                    txn_state <= TXN_HANDSHAKE_RECV_WAIT;
+
+            TXN_HANDSHAKE_RECV_WAIT:
+                if (bus_sop)
+                    txn_state <= TXN_HANDSHAKE_RECV;
+                else if (turn_around_counter == TURN_AROUND_COUNT)
+                    txn_state <= TXN_IDLE;
+            TXN_HANDSHAKE_RECV:
+                if (packet_eop)
+                    txn_state <= TXN_IDLE;
+
+
+            default:
+                txn_state <= TXN_IDLE;
+        endcase
+end
+
+endmodule
@@ -0,0 +1,23 @@
+#include "mod_bench.hpp"
+#include "Vjk_decoder.h"
+
+// A 64 byte DATA0 packet followed by a short idle gap, decoded repeatedly
+template <ModBenchTrace Trace>
+static void BM_JKDecoderDataPacket(benchmark::State& state) {
+    ModBench<ModBenchFixture<UsbModTest, Vjk_decoder, Trace>, Trace> bench(state, "jk_decoder");
+
+    std::vector<uint8_t> data(64, 0xA5);
+    auto states = bus_states(UsbUtils::JKEncoder::create_data_packet(UsbUtils::PID_DATA0, data));
+    states.insert(states.end(), 16, UsbUtils::BUS_J);
+
+    bench->reset();
+
+    for (auto _ : state) {
+        for (auto bus : states) {
+            drive_bus_state(bench->mod.get(), bus);
+            bench->clk();
+        }
+        bench.count_packets(1, data.size());
+    }
+}
+MOD_BENCHMARK(BM_JKDecoderDataPacket);
@@ -1,10 +1,25 @@
 
+#include <filesystem>
+#include <format>
+
+#include <unistd.h>
+
 #include "mod_test.hpp"
 #include "usb_utils.hpp"
+#include "rtl_fsm_states.hpp"
 #include "Vjk_decoder.h"
+#include "Vjk_decoder___024root.h"
 
 
-typedef UsbModTest<Vjk_decoder> JKDecoderTest;
+class JKDecoderTest : public UsbModTest<Vjk_decoder> {
+
+    public:
+    void SetUp() override {
+        UsbModTest::SetUp();
+        profile_fsm("decoder_state", [this] { return mod->rootp->jk_decoder__DOT__decoder_state; },
+                    JK_DECODER_STATES);
+    }
+};
 
 TEST_F(JKDecoderTest, Reset) {
     reset();
@@ -21,13 +36,13 @@ TEST_F(JKDecoderTest, BusIdle) {
     mod->dn = 0;
     mod->dp = 0;
 
-    for (int i = 0; i < (360000-1); i++) {
-        clk();
-        ASSERT_EQ(mod->bit_valid, 0);
-        ASSERT_EQ(mod->bus_reset, 0);
-        ASSERT_EQ(mod->bus_sop, 0);
-        ASSERT_EQ(mod->bus_eop, 0);
-    }
+    bool any_output = run_until([this] {
+        return mod->bit_valid ||
+               mod->bus_reset ||
+               mod->bus_sop ||
+               mod->bus_eop;
+    }, 360000-1);
+    ASSERT_FALSE(any_output);
 
     clk();
     ASSERT_EQ(mod->bit_valid, 0);
@@ -36,9 +51,97 @@ TEST_F(JKDecoderTest, BusIdle) {
     ASSERT_EQ(mod->bus_eop, 0);
 }
 
-void capture_test(JKDecoderTest& tester, std::string capture_fname, std::string decoder_fname) {
+// Drive a packet from the C++ encoder and check the decoded bits against it
+void encoder_test(JKDecoderTest& tester, const std::vector<uint8_t>& exp_pkt) {
+    UsbUtils::JKEncoder encoder(exp_pkt);
+
+    uint8_t in_b = 0;
+    uint32_t in_idx = 0;
+    uint32_t exp_idx = 0;
+
+    while (!encoder.is_complete()) {
+
+        UsbUtils::BusState next_state = encoder.step();
+
+        ASSERT_NE(next_state, UsbUtils::BUS_INVALID);
+        switch (next_state) {
+            case UsbUtils::BUS_SE0:
+                tester.mod->dn = 0;
+                tester.mod->dp = 0;
+                break;
+            case UsbUtils::BUS_J:
+                tester.mod->dn = 0;
+                tester.mod->dp = 1;
+                break;
+            case UsbUtils::BUS_K:
+                tester.mod->dn = 1;
+                tester.mod->dp = 0;
+                break;
+            default:
+                ASSERT_TRUE(false);
+                break;
+        }
+
+        tester.clk();
+
+        if (tester.mod->bit_valid) {
+            in_b |= (tester.mod->bit_out & 1) << in_idx;
+            in_idx++;
+
+            if (in_idx == 8) {
+                ASSERT_LT(exp_idx, exp_pkt.size());
+                ASSERT_EQ(in_b, exp_pkt[exp_idx]);
+                exp_idx++;
+                in_idx = 0;
+                in_b = 0;
+            }
+        }
+    }
+
+    ASSERT_EQ(in_b, 0);
+    ASSERT_EQ(exp_idx, exp_pkt.size());
+    ASSERT_EQ(tester.mod->bus_eop, 1);
+}
+
+// bus_reset() simulates the reset the first time and saves a checkpoint, or
+// restores one saved by an earlier test. Either way the checkpoint then
+// exists, and restoring it after a fresh reset must bring back the clock
+// count and decoder state of the simulated reset, one clock from detecting
+// it. The decoder must then carry on decoding packets
+TEST_F(JKDecoderTest, BusResetCheckpoint) {
+    reset();
+
+    bus_reset();
+    ASSERT_TRUE(has_checkpoint("bus_reset"));
+    const uint64_t reset_clk_cnt = clk_cnt;
+    const uint32_t reset_state = mod->rootp->jk_decoder__DOT__decoder_state;
+    ASSERT_EQ(reset_clk_cnt, 3 + (360000-1));
+    ASSERT_EQ(mod->bus_reset, 0);
+
+    reset();
+    ASSERT_NE(clk_cnt, reset_clk_cnt);
+    ASSERT_TRUE(restore_checkpoint("bus_reset"));
+    ASSERT_EQ(clk_cnt, reset_clk_cnt);
+    ASSERT_EQ(mod->rootp->jk_decoder__DOT__decoder_state, reset_state);
+    ASSERT_EQ(mod->dn, 0);
+    ASSERT_EQ(mod->dp, 0);
+    ASSERT_EQ(mod->bus_reset, 0);
+
+    clk();
+    ASSERT_EQ(mod->bus_reset, 1);
+
+    // Idle J after the reset, then a packet
+    mod->dn = 0;
+    mod->dp = 1;
+    run_cycles(16);
+    encoder_test(*this, {0xFF, 0x00, 0xAA, 0xCF});
+}
+
+void capture_test(JKDecoderTest& tester, std::string capture_fname, std::string decoder_fname,
+                  bool skip_idle = false) {
 
-    std::vector<USBCaptureInput> capture_entries = load_usb_capture(capture_fname);
+    USBCaptureFile capture(capture_fname);
+    ASSERT_TRUE(capture.is_open());
     auto exp_pkts = load_usb_decoder_output(decoder_fname);
     tester.mod->dn = 0;
     tester.mod->dp = 0;
@@ -48,10 +151,24 @@ void capture_test(JKDecoderTest& tester, std::string capture_fname, std::string
     uint32_t exp_idx = 0;
     auto pkt_itr = exp_pkts.begin();
 
-    auto cap_iter = capture_entries.begin();
+    // Pause playback whenever there is decoder output to check
+    auto on_clk = [&tester] {
+        return !tester.mod->bit_valid && !tester.mod->bus_eop;
+    };
+    // Between packets the decoder sits in IDLE on a J bus
+    auto quiescent = [&tester] {
+        return !tester.mod->bus_sop;
+    };
+
+    auto edge = capture.begin();
+
+    while (edge != capture.end()) {
+        if (skip_idle) {
+            edge = tester.play_capture(edge, capture.end(), on_clk, quiescent);
+        } else {
+            edge = tester.play_capture(edge, capture.end(), on_clk);
+        }
 
-    while (cap_iter != capture_entries.end()) {
-        cap_iter = tester.step_capture(cap_iter);
         if (tester.mod->bit_valid) {
             in_b |= (tester.mod->bit_out & 1) << in_idx;
             in_idx++;
@@ -103,69 +220,96 @@ TEST_F(JKDecoderTest, SetupIn) {
                  "bus_captures/setupin_capture_jk.csv");
 }
 
-TEST_F(JKDecoderTest, AckPoorTiming) {
+TEST_F(JKDecoderTest, SetupInSkipIdle) {
     reset();
 
     capture_test(*this,
-                 "bus_captures/ack_poor_capture.csv",
-                 "bus_captures/ack_poor_capture_jk.csv");
+                 "bus_captures/setupin_capture.csv",
+                 "bus_captures/setupin_capture_jk.csv",
+                 true);
 }
 
-TEST_F(JKDecoderTest, CppEncoder) {
-    reset();
-
-
-    std::vector<uint8_t> exp_pkt = {0xFF, 0x00, 0xAA, 0xCF};
-    UsbUtils::JKEncoder encoder(exp_pkt);
+// Skipped idle clocks move trace time on as clocked ones do, so the window
+// of a triggered trace lines up with clk_cnt
+TEST_F(JKDecoderTest, SetupInSkipIdleTraced) {
+    if constexpr (!traced) {
+        GTEST_SKIP() << "Tracing is compiled out";
+    } else {
+        const std::string name = std::format("skip_idle_traced.{}", getpid());
+        if (!trace.enabled()) {
+            trace.setup({.enabled = true,
+                         .depth = 1,
+                         .scope = "",
+                         .trigger = "",
+                         .pre_cycles = 100,
+                         .post_cycles = 100},
+                        vctx.get(), mod.get(), name);
+        }
+        trace_trigger([this] { return mod->bus_sop != 0; });
+        reset();
+
+        capture_test(*this,
+                     "bus_captures/setupin_capture.csv",
+                     "bus_captures/setupin_capture_jk.csv",
+                     true);
+        ASSERT_TRUE(trace.triggered());
+        ASSERT_EQ(timeui, 4 * clk_cnt);
+
+        trace.close();
+        std::filesystem::remove(std::format("{}.{}", name, MOD_TRACE_EXT));
+        std::filesystem::remove(std::format("{}.pre.{}", name, MOD_TRACE_EXT));
+    }
+}
 
+TEST_F(JKDecoderTest, SetupInBinary) {
+    reset();
 
-    mod->dn = 0;
-    mod->dp = 0;
+    std::vector<USBCaptureEdge> csv_edges =
+        resample_usb_capture(load_usb_capture("bus_captures/setupin_capture.csv"));
+    const std::filesystem::path ucap_fname =
+        std::filesystem::temp_directory_path() /
+        std::format("setupin_capture.{}.ucap", getpid());
+    ASSERT_TRUE(write_usb_capture(ucap_fname, csv_edges));
+
+    // Both the lazy edge list and the CSV compatible loader must round trip
+    USBCaptureFile ucap(ucap_fname);
+    ASSERT_TRUE(ucap.is_open());
+    ASSERT_EQ(ucap.size(), csv_edges.size());
+    auto csv_itr = csv_edges.begin();
+    for (const auto& edge : ucap) {
+        ASSERT_EQ(edge.cycle, csv_itr->cycle);
+        ASSERT_EQ(edge.dn, csv_itr->dn);
+        ASSERT_EQ(edge.dp, csv_itr->dp);
+        csv_itr++;
+    }
 
-    uint8_t in_b = 0;
-    uint32_t in_idx = 0;
-    uint32_t exp_idx = 0;
+    std::vector<USBCaptureEdge> reloaded_edges =
+        resample_usb_capture(load_usb_capture(ucap_fname));
+    ASSERT_EQ(reloaded_edges.size(), csv_edges.size());
+    for (std::size_t i = 0; i < csv_edges.size(); i++) {
+        ASSERT_EQ(reloaded_edges[i].cycle, csv_edges[i].cycle);
+    }
 
-    while (!encoder.is_complete()) {
+    capture_test(*this,
+                 ucap_fname,
+                 "bus_captures/setupin_capture_jk.csv");
 
-        UsbUtils::BusState next_state = encoder.step();
+    std::filesystem::remove(ucap_fname);
+}
 
-        ASSERT_NE(next_state, UsbUtils::BUS_INVALID);
-        switch (next_state) {
-            case UsbUtils::BUS_SE0:
-                mod->dn = 0;
-                mod->dp = 0;
-                break;
-            case UsbUtils::BUS_J:
-                mod->dn = 0;
-                mod->dp = 1;
-                break;
-            case UsbUtils::BUS_K:
-                mod->dn = 1;
-                mod->dp = 0;
-                break;
-            default:
-                ASSERT_TRUE(false);
-                break;
-        }
+TEST_F(JKDecoderTest, AckPoorTiming) {
+    reset();
 
-        clk();
+    capture_test(*this,
+                 "bus_captures/ack_poor_capture.csv",
+                 "bus_captures/ack_poor_capture_jk.csv");
+}
 
-        if (mod->bit_valid) {
-            in_b |= (mod->bit_out & 1) << in_idx;
-            in_idx++;
+TEST_F(JKDecoderTest, CppEncoder) {
+    reset();
 
-            if (in_idx == 8) {
-                ASSERT_LT(exp_idx, exp_pkt.size());
-                ASSERT_EQ(in_b, exp_pkt[exp_idx]);
-                exp_idx++;
-                in_idx = 0;
-                in_b = 0;
-            }
-        }
-    }
+    mod->dn = 0;
+    mod->dp = 0;
 
-    ASSERT_EQ(in_b, 0);
-    ASSERT_EQ(exp_idx, exp_pkt.size());
-    ASSERT_EQ(mod->bus_eop, 1);
+    encoder_test(*this, {0xFF, 0x00, 0xAA, 0xCF});
 }
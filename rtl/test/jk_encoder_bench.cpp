@@ -0,0 +1,32 @@
+#include "mod_bench.hpp"
+#include "Vjk_encoder.h"
+
+// Serialize a 64 byte payload bit by bit. The encoder holds done until
+// reset, so every packet starts from reset()
+template <ModBenchTrace Trace>
+static void BM_JKEncoderPacket(benchmark::State& state) {
+    ModBench<ModBenchFixture<UsbModTest, Vjk_encoder, Trace>, Trace> bench(state, "jk_encoder");
+
+    std::vector<uint8_t> data(64, 0x3C);
+    const uint32_t bits = data.size() * 8;
+
+    for (auto _ : state) {
+        bench->reset();
+
+        uint32_t bit_idx = 0;
+        bench->mod->bit_in = data[0] & 1;
+        bench->mod->last_bit = 0;
+        while (!bench->mod->done) {
+            bench->clk();
+            if (bench->mod->bit_ack) {
+                bit_idx++;
+            }
+            if (bit_idx < bits) {
+                bench->mod->bit_in = (data[bit_idx / 8] >> (bit_idx % 8)) & 1;
+                bench->mod->last_bit = bit_idx == bits - 1;
+            }
+        }
+        bench.count_packets(1, data.size());
+    }
+}
+MOD_BENCHMARK(BM_JKEncoderPacket);
@@ -2,9 +2,19 @@
 #include <random>
 #include "mod_test.hpp"
 #include "usb_utils.hpp"
+#include "rtl_fsm_states.hpp"
 #include "Vjk_encoder.h"
+#include "Vjk_encoder___024root.h"
 
-typedef UsbModTest<Vjk_encoder> JKEncoderTest;
+class JKEncoderTest : public UsbModTest<Vjk_encoder> {
+
+    public:
+    void SetUp() override {
+        UsbModTest::SetUp();
+        profile_fsm("encoder_state", [this] { return mod->rootp->jk_encoder__DOT__encoder_state; },
+                    JK_ENCODER_STATES);
+    }
+};
 
 TEST_F(JKEncoderTest, Reset) {
     reset();
@@ -59,9 +69,11 @@ void loopback_test(JKEncoderTest& tester, std::vector<uint8_t> byte_vals, int ma
         bit_idx = 0;
     }
 
-    while (!tester.mod->done && max_cycles--) {
-        tester.clk();
-        decoder.step(tester.mod->dp, tester.mod->dn);
+    if (!tester.mod->done) {
+        tester.run_until([&] {
+            decoder.step(tester.mod->dp, tester.mod->dn);
+            return tester.mod->done || decoder.get_err().has_value();
+        }, max_cycles);
         ASSERT_FALSE(decoder.get_err().has_value()) << decoder.get_err().value();
     }
 
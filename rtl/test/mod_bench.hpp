@@ -0,0 +1,132 @@
+#pragma once
+
+#include <filesystem>
+#include <format>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+
+#include "mod_test.hpp"
+#include "usb_utils.hpp"
+
+// ModTest paths covered by the per-top benchmarks
+//
+//   BENCH_UNTRACED   Untraced policy, tracing compiled out
+//   BENCH_TRACED     Traced policy with tracing disabled at runtime
+//   BENCH_DUMPING    Traced policy dumping every signal to a trace file
+enum ModBenchTrace {
+    BENCH_UNTRACED,
+    BENCH_TRACED,
+    BENCH_DUMPING
+};
+
+template <template <typename, typename> class Fixture, typename T, ModBenchTrace Trace>
+using ModBenchFixture = Fixture<T, std::conditional_t<Trace == BENCH_UNTRACED, Untraced, Traced>>;
+
+// Owns a set up fixture for the duration of a benchmark and publishes the
+// simulated cycle and packet rates as counters
+template <typename Fixture, ModBenchTrace Trace>
+class ModBench {
+
+    public:
+    ModBench(benchmark::State& state, const std::string_view& name) :
+        state_(state),
+        packets_(0),
+        bytes_(0) {
+
+        fixture_.SetUp();
+
+        if constexpr (Trace == BENCH_DUMPING) {
+            ModTraceConfig config = {
+                .enabled = true,
+                .depth = 99,
+                .scope = "",
+                .trigger = "",
+                .pre_cycles = 1,
+                .post_cycles = 0
+            };
+            trace_name_ = std::filesystem::temp_directory_path() /
+                          std::format("bench_{}.{}", name, getpid());
+            fixture_.trace.setup(config, fixture_.vctx.get(), fixture_.mod.get(),
+                                 trace_name_.string());
+        }
+    }
+
+    ~ModBench() {
+        state_.counters["cycles"] = benchmark::Counter(fixture_.clk_cnt,
+                                                       benchmark::Counter::kIsRate);
+        state_.counters["packets"] = benchmark::Counter(packets_,
+                                                        benchmark::Counter::kIsRate);
+        if (bytes_ > 0) {
+            state_.SetBytesProcessed(bytes_);
+        }
+
+        fixture_.TearDown();
+
+        if constexpr (Trace == BENCH_DUMPING) {
+            std::error_code ec;
+            std::filesystem::path fname = trace_name_;
+            fname += std::format(".{}", MOD_TRACE_EXT);
+            std::filesystem::remove(fname, ec);
+        }
+    }
+
+    Fixture& operator*() {
+        return fixture_;
+    }
+
+    Fixture* operator->() {
+        return &fixture_;
+    }
+
+    // Count packets, carrying payload_bytes in total, through the model
+    void count_packets(uint64_t packets, uint64_t payload_bytes = 0) {
+        packets_ += packets;
+        bytes_ += payload_bytes;
+    }
+
+    private:
+    benchmark::State& state_;
+    StandaloneModTest<Fixture> fixture_;
+    std::filesystem::path trace_name_;
+    uint64_t packets_;
+    uint64_t bytes_;
+};
+
+// Register a benchmark template for every ModTest path
+#define MOD_BENCHMARK(fn) \
+    BENCHMARK_TEMPLATE(fn, BENCH_UNTRACED); \
+    BENCHMARK_TEMPLATE(fn, BENCH_TRACED); \
+    BENCHMARK_TEMPLATE(fn, BENCH_DUMPING)
+
+// Expand an encoder into the bus state for each clock, so stimulus
+// generation stays out of the measured loop
+inline std::vector<UsbUtils::BusState> bus_states(UsbUtils::JKEncoder encoder) {
+    std::vector<UsbUtils::BusState> states;
+    while (!encoder.is_complete()) {
+        states.push_back(encoder.step());
+    }
+    return states;
+}
+
+template <typename T>
+void drive_bus_state(T* mod, UsbUtils::BusState state) {
+    switch (state) {
+        case UsbUtils::BUS_SE0:
+            mod->dn = 0;
+            mod->dp = 0;
+            break;
+        case UsbUtils::BUS_K:
+            mod->dn = 1;
+            mod->dp = 0;
+            break;
+        case UsbUtils::BUS_J:
+        default:
+            mod->dn = 0;
+            mod->dp = 1;
+            break;
+    }
+}
@@ -0,0 +1,19 @@
+
+#include <benchmark/benchmark.h>
+#include <verilated.h>
+
+#include "mod_test.hpp"
+
+int main(int argc, char** argv) {
+
+    Verilated::commandArgs(argc, argv);
+    mod_test_set_command_args(argc, argv);
+
+    // Leaves the +verilator+ arguments in place
+    ::benchmark::Initialize(&argc, argv);
+
+    ::benchmark::RunSpecifiedBenchmarks();
+    ::benchmark::Shutdown();
+
+    return 0;
+}
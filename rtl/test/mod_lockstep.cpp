@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <format>
+
+#include "mod_lockstep.hpp"
+
+PacketDecoderLockstep::PacketDecoderLockstep(size_t window_clks, uint64_t max_lag_clks) :
+    max_lag_clks_(max_lag_clks),
+    clk_(0),
+    ref_(),
+    ref_bits_(0),
+    ref_byte_in_(0),
+    ref_pid_(0),
+    ref_packet_(0),
+    resync_(false),
+    idle_clks_(0),
+    rtl_last_eop_(false),
+    bits_checked_(0),
+    bytes_checked_(0),
+    packets_checked_(0),
+    packets_skipped_(0),
+    window_(std::max<size_t>(1, window_clks)),
+    mismatch_() {
+}
+
+bool PacketDecoderLockstep::step(uint8_t dp, uint8_t dn, const PacketDecoderProbe& rtl) {
+
+    if (failed()) {
+        return false;
+    }
+
+    WindowEntry entry = {clk_, dp, dn, -1, -1, -1, -1, false, false, false};
+
+    step_reference(dp, dn, entry);
+
+    if (rtl.bit_valid) {
+        entry.rtl_bit = rtl.bit;
+    }
+    if (rtl.byte_valid) {
+        entry.rtl_byte = rtl.byte;
+    }
+    entry.rtl_eop = rtl.eop && !rtl_last_eop_;
+    rtl_last_eop_ = rtl.eop;
+
+    // Whatever the RTL makes of a packet the reference rejected is dropped
+    if (!resync_) {
+        if (rtl.bit_valid) {
+            rtl_bit_q_.push_back({clk_, rtl.bit, 0, 0});
+        }
+        if (rtl.byte_valid) {
+            rtl_byte_q_.push_back({clk_, rtl.byte, 0, 0});
+        }
+        if (entry.rtl_eop) {
+            rtl_packet_q_.push_back({clk_, 0, rtl.pid_valid, rtl.pid, rtl.good});
+        }
+    }
+
+    window_[clk_ % window_.size()] = entry;
+
+    if (!resync_) {
+        compare();
+    }
+
+    clk_++;
+    return !failed();
+}
+
+void PacketDecoderLockstep::step_reference(uint8_t dp, uint8_t dn, WindowEntry& entry) {
+
+    idle_clks_ = dp == 1 && dn == 0 ? idle_clks_ + 1 : 0;
+
+    if (resync_) {
+        if (idle_clks_ >= max_lag_clks_) {
+            resync_ = false;
+        }
+        return;
+    }
+
+    ref_.step(dp, dn);
+
+    if (ref_.get_err()) {
+        entry.ref_err = true;
+        resync_ = true;
+        ref_bit_q_.clear();
+        rtl_bit_q_.clear();
+        ref_byte_q_.clear();
+        rtl_byte_q_.clear();
+        ref_packet_q_.clear();
+        rtl_packet_q_.clear();
+        packets_skipped_++;
+        ref_ = UsbUtils::JKDecoder();
+        ref_bits_ = 0;
+        ref_packet_++;
+        return;
+    }
+
+    if (ref_.get_bit_count() != ref_bits_) {
+        const uint8_t bit = ref_.get_last_bit();
+        entry.ref_bit = bit;
+        ref_bit_q_.push_back({clk_, bit, ref_packet_, (uint64_t)ref_bits_});
+        ref_bits_++;
+
+        ref_byte_in_ = (ref_byte_in_ >> 1) | (bit << 7);
+        if ((ref_bits_ % 8) == 0) {
+            if (ref_bits_ == 8) {
+                ref_pid_ = ref_byte_in_;
+            } else {
+                entry.ref_byte = ref_byte_in_;
+                ref_byte_q_.push_back({clk_, ref_byte_in_, ref_packet_, (uint64_t)ref_bits_ / 8 - 1});
+            }
+        }
+    }
+
+    if (ref_.is_complete()) {
+        // The RTL checks the PID and CRC; the reference also checks lengths
+        const bool pid_valid = ref_bits_ >= 8 &&
+                               (ref_pid_ & 0xF) == ((~ref_pid_ >> 4) & 0xF) &&
+                               (ref_pid_ & 0xF) != UsbUtils::PID_INVALID;
+        bool good = pid_valid;
+        switch (static_cast<UsbUtils::Pid>(ref_pid_ & 0xF)) {
+            case UsbUtils::PID_ACK:
+            case UsbUtils::PID_NAK:
+            case UsbUtils::PID_STALL:
+                break;
+            default:
+                good = good && UsbUtils::UsbPacketView::decode(ref_.get_decoded()).has_value();
+                break;
+        }
+
+        entry.ref_eop = true;
+        ref_packet_q_.push_back({clk_, ref_packet_, pid_valid, (uint8_t)(ref_pid_ & 0xF), good});
+        ref_ = UsbUtils::JKDecoder();
+        ref_bits_ = 0;
+        ref_packet_++;
+    }
+}
+
+void PacketDecoderLockstep::compare() {
+
+    while (!ref_bit_q_.empty() && !rtl_bit_q_.empty()) {
+        const auto& ref = ref_bit_q_.front();
+        const auto& rtl = rtl_bit_q_.front();
+        if (ref.value != rtl.value) {
+            fail(rtl.clk, std::format("Bit {} of packet {}: reference {} at clk {}, RTL {}",
+                                      ref.index, ref.packet, (int)ref.value, ref.clk, (int)rtl.value));
+            return;
+        }
+        ref_bit_q_.pop_front();
+        rtl_bit_q_.pop_front();
+        bits_checked_++;
+    }
+
+    while (!ref_byte_q_.empty() && !rtl_byte_q_.empty()) {
+        const auto& ref = ref_byte_q_.front();
+        const auto& rtl = rtl_byte_q_.front();
+        if (ref.value != rtl.value) {
+            fail(rtl.clk, std::format("Byte {} of packet {}: reference {:02X} at clk {}, RTL {:02X}",
+                                      ref.index, ref.packet, ref.value, ref.clk, rtl.value));
+            return;
+        }
+        ref_byte_q_.pop_front();
+        rtl_byte_q_.pop_front();
+        bytes_checked_++;
+    }
+
+    while (!ref_packet_q_.empty() && !rtl_packet_q_.empty()) {
+        const auto& ref = ref_packet_q_.front();
+        const auto& rtl = rtl_packet_q_.front();
+        if (ref.pid_valid != rtl.pid_valid ||
+            (ref.pid_valid && ref.pid != rtl.pid) ||
+            ref.good != rtl.good) {
+            fail(rtl.clk, std::format("End of packet {}: reference pid {:X} valid {} good {} at clk {}, "
+                                      "RTL pid {:X} valid {} good {}",
+                                      ref.packet, ref.pid, ref.pid_valid, ref.good, ref.clk,
+                                      rtl.pid, rtl.pid_valid, rtl.good));
+            return;
+        }
+        ref_packet_q_.pop_front();
+        rtl_packet_q_.pop_front();
+        packets_checked_++;
+    }
+
+    // Whatever is left is only on one side. It may not wait for long
+    auto late = [this](uint64_t clk) {
+        return clk_ - clk > max_lag_clks_;
+    };
+
+    if (!ref_bit_q_.empty() && late(ref_bit_q_.front().clk)) {
+        const auto& ref = ref_bit_q_.front();
+        fail(ref.clk, std::format("Bit {} of packet {}: reference {}, none from the RTL",
+                                  ref.index, ref.packet, (int)ref.value));
+    } else if (!rtl_bit_q_.empty() && late(rtl_bit_q_.front().clk)) {
+        fail(rtl_bit_q_.front().clk, std::format("RTL bit {} with no reference bit",
+                                                 (int)rtl_bit_q_.front().value));
+    } else if (!ref_byte_q_.empty() && late(ref_byte_q_.front().clk)) {
+        const auto& ref = ref_byte_q_.front();
+        fail(ref.clk, std::format("Byte {} of packet {}: reference {:02X}, none from the RTL",
+                                  ref.index, ref.packet, ref.value));
+    } else if (!rtl_byte_q_.empty() && late(rtl_byte_q_.front().clk)) {
+        fail(rtl_byte_q_.front().clk, std::format("RTL byte {:02X} with no reference byte",
+                                                  rtl_byte_q_.front().value));
+    } else if (!ref_packet_q_.empty() && late(ref_packet_q_.front().clk)) {
+        fail(ref_packet_q_.front().clk, std::format("End of packet {} with no RTL packet_eop",
+                                                    ref_packet_q_.front().packet));
+    } else if (!rtl_packet_q_.empty() && late(rtl_packet_q_.front().clk)) {
+        fail(rtl_packet_q_.front().clk, "RTL packet_eop with no reference packet");
+    }
+}
+
+void PacketDecoderLockstep::fail(uint64_t clk, const std::string& what) {
+    mismatch_ = std::format("clk {}: {}\n{}", clk, what, format_window());
+}
+
+static char line_char(uint8_t dp, uint8_t dn) {
+    static const char chars[] = {'0', 'J', 'K', '1'};
+    return chars[UsbUtils::pack_line_state(dp, dn)];
+}
+
+std::string PacketDecoderLockstep::format_window() const {
+
+    const uint64_t first = clk_ + 1 > window_.size() ? clk_ + 1 - window_.size() : 0;
+
+    std::string out = "       clk line ref rtl refB rtlB\n";
+    for (uint64_t clk = first; clk <= clk_; clk++) {
+        const auto& e = window_[clk % window_.size()];
+        auto bit = [](int b) {
+            return b < 0 ? std::string(".") : std::format("{}", b);
+        };
+        auto byte = [](int b) {
+            return b < 0 ? std::string("..") : std::format("{:02X}", b);
+        };
+        out += std::format("{:>10}    {} {:>3} {:>3}   {}   {}{}{}{}\n",
+                           e.clk, line_char(e.dp, e.dn),
+                           bit(e.ref_bit), bit(e.rtl_bit),
+                           byte(e.ref_byte), byte(e.rtl_byte),
+                           e.ref_eop ? " ref eop" : "",
+                           e.rtl_eop ? " rtl eop" : "",
+                           e.ref_err ? " ref error" : "");
+    }
+    return out;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "usb_utils.hpp"
+
+// Lockstep differential check of the RTL packet_decoder against
+// UsbUtils::JKDecoder
+//
+// Both decoders consume the same dp/dn sample every clock. Decoded bits
+// (PID included, stuffed bits removed), payload bytes and end of packet
+// results are queued on each side and compared in order as soon as both
+// sides have produced them, so a divergence deep in a long packet is
+// reported within a few clocks of where it happened. Either side may lead
+// the other by up to max_lag_clks: the RTL samples each bit later in the bit
+// time than the reference does, and registers its outputs.
+//
+// Only the last window_clks clocks are kept, as context for the first
+// mismatch, so arbitrarily long runs can be checked.
+//
+// A packet the reference fails to decode (a SYNC, bitstuff or line state
+// error) is not compared. Both sides are resynchronized once the bus has
+// been idle for max_lag_clks.
+
+// RTL packet_decoder outputs after a clock
+struct PacketDecoderProbe {
+    bool bit_valid;
+    uint8_t bit;
+    bool byte_valid;
+    uint8_t byte;
+    bool eop;
+    bool pid_valid;
+    uint8_t pid;
+    bool good;
+};
+
+class PacketDecoderLockstep {
+
+    public:
+    PacketDecoderLockstep(size_t window_clks = 48, uint64_t max_lag_clks = 64);
+
+    // One clock: dp/dn as driven for the clock, and the RTL outputs after
+    // it. Returns false at the first mismatch and on every step after it
+    bool step(uint8_t dp, uint8_t dn, const PacketDecoderProbe& rtl);
+
+    bool failed() const {
+        return !mismatch_.empty();
+    }
+
+    // What diverged, followed by the context window
+    const std::string& mismatch() const {
+        return mismatch_;
+    }
+
+    uint64_t clks() const {
+        return clk_;
+    }
+
+    uint64_t bits_checked() const {
+        return bits_checked_;
+    }
+
+    uint64_t bytes_checked() const {
+        return bytes_checked_;
+    }
+
+    uint64_t packets_checked() const {
+        return packets_checked_;
+    }
+
+    uint64_t packets_skipped() const {
+        return packets_skipped_;
+    }
+
+    private:
+
+    struct Value {
+        uint64_t clk;
+        uint8_t value;
+        // Reference packet and bit or byte within it
+        uint64_t packet;
+        uint64_t index;
+    };
+
+    struct PacketResult {
+        uint64_t clk;
+        uint64_t packet;
+        bool pid_valid;
+        uint8_t pid;
+        bool good;
+    };
+
+    // One clock of context. -1 where nothing was produced
+    struct WindowEntry {
+        uint64_t clk;
+        uint8_t dp, dn;
+        int ref_bit, rtl_bit;
+        int ref_byte, rtl_byte;
+        bool ref_eop, rtl_eop;
+        bool ref_err;
+    };
+
+    void step_reference(uint8_t dp, uint8_t dn, WindowEntry& entry);
+    void compare();
+    void fail(uint64_t clk, const std::string& what);
+    std::string format_window() const;
+
+    uint64_t max_lag_clks_;
+    uint64_t clk_;
+
+    UsbUtils::JKDecoder ref_;
+    int ref_bits_;
+    uint8_t ref_byte_in_;
+    uint8_t ref_pid_;
+    uint64_t ref_packet_;
+    bool resync_;
+    uint64_t idle_clks_;
+
+    std::deque<Value> ref_bit_q_, rtl_bit_q_;
+    std::deque<Value> ref_byte_q_, rtl_byte_q_;
+    std::deque<PacketResult> ref_packet_q_, rtl_packet_q_;
+    bool rtl_last_eop_;
+
+    uint64_t bits_checked_;
+    uint64_t bytes_checked_;
+    uint64_t packets_checked_;
+    uint64_t packets_skipped_;
+
+    std::vector<WindowEntry> window_;
+    std::string mismatch_;
+};
@@ -0,0 +1,85 @@
+
+#include <algorithm>
+#include <cstdlib>
+#include <format>
+#include <fstream>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "mod_regress.hpp"
+
+ModRegressionConfig mod_regression_config_from_env(uint64_t default_seeds) {
+
+    ModRegressionConfig config = {
+        .first_seed = 0,
+        .seeds = default_seeds,
+        .threads = std::max(1u, std::thread::hardware_concurrency()),
+        .max_failures = 16,
+        .failures_file = ""
+    };
+
+    if (const char* env_first = std::getenv("REGRESS_FIRST_SEED")) {
+        config.first_seed = std::strtoull(env_first, nullptr, 0);
+    }
+    if (const char* env_seeds = std::getenv("REGRESS_SEEDS")) {
+        config.seeds = std::strtoull(env_seeds, nullptr, 0);
+    }
+    if (const char* env_threads = std::getenv("REGRESS_THREADS")) {
+        config.threads = std::max(1, std::atoi(env_threads));
+    }
+    if (const char* env_max = std::getenv("REGRESS_MAX_FAILURES")) {
+        config.max_failures = std::max(1ull, std::strtoull(env_max, nullptr, 0));
+    }
+    if (const char* env_file = std::getenv("REGRESS_FAILURES_FILE")) {
+        config.failures_file = env_file;
+    }
+
+    // Replaying a single seed runs it on the calling thread
+    if (const char* env_seed = std::getenv("REGRESS_SEED")) {
+        config.first_seed = std::strtoull(env_seed, nullptr, 0);
+        config.seeds = 1;
+        config.threads = 1;
+    }
+
+    return config;
+}
+
+void mod_regression_report(const ModRegressionConfig& config,
+                           std::vector<ModRegressionFailure> failures,
+                           uint64_t seeds_run,
+                           double seconds) {
+
+    std::sort(failures.begin(), failures.end(),
+              [](const auto& a, const auto& b) { return a.seed < b.seed; });
+
+    auto test = ::testing::UnitTest::GetInstance()->current_test_info();
+    const std::string filter = test != nullptr ?
+        std::format("{}.{}", test->test_suite_name(), test->name()) : "*";
+
+    std::cout << std::format("[ REGRESS  ] {} of {} seeds from {} on {} threads, "
+                             "{} failed, {:.2f} s ({:.0f} seeds/s)\n",
+                             seeds_run, config.seeds, config.first_seed,
+                             config.threads, failures.size(), seconds,
+                             seconds > 0 ? seeds_run / seconds : 0.0);
+
+    std::ofstream failures_f;
+    if (config.failures_file.size() > 0 && failures.size() > 0) {
+        failures_f.open(config.failures_file, std::ios_base::app);
+    }
+
+    for (const auto& failure : failures) {
+        ADD_FAILURE() << "seed " << failure.seed << " failed, replay with "
+                      << "REGRESS_SEED=" << failure.seed
+                      << " --gtest_filter=" << filter << "\n"
+                      << failure.message;
+
+        if (failures_f.is_open()) {
+            failures_f << filter << " " << failure.seed << "\n";
+        }
+    }
+
+    if (failures.size() > 0 && seeds_run < config.seeds) {
+        std::cout << std::format("[ REGRESS  ] stopped after {} failures\n", failures.size());
+    }
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <format>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <gtest/gtest-spi.h>
+
+#include "mod_test.hpp"
+
+// Randomized regression configuration, read from the environment
+//
+//   REGRESS_SEEDS          number of seeds to run (default per test)
+//   REGRESS_FIRST_SEED     first seed of the range (default 0)
+//   REGRESS_THREADS        worker threads (default all cores)
+//   REGRESS_MAX_FAILURES   stop handing out seeds after this many failures
+//                          (default 16)
+//   REGRESS_SEED           replay only this seed
+//   REGRESS_FAILURES_FILE  append failing seeds to this file, one per line
+struct ModRegressionConfig {
+    uint64_t first_seed;
+    uint64_t seeds;
+    unsigned threads;
+    uint64_t max_failures;
+    std::string failures_file;
+};
+
+ModRegressionConfig mod_regression_config_from_env(uint64_t default_seeds);
+
+struct ModRegressionFailure {
+    uint64_t seed;
+    std::string message;
+};
+
+// Report failures to the running gtest test, with the seeds needed to replay
+// them, and append them to the failures file if one is configured
+void mod_regression_report(const ModRegressionConfig& config,
+                           std::vector<ModRegressionFailure> failures,
+                           uint64_t seeds_run,
+                           double seconds);
+
+// Run run_seed(fixture, seed) for every seed of the configured range on a
+// pool of worker threads. Each seed gets a freshly set up fixture, with its
+// own VerilatedContext and model, so any failure replays exactly with
+// REGRESS_SEED. gtest assertions in run_seed are captured per seed rather
+// than failing the running test directly; the failing seeds are reported
+// once every worker has finished.
+//
+// Seeds are handed out in small batches from a shared counter, which keeps
+// the cores busy when the work per seed varies.
+template <typename Fixture, typename SeedFn>
+void run_regression(const ModRegressionConfig& config, SeedFn&& run_seed) {
+
+    constexpr uint64_t SEED_BATCH = 16;
+
+    const uint64_t end_seed = config.first_seed + config.seeds;
+    const unsigned threads = std::max<uint64_t>(1,
+        std::min<uint64_t>(config.threads, (config.seeds + SEED_BATCH - 1) / SEED_BATCH));
+
+    std::atomic<uint64_t> next_seed = config.first_seed;
+    std::atomic<uint64_t> seeds_run = 0;
+    std::atomic<uint64_t> failure_cnt = 0;
+    std::mutex failures_lock;
+    std::vector<ModRegressionFailure> failures;
+
+    auto run_one = [&](uint64_t seed) {
+        ::testing::TestPartResultArray results;
+        {
+            ::testing::ScopedFakeTestPartResultReporter reporter(
+                ::testing::ScopedFakeTestPartResultReporter::INTERCEPT_ONLY_CURRENT_THREAD,
+                &results);
+
+            StandaloneModTest<Fixture> fixture;
+            fixture.trace_suffix = std::format("_seed{}", seed);
+            fixture.SetUp();
+            try {
+                run_seed(static_cast<Fixture&>(fixture), seed);
+            } catch (const std::exception& e) {
+                ADD_FAILURE() << "exception: " << e.what();
+            }
+            fixture.TearDown();
+        }
+
+        std::string message;
+        for (int i = 0; i < results.size(); i++) {
+            const ::testing::TestPartResult& result = results.GetTestPartResult(i);
+            if (result.failed()) {
+                message += std::format("{}:{}: {}\n",
+                                       result.file_name() ? result.file_name() : "unknown",
+                                       result.line_number(),
+                                       result.message());
+            }
+        }
+
+        seeds_run++;
+        if (message.size() > 0) {
+            failure_cnt++;
+            std::lock_guard<std::mutex> guard(failures_lock);
+            failures.push_back({seed, std::move(message)});
+        }
+    };
+
+    auto worker = [&] {
+        while (failure_cnt < config.max_failures) {
+            const uint64_t first = next_seed.fetch_add(SEED_BATCH);
+            if (first >= end_seed) {
+                break;
+            }
+
+            const uint64_t last = std::min(first + SEED_BATCH, end_seed);
+            for (uint64_t seed = first; seed < last; seed++) {
+                run_one(seed);
+            }
+        }
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::jthread> pool;
+        for (unsigned i = 1; i < threads; i++) {
+            pool.emplace_back(worker);
+        }
+        worker();
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    ModRegressionConfig run_config = config;
+    run_config.threads = threads;
+    mod_regression_report(run_config, std::move(failures), seeds_run, elapsed.count());
+}
@@ -1,38 +1,18 @@
 
 #include <cassert>
+#include <filesystem>
+#include <format>
 #include <fstream>
+#include <iostream>
+#include <mutex>
+
+#include <unistd.h>
 
 #include <gtest/gtest.h>
 #include <verilated.h>
 
 #include "mod_test.hpp"
 
-std::vector<USBCaptureInput> load_usb_capture(std::string capture_fname) {
-
-    std::fstream captures_f(capture_fname, std::ios_base::in);
-    std::string line;
-    std::vector<USBCaptureInput> entries;
-
-    // Skip header
-    std::getline(captures_f, line);
-
-    double min_time = 0;
-    while (std::getline(captures_f, line)) {
-        USBCaptureInput entry;
-        sscanf(line.c_str(), "%lf,%d,%d\n",
-               &entry.time,
-               &entry.dn, &entry.dp);
-        if (entries.size() == 0) {
-            min_time = entry.time;
-        }
-        entry.time -= min_time;
-        entry.time += 8 * (1./(48.*1000.*1000.));
-        entries.push_back(entry);
-    }
-
-    return entries;
-}
-
 std::vector<std::vector<uint8_t>> load_usb_decoder_output(std::string decoder_fname) {
 
     std::fstream bytes_f(decoder_fname, std::ios_base::in);
@@ -52,15 +32,171 @@ std::vector<std::vector<uint8_t>> load_usb_decoder_output(std::string decoder_fn
     return exp_list;
 }
 
-int main(int argc, char** argv) {
+ModTraceConfig mod_trace_config_from_env() {
+
+    ModTraceConfig config = {
+        .enabled = false,
+        .depth = 99,
+        .scope = "",
+        .trigger = "",
+        .pre_cycles = 1000,
+        .post_cycles = 0
+    };
+
+    for (const char* env_name : {"TRACE", "DUMP_VCD"}) {
+        if (const char* env_en = std::getenv(env_name)) {
+            config.enabled |= std::atoi(env_en) > 0;
+        }
+    }
+    if (const char* env_depth = std::getenv("TRACE_DEPTH")) {
+        config.depth = std::atoi(env_depth);
+    }
+    if (const char* env_scope = std::getenv("TRACE_SCOPE")) {
+        config.scope = env_scope;
+    }
+    if (const char* env_trigger = std::getenv("TRACE_TRIGGER")) {
+        config.trigger = env_trigger;
+    }
+    if (const char* env_pre = std::getenv("TRACE_PRE_CYCLES")) {
+        config.pre_cycles = std::max(1ll, std::atoll(env_pre));
+    }
+    if (const char* env_post = std::getenv("TRACE_POST_CYCLES")) {
+        config.post_cycles = std::atoll(env_post);
+    }
+
+    return config;
+}
+
+bool mod_fsm_profile_from_env() {
+    if (const char* env_en = std::getenv("FSM_PROFILE")) {
+        return std::atoi(env_en) > 0;
+    }
+    return false;
+}
+
+void ModFsmProfile::Fsm::resize(std::size_t n) {
+    const std::size_t old_n = cycles.size();
+    std::vector<uint64_t> old_transitions = std::move(transitions);
+
+    cycles.resize(n, 0);
+    transitions.assign(n * n, 0);
+    for (std::size_t from = 0; from < old_n; from++) {
+        for (std::size_t to = 0; to < old_n; to++) {
+            transitions[from * n + to] = old_transitions[from * old_n + to];
+        }
+    }
+}
+
+std::string ModFsmProfile::Fsm::state_name(uint32_t state) const {
+    if (state < state_names.size()) {
+        return state_names[state];
+    }
+    return std::format("<{}>", state);
+}
+
+void ModFsmProfile::report(const std::string& test_name) const {
+
+    // Fixtures on regression worker threads report concurrently
+    static std::mutex report_lock;
+    std::lock_guard<std::mutex> guard(report_lock);
+
+    const char* env_dir = std::getenv("FSM_PROFILE_DIR");
 
-    int res;
+    for (const auto& fsm : fsms_) {
+        const std::size_t n = fsm.cycles.size();
+        uint64_t total = 0;
+        for (auto c : fsm.cycles) {
+            total += c;
+        }
 
-    Verilated::commandArgs(argc, argv);
+        std::cout << std::format("[ FSM      ] {} {}: {} cycles\n", test_name, fsm.name, total);
+        for (uint32_t state = 0; state < n; state++) {
+            if (fsm.cycles[state] == 0) {
+                continue;
+            }
+            std::cout << std::format("    {:<28} {:>12} {:>6.2f}%\n",
+                                     fsm.state_name(state), fsm.cycles[state],
+                                     100.0 * fsm.cycles[state] / total);
+        }
+        for (uint32_t from = 0; from < n; from++) {
+            for (uint32_t to = 0; to < n; to++) {
+                const uint64_t count = fsm.transitions[from * n + to];
+                if (count > 0) {
+                    std::cout << std::format("    {} -> {}: {}\n",
+                                             fsm.state_name(from), fsm.state_name(to), count);
+                }
+            }
+        }
 
-    ::testing::InitGoogleTest(&argc, argv);
+        if (env_dir == nullptr) {
+            continue;
+        }
 
-    return RUN_ALL_TESTS();
+        std::filesystem::create_directories(env_dir);
+        std::ofstream csv(std::filesystem::path(env_dir) /
+                          std::format("{}.{}.csv", test_name, fsm.name));
+        csv << "state,cycles\n";
+        for (uint32_t state = 0; state < n; state++) {
+            csv << fsm.state_name(state) << "," << fsm.cycles[state] << "\n";
+        }
+        csv << "\nfrom/to";
+        for (uint32_t to = 0; to < n; to++) {
+            csv << "," << fsm.state_name(to);
+        }
+        csv << "\n";
+        for (uint32_t from = 0; from < n; from++) {
+            csv << fsm.state_name(from);
+            for (uint32_t to = 0; to < n; to++) {
+                csv << "," << fsm.transitions[from * n + to];
+            }
+            csv << "\n";
+        }
+    }
 }
 
+namespace {
+
+class CheckpointDir {
+
+    public:
+    CheckpointDir() :
+        path_(std::filesystem::temp_directory_path() /
+              std::format("usbfs_checkpoints.{}", getpid())) {
+        std::filesystem::create_directories(path_);
+    }
 
+    ~CheckpointDir() {
+        std::error_code ec;
+        std::filesystem::remove_all(path_, ec);
+    }
+
+    const std::filesystem::path& path() {
+        return path_;
+    }
+
+    private:
+    std::filesystem::path path_;
+};
+
+}
+
+std::filesystem::path checkpoint_path(const std::string_view& name) {
+    // Keyed by pid so test binaries running in parallel under ctest never
+    // restore each other's checkpoints
+    static CheckpointDir dir;
+    return dir.path() / name;
+}
+
+static int mod_test_argc = 0;
+static char** mod_test_argv = nullptr;
+
+void mod_test_set_command_args(int argc, char** argv) {
+    mod_test_argc = argc;
+    mod_test_argv = argv;
+}
+
+void mod_test_command_args(VerilatedContext* vctx) {
+    if (mod_test_argv != nullptr) {
+        vctx->commandArgs(mod_test_argc, mod_test_argv);
+    }
+}
@@ -1,129 +1,791 @@
+#pragma once
 
 #include <verilated.h>
+#include <verilated_save.h>
+
+// Set by add_verilator_library for tops verilated with TRACE_FST
+#if VM_TRACE_FST
+#include <verilated_fst_c.h>
+typedef VerilatedFstC ModTraceFile;
+constexpr const char* MOD_TRACE_EXT = "fst";
+#else
 #include <verilated_vcd_c.h>
+typedef VerilatedVcdC ModTraceFile;
+constexpr const char* MOD_TRACE_EXT = "vcd";
+#endif
 
+#include <algorithm>
 #include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <functional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <typeinfo>
+#include <vector>
 
 #include <gtest/gtest.h>
 
+#include "usb_capture.hpp"
+#include "usb_utils.hpp"
+
 std::tuple<uint8_t*,std::size_t> bin_from_asm(const std::string_view& s, const uint32_t addr, const std::string_view& tmp_name);
 
+// Location of a named checkpoint file. Checkpoints live in a per-process
+// scratch directory that is removed when the test binary exits
+std::filesystem::path checkpoint_path(const std::string_view& name);
+
+// Models verilated with --savable (see SAVABLE in add_verilator_library)
+// can be serialized to and from a checkpoint
+template <typename T>
+concept SavableModel = requires(VerilatedSerialize& os, VerilatedDeserialize& is, T& mod) {
+    os << mod;
+    is >> mod;
+};
+
+// Waveform tracing configuration, read from the environment
+//
+//   TRACE=1 (or DUMP_VCD=1)  enable tracing
+//   TRACE_DEPTH              hierarchy levels to trace (default 99)
+//   TRACE_SCOPE              only trace signals below this scope
+//   TRACE_TRIGGER            start the trace window on "sop" or "bad_packet"
+//   TRACE_PRE_CYCLES         cycles kept from before the trigger (default 1000)
+//   TRACE_POST_CYCLES        cycles traced after the trigger, 0 to trace until
+//                            the end of the test (default 0)
+struct ModTraceConfig {
+    bool enabled;
+    int depth;
+    std::string scope;
+    std::string trigger;
+    uint64_t pre_cycles;
+    uint64_t post_cycles;
+};
+
+ModTraceConfig mod_trace_config_from_env();
+
+// Pass the test binary's +verilator+ runtime arguments on to a context.
+// Set once by main()
+void mod_test_set_command_args(int argc, char** argv);
+void mod_test_command_args(VerilatedContext* vctx);
+
+// Triggered, windowed waveform trace
+//
+// Without a trigger every eval is dumped, as with a plain trace. With a
+// trigger, the trace is armed: dumps rotate between two segment files of
+// pre_cycles each, so at least pre_cycles of history survive in
+// <name>.pre.<ext> when the trigger fires. The window then continues in
+// <name>.<ext> for post_cycles and dumping stops. Segments from a trace that
+// never triggered are removed on close.
+template <typename TraceFile>
+class ModTrace {
+
+    public:
+    ModTrace() :
+        config_({}),
+        file_(),
+        state_(TRACE_DISABLED),
+        trigger_(),
+        seg_dumps_(0),
+        window_dumps_(0)
+    {}
+
+    template <typename T>
+    void setup(const ModTraceConfig& config, VerilatedContext* vctx, T* mod,
+               const std::string& name) {
+        config_ = config;
+        if (!config_.enabled) {
+            return;
+        }
+
+        name_ = name;
+        file_ = std::make_unique<TraceFile>();
+        vctx->traceEverOn(true);
+        mod->trace(file_.get(), config_.depth);
+        if (config_.scope.size() > 0) {
+            file_->dumpvars(config_.depth, config_.scope);
+        }
+        state_ = TRACE_PENDING;
+    }
+
+    bool enabled() const {
+        return state_ != TRACE_DISABLED;
+    }
+
+    bool triggered() const {
+        return state_ == TRACE_WINDOW ||
+               state_ == TRACE_DONE;
+    }
+
+    void set_trigger(std::function<bool()> trigger) {
+        trigger_ = std::move(trigger);
+    }
+
+    // Two evals are dumped per clock
+    void dump(uint64_t timeui) {
+        switch (state_) {
+            case TRACE_PENDING:
+                // Opened on the first dump so tests can set a trigger first
+                file_->open(fname("").c_str());
+                state_ = trigger_ ? TRACE_ARMED : TRACE_WINDOW;
+                dump(timeui);
+                break;
+
+            case TRACE_ARMED:
+                file_->dump(timeui);
+                if (trigger_()) {
+                    state_ = TRACE_WINDOW;
+                    window_dumps_ = 0;
+                } else if (++seg_dumps_ >= 2 * config_.pre_cycles) {
+                    rotate();
+                }
+                break;
+
+            case TRACE_WINDOW:
+                file_->dump(timeui);
+                window_dumps_++;
+                if (trigger_ &&
+                    config_.post_cycles > 0 &&
+                    window_dumps_ >= 2 * config_.post_cycles) {
+                    file_->close();
+                    state_ = TRACE_DONE;
+                }
+                break;
+
+            case TRACE_DISABLED:
+            case TRACE_DONE:
+                break;
+        }
+    }
+
+    void close() {
+        if (state_ == TRACE_ARMED ||
+            state_ == TRACE_WINDOW) {
+            file_->flush();
+            file_->close();
+        }
+
+        if (state_ == TRACE_ARMED) {
+            std::error_code ec;
+            std::filesystem::remove(fname(""), ec);
+            std::filesystem::remove(fname(".pre"), ec);
+        }
+
+        if (enabled()) {
+            state_ = TRACE_DONE;
+        }
+    }
+
+    private:
+    std::string fname(const std::string_view& suffix) {
+        return std::format("{}{}.{}", name_, suffix, MOD_TRACE_EXT);
+    }
+
+    // Keep the finished segment as the pre-trigger history
+    void rotate() {
+        file_->close();
+        std::filesystem::rename(fname(""), fname(".pre"));
+        file_->open(fname("").c_str());
+        seg_dumps_ = 0;
+    }
+
+    enum TraceState {
+        TRACE_DISABLED,
+        TRACE_PENDING,
+        TRACE_ARMED,
+        TRACE_WINDOW,
+        TRACE_DONE
+    };
+
+    ModTraceConfig config_;
+    std::string name_;
+    std::unique_ptr<TraceFile> file_;
+    TraceState state_;
+    std::function<bool()> trigger_;
+    uint64_t seg_dumps_;
+    uint64_t window_dumps_;
+};
+
+// FSM state occupancy and transition profile
+//
+// Tracks the state registers registered with ModTest::profile_fsm(),
+// sampled once per clock. Enabled with FSM_PROFILE=1; at the end of each
+// test the per-state cycle histogram and the non-zero transitions are
+// printed, and with FSM_PROFILE_DIR set each FSM is also written to
+// <dir>/<test>.<fsm>.csv as a histogram followed by the full transition
+// matrix (rows are the from state).
+//
+// State registers are exposed to the harness with /*verilator public_flat_rd*/
+// and read through the model's rootp.
+class ModFsmProfile {
+
+    public:
+    ModFsmProfile() :
+        enabled_(false)
+    {}
+
+    void enable(bool en) {
+        enabled_ = en;
+    }
+
+    bool enabled() const {
+        return enabled_;
+    }
+
+    // state_names are indexed by state encoding, in enum declaration order
+    void add(const std::string_view& name,
+             std::function<uint32_t()> read_state,
+             std::vector<std::string> state_names) {
+        if (!enabled_) {
+            return;
+        }
+
+        Fsm fsm = {
+            .name = std::string(name),
+            .read_state = std::move(read_state),
+            .state_names = std::move(state_names),
+            .state = 0,
+            .sampled = false,
+            .cycles = {},
+            .transitions = {}
+        };
+        fsm.resize(fsm.state_names.size());
+        fsms_.push_back(std::move(fsm));
+    }
+
+    void sample() {
+        for (auto& fsm : fsms_) {
+            const uint32_t state = fsm.read_state();
+            if (state >= fsm.cycles.size()) {
+                fsm.resize(state + 1);
+            }
+            if (fsm.sampled && state != fsm.state) {
+                fsm.transitions[fsm.state * fsm.cycles.size() + state]++;
+            }
+            fsm.cycles[state]++;
+            fsm.state = state;
+            fsm.sampled = true;
+        }
+    }
+
+    // Clocks skipped without evaluating the model stay in the current state
+    void skip(uint64_t n) {
+        for (auto& fsm : fsms_) {
+            if (fsm.sampled) {
+                fsm.cycles[fsm.state] += n;
+            }
+        }
+    }
+
+    void report(const std::string& test_name) const;
+
+    private:
+    struct Fsm {
+        std::string name;
+        std::function<uint32_t()> read_state;
+        std::vector<std::string> state_names;
+        uint32_t state;
+        bool sampled;
+        std::vector<uint64_t> cycles;
+        // cycles.size() x cycles.size(), indexed [from][to]
+        std::vector<uint64_t> transitions;
+
+        void resize(std::size_t n);
+        std::string state_name(uint32_t state) const;
+    };
+
+    bool enabled_;
+    std::vector<Fsm> fsms_;
+};
+
+bool mod_fsm_profile_from_env();
+
+// Clock driver trace policies, selected at compile time. Traced dumps through
+// ModTrace when tracing is enabled at runtime; Untraced compiles tracing out
+// of eval() and clk() entirely
+struct Traced {};
+struct Untraced {};
+
+// Models verilated with --trace or --trace-fst
 template <typename T>
+concept TraceableModel = requires(T& mod, ModTraceFile* tfp) {
+    mod.trace(tfp, 1);
+};
+
+template <typename T>
+using DefaultTracePolicy = std::conditional_t<TraceableModel<T>, Traced, Untraced>;
+
+template <typename T, typename TracePolicy = DefaultTracePolicy<T>>
 class ModTest : public ::testing::Test {
 
     public:
+    static constexpr bool traced = std::is_same_v<TracePolicy, Traced>;
 
     virtual void SetUp() override {
         vctx = std::make_unique<VerilatedContext>();
-        vcd = std::make_unique<VerilatedVcdC>();
+        mod_test_command_args(vctx.get());
         mod = std::make_unique<T>(vctx.get());
         timeui = 0;
         clk_cnt = 0;
+        mark_known_state("init");
 
-        if (const char* env_dump_vcd = std::getenv("DUMP_VCD")) {
-            int en_vcd = std::atoi(env_dump_vcd);
-            if (en_vcd > 0) {
-                vctx->traceEverOn(true);
-                mod->trace(vcd.get(), 99);
-                auto ut = ::testing::UnitTest::GetInstance();
-                auto test = ut->current_test_info();
-                std::stringstream trace_name;
-                trace_name << "test_" <<
-                              test->test_suite_name() << "_" <<
-                              test->name() << ".vcd";
+        fsm_profile.enable(mod_fsm_profile_from_env());
 
-                vcd->open(trace_name.str().c_str());
+        ModTraceConfig trace_config = mod_trace_config_from_env();
+        if constexpr (traced) {
+            if (!trace_config.enabled) {
+                return;
             }
+
+            trace.setup(trace_config, vctx.get(), mod.get(), test_name());
+            set_config_trigger(trace_config.trigger);
         }
     }
 
     virtual void TearDown() override {
 
-        vcd->flush();
-        vcd->close();
+        trace.close();
+
+        if (fsm_profile.enabled()) {
+            fsm_profile.report(test_name());
+        }
 
         mod->final();
 
         mod.reset();
-        vcd.reset();
         vctx.reset();
     }
 
     void eval() {
         mod->eval();
-        vcd->dump(timeui);
-        timeui++;
+        if constexpr (traced) {
+            if (trace.enabled()) {
+                trace.dump(timeui);
+            }
+            timeui++;
+        }
+    }
+
+    // Start the trace window when trigger() holds after an eval. Overrides
+    // TRACE_TRIGGER and must be set before the first clock. Has no effect
+    // unless tracing is enabled
+    void trace_trigger(std::function<bool()> trigger) {
+        if constexpr (traced) {
+            trace.set_trigger(std::move(trigger));
+        }
+    }
+
+    // Profile a state register for this test when FSM_PROFILE is set.
+    // Register from SetUp(), before the first clock
+    void profile_fsm(const std::string_view& name,
+                     std::function<uint32_t()> read_state,
+                     std::vector<std::string> state_names) {
+        fsm_profile.add(name, std::move(read_state), std::move(state_names));
+    }
+
+    // Checkpoints are shared by every test in the binary. Restoring also
+    // restores the model inputs to their values at the time of the save
+    void save_checkpoint(const std::string_view& name) requires SavableModel<T> {
+        // Written aside and renamed so models running on other threads
+        // never restore a partial checkpoint
+        const std::filesystem::path fname = checkpoint_file(name);
+        std::filesystem::path tmp_fname = fname;
+        tmp_fname += std::format(".{}", std::hash<std::thread::id>{}(std::this_thread::get_id()));
+
+        VerilatedSave os;
+        os.open(tmp_fname.c_str());
+        os << timeui << clk_cnt << *mod;
+        os.close();
+        std::filesystem::rename(tmp_fname, fname);
+    }
+
+    bool restore_checkpoint(const std::string_view& name) requires SavableModel<T> {
+        const std::filesystem::path fname = checkpoint_file(name);
+        if (!std::filesystem::exists(fname)) {
+            return false;
+        }
+
+        uint64_t saved_timeui;
+        VerilatedRestore is;
+        is.open(fname.c_str());
+        is >> saved_timeui >> clk_cnt >> *mod;
+        is.close();
+
+        // Never step the trace backwards when restoring an earlier checkpoint
+        timeui = std::max(timeui, saved_timeui);
+        return true;
+    }
+
+    bool has_checkpoint(const std::string_view& name) {
+        return std::filesystem::exists(checkpoint_file(name));
     }
 
-    
+    // Tracks a named, well-known model state (e.g. "reset"). The state is only
+    // valid until the next clock, so a checkpoint of it can safely be
+    // restored in place of simulating the sequence again
+    void mark_known_state(const std::string_view& name) {
+        known_state = name;
+        known_state_clk_cnt = clk_cnt;
+    }
+
+    bool in_known_state(const std::string_view& name) {
+        return known_state == name &&
+               known_state_clk_cnt == clk_cnt;
+    }
+
+    // Appended to the names of per-test traces and FSM profiles. Set before
+    // SetUp() to keep runs of the same test apart
+    std::string trace_suffix;
+
     uint64_t timeui;
     uint64_t clk_cnt;
     std::unique_ptr<VerilatedContext> vctx;
-    std::unique_ptr<VerilatedVcdC> vcd;
     std::unique_ptr<T> mod;
+    ModTrace<ModTraceFile> trace;
+    ModFsmProfile fsm_profile;
+
+    private:
+    // test_<suite>_<name><trace_suffix>, naming per-test output files
+    std::string test_name() {
+        auto ut = ::testing::UnitTest::GetInstance();
+        auto test = ut->current_test_info();
+        std::stringstream name;
+        name << "test";
+        if (test != nullptr) {
+            name << "_" << test->test_suite_name() <<
+                    "_" << test->name();
+        }
+        name << trace_suffix;
+        return name.str();
+    }
+
+    // Triggers named by TRACE_TRIGGER, for the models that have the ports.
+    // A misspelt name fails the test instead of tracing the whole run
+    void set_config_trigger(const std::string& trigger) {
+        if (trigger.empty()) {
+            return;
+        } else if (trigger == "sop") {
+            if constexpr (requires { mod->bus_sop; }) {
+                trace.set_trigger([this] { return mod->bus_sop != 0; });
+            }
+        } else if (trigger == "bad_packet") {
+            if constexpr (requires { mod->packet_eop; mod->packet_good; }) {
+                trace.set_trigger([this] {
+                    return mod->packet_eop != 0 && mod->packet_good == 0;
+                });
+            }
+        } else {
+            FAIL() << std::format("Unknown TRACE_TRIGGER \"{}\", expected one of: sop, bad_packet",
+                                  trigger);
+        }
+    }
+
+    std::filesystem::path checkpoint_file(const std::string_view& name) {
+        return checkpoint_path(std::format("{}.{}", typeid(T).name(), name));
+    }
 
+    std::string known_state;
+    uint64_t known_state_clk_cnt;
 };
 
-template <typename T>
-class ClockedModTest : public ModTest<T> {
+// A test fixture that can be set up outside of a TEST_F body, e.g. on a
+// worker thread or in a benchmark
+template <typename Fixture>
+class StandaloneModTest : public Fixture {
+    public:
+    void TestBody() override {}
+};
+
+template <typename T, typename TracePolicy = DefaultTracePolicy<T>>
+class ClockedModTest : public ModTest<T, TracePolicy> {
 
     public:
+    static constexpr bool traced = ModTest<T, TracePolicy>::traced;
+
     void clk() {
-        this->timeui += 1;
-        this->mod->clk48 = 0;
+        T* const m = this->mod.get();
+
+        if constexpr (traced) {
+            this->timeui += 1;
+        }
+        m->clk48 = 0;
         this->eval();
 
-        this->timeui += 1;
-        this->mod->clk48 = 1;
+        if constexpr (traced) {
+            this->timeui += 1;
+        }
+        m->clk48 = 1;
         this->eval();
 
+        if (this->fsm_profile.enabled()) {
+            this->fsm_profile.sample();
+        }
+
         this->clk_cnt += 1;
     }
 
+    void run_cycles(uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            clk();
+        }
+    }
+
+    // Clock until pred() holds after a clock, for at most max_cycles clocks.
+    // Returns whether pred() was met
+    template <typename Pred>
+    bool run_until(Pred&& pred, uint64_t max_cycles) {
+        for (uint64_t i = 0; i < max_cycles; i++) {
+            clk();
+            if (pred()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Advance time by n clocks without evaluating the model. Trace time
+    // moves on by as much as n calls to clk() would
+    void skip_clks(uint64_t n) {
+        if constexpr (traced) {
+            this->timeui += 4 * n;
+        }
+        this->clk_cnt += n;
+        if (this->fsm_profile.enabled()) {
+            this->fsm_profile.skip(n);
+        }
+    }
+
     void reset() {
+        const bool from_init = this->in_known_state("init");
+
         this->mod->reset = 1;
 
-        clk();
-        clk();
-        clk();
+        run_cycles(3);
 
         this->mod->reset = 0;
-    }
 
-};
+        if (from_init) {
+            this->mark_known_state("reset");
+        }
+    }
 
-struct USBCaptureInput {
-    double time;
-    int dn, dp;
 };
 
-template <typename T>
-class UsbModTest : public ClockedModTest<T> {
+template <typename T, typename TracePolicy = DefaultTracePolicy<T>>
+class UsbModTest : public ClockedModTest<T, TracePolicy> {
 
     public:
+    // Hold SE0 until one clock before the device detects a bus reset.
+    // Starting from a fresh reset() the result is simulated once per test
+    // binary and restored from a checkpoint afterwards
     void bus_reset() {
+        const bool from_reset = this->in_known_state("reset");
+
+        if constexpr (SavableModel<T>) {
+            if (from_reset && this->restore_checkpoint("bus_reset")) {
+                this->mark_known_state("bus_reset");
+                return;
+            }
+        }
+
         this->mod->dn = 0;
         this->mod->dp = 0;
-        for (int i = 0; i < (360000-1); i++) {
-            this->clk();
+        this->run_cycles(360000-1);
+
+        if constexpr (SavableModel<T>) {
+            if (from_reset) {
+                this->save_checkpoint("bus_reset");
+                this->mark_known_state("bus_reset");
+            }
+        }
+    }
+
+    // Play resampled capture edges, clocking straight through the gap before
+    // each one. on_clk runs after every clock and returns false to pause
+    // playback; the returned iterator resumes it
+    template <typename EdgeIterator>
+    EdgeIterator play_capture(EdgeIterator edge, EdgeIterator end) {
+        return play_capture_impl<false>(edge, end,
+                                        [] { return true; },
+                                        [] { return false; });
+    }
+
+    template <typename EdgeIterator, typename ClkFn>
+    EdgeIterator play_capture(EdgeIterator edge, EdgeIterator end, ClkFn&& on_clk) {
+        return play_capture_impl<false>(edge, end, on_clk,
+                                        [] { return false; });
+    }
+
+    // As above, but fast-forward long idle (J) gaps once quiescent() reports
+    // that the model has nothing pending. Skipped clocks are not evaluated,
+    // so quiescent() must only hold when the model state is static on an
+    // idle bus
+    template <typename EdgeIterator, typename ClkFn, typename QuiescentFn>
+    EdgeIterator play_capture(EdgeIterator edge, EdgeIterator end,
+                              ClkFn&& on_clk, QuiescentFn&& quiescent) {
+        return play_capture_impl<true>(edge, end, on_clk, quiescent);
+    }
+
+    // Clocks run on an idle bus before quiescent() is consulted
+    static constexpr uint64_t CAPTURE_SKIP_SETTLE_CLKS = 64;
+
+    // Drive a packed waveform onto dp/dn, one sample per clock. on_clk runs
+    // after every clock. If it returns bool, returning false stops playback
+    // and play_waveform returns false
+    void play_waveform(const UsbUtils::JKWaveform& wave) {
+        play_waveform(wave, [] {});
+    }
+
+    template <typename ClkFn>
+    bool play_waveform(const UsbUtils::JKWaveform& wave, ClkFn&& on_clk) {
+        const auto& words = wave.words();
+        for (size_t i = 0; i < words.size(); i++) {
+            uint64_t lines = words[i];
+            for (unsigned s = wave.word_samples(i); s > 0; s--) {
+                this->mod->dp = lines & 1;
+                this->mod->dn = (lines >> 1) & 1;
+                lines >>= 2;
+                this->clk();
+                if constexpr (std::is_same_v<std::invoke_result_t<ClkFn&>, bool>) {
+                    if (!on_clk()) {
+                        return false;
+                    }
+                } else {
+                    on_clk();
+                }
+            }
         }
+        return true;
+    }
 
+    private:
+    template <bool SkipIdle, typename EdgeIterator, typename ClkFn, typename QuiescentFn>
+    EdgeIterator play_capture_impl(EdgeIterator edge, EdgeIterator end,
+                                   ClkFn&& on_clk, QuiescentFn&& quiescent) {
+        while (edge != end) {
+            // Every edge is held for at least one clock, even if the
+            // caller clocked past it while playback was paused
+            const uint64_t edge_cycle = std::max(edge->cycle, capture_clk_cnt + 1);
+            bool playing = true;
+
+            if constexpr (SkipIdle) {
+                if (this->mod->dp == 1 && this->mod->dn == 0 &&
+                    edge_cycle > this->clk_cnt + CAPTURE_SKIP_SETTLE_CLKS) {
+                    const uint64_t settle_cycle = this->clk_cnt + CAPTURE_SKIP_SETTLE_CLKS;
+                    while (playing && this->clk_cnt < settle_cycle) {
+                        this->clk();
+                        playing = on_clk();
+                    }
+                    if (playing && quiescent()) {
+                        this->skip_clks(edge_cycle - this->clk_cnt);
+                    }
+                }
+            }
+
+            while (playing && this->clk_cnt < edge_cycle) {
+                this->clk();
+                playing = on_clk();
+            }
+
+            if (this->clk_cnt >= edge_cycle) {
+                this->mod->dn = edge->dn;
+                this->mod->dp = edge->dp;
+                capture_clk_cnt = this->clk_cnt;
+                ++edge;
+            }
+
+            if (!playing) {
+                break;
+            }
+        }
+        return edge;
     }
 
-    template <typename InputIterator>
-    InputIterator step_capture(InputIterator cap_iter) {
-        const double now = this->clk_cnt * (1. / (48.*1000.*1000.));
+    uint64_t capture_clk_cnt = 0;
+};
 
+// Drives the packet_decoder output interface of a model that takes decoded
+// packets in place of dp/dn (e.g. transaction_core). Signals follow the
+// order packet_decoder produces them in: bus_sop, the PID, one byte_out
+// strobe per byte after the PID and a packet_eop clock, with the PID and
+// token fields held for a clock after it. Bytes are byte_clks apart
+// instead of 32 clocks or more on the wire
+template <typename T, typename TracePolicy = DefaultTracePolicy<T>>
+class PacketModTest : public ClockedModTest<T, TracePolicy> {
+
+    public:
+    // Bytes from the PID to the CRC. packet_good is set when the bytes
+    // decode as a valid packet
+    void play_packet(std::span<const uint8_t> bytes) {
+        play_packet(bytes, UsbUtils::UsbPacketView::decode(bytes).has_value());
+    }
+
+    void play_packet(std::span<const uint8_t> bytes, bool good) {
+        T* const m = this->mod.get();
+
+        m->bus_sop = 1;
+        this->clk();
+        m->bus_sop = 0;
+
+        if (!bytes.empty()) {
+            m->packet_pid_out = bytes[0] & 0xF;
+            m->packet_pid_valid = (bytes[0] & 0xF) == ((~bytes[0] >> 4) & 0xF) &&
+                                  (bytes[0] & 0xF) != UsbUtils::PID_INVALID;
+        }
         this->clk();
-        if (now > cap_iter->time) {
-            this->mod->dn = cap_iter->dn;
-            this->mod->dp = cap_iter->dp;
-            cap_iter++;
+
+        uint16_t token = 0;
+        for (size_t i = 1; i < bytes.size(); i++) {
+            if (i < 3) {
+                token |= bytes[i] << (8 * (i - 1));
+            }
+            if (i == 2) {
+                m->packet_addr = token & 0x7F;
+                m->packet_endp = (token >> 7) & 0xF;
+                m->packet_frame = token & 0x7FF;
+            }
+
+            m->byte_out = bytes[i];
+            m->byte_out_valid = 1;
+            this->clk();
+            m->byte_out_valid = 0;
+            this->run_cycles(byte_clks - 1);
         }
-        return cap_iter;
+
+        m->packet_eop = 1;
+        m->packet_good = good;
+        this->clk();
+        m->packet_eop = 0;
+        m->packet_good = 0;
+        m->packet_pid_valid = 0;
+        this->clk();
+
+        m->packet_pid_out = 0;
+        m->packet_addr = 0;
+        m->packet_endp = 0;
+        m->packet_frame = 0;
+        m->byte_out = 0;
+    }
+
+    void play_packet(const UsbUtils::UsbPacket& packet) {
+        std::vector<uint8_t> bytes;
+        packet.view().append_bytes(bytes);
+        play_packet(bytes, true);
     }
+
+    // Hold bus_reset for a clock, as packet_decoder does once the bus has
+    // been in SE0 for the reset time
+    void bus_reset() {
+        this->mod->bus_reset = 1;
+        this->clk();
+        this->mod->bus_reset = 0;
+    }
+
+    // Clocks between byte_out strobes, at least 1
+    unsigned byte_clks = 1;
 };
 
-std::vector<USBCaptureInput> load_usb_capture(std::string capture_fname);
 std::vector<std::vector<uint8_t>> load_usb_decoder_output(std::string decoder_fname);
 
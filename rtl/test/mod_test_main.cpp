@@ -0,0 +1,19 @@
+
+#include <gtest/gtest.h>
+#include <verilated.h>
+
+#include "mod_test.hpp"
+
+int main(int argc, char** argv) {
+
+    int res;
+
+    Verilated::commandArgs(argc, argv);
+
+    // Each test creates its own context, which sees the same +verilator+ args
+    mod_test_set_command_args(argc, argv);
+
+    ::testing::InitGoogleTest(&argc, argv);
+
+    return RUN_ALL_TESTS();
+}
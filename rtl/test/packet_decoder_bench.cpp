@@ -0,0 +1,51 @@
+#include "mod_bench.hpp"
+#include "Vpacket_decoder.h"
+
+template <ModBenchTrace Trace>
+static void run_packets(benchmark::State& state,
+                        const std::vector<UsbUtils::JKEncoder>& encoders,
+                        uint64_t payload_bytes) {
+    ModBench<ModBenchFixture<UsbModTest, Vpacket_decoder, Trace>, Trace> bench(state, "packet_decoder");
+
+    std::vector<UsbUtils::BusState> states;
+    for (const auto& encoder : encoders) {
+        auto packet = bus_states(encoder);
+        states.insert(states.end(), packet.begin(), packet.end());
+        states.insert(states.end(), 16, UsbUtils::BUS_J);
+    }
+
+    bench->reset();
+
+    for (auto _ : state) {
+        for (auto bus : states) {
+            drive_bus_state(bench->mod.get(), bus);
+            bench->clk();
+        }
+        bench.count_packets(encoders.size(), payload_bytes);
+    }
+}
+
+// SETUP, DATA0 (8 byte request) and ACK, as seen during enumeration
+template <ModBenchTrace Trace>
+static void BM_PacketDecoderSetupTxn(benchmark::State& state) {
+    std::vector<uint8_t> request = {0x80,0x06,0x00,0x01,0x00,0x00,0x40,0x00};
+    run_packets<Trace>(state, {
+        UsbUtils::JKEncoder::create_token_packet(UsbUtils::PID_SETUP, 0, 0),
+        UsbUtils::JKEncoder::create_data_packet(UsbUtils::PID_DATA0, request),
+        UsbUtils::JKEncoder::create_handshake_packet(UsbUtils::PID_ACK)
+    }, request.size());
+}
+MOD_BENCHMARK(BM_PacketDecoderSetupTxn);
+
+// Maximum size full speed bulk packet
+template <ModBenchTrace Trace>
+static void BM_PacketDecoderData64(benchmark::State& state) {
+    std::vector<uint8_t> data(64);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = i * 37;
+    }
+    run_packets<Trace>(state, {
+        UsbUtils::JKEncoder::create_data_packet(UsbUtils::PID_DATA1, data)
+    }, data.size());
+}
+MOD_BENCHMARK(BM_PacketDecoderData64);
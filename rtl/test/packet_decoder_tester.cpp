@@ -1,11 +1,26 @@
 
+#include <print>
 #include <random>
 
+#include "mod_lockstep.hpp"
+#include "mod_regress.hpp"
 #include "mod_test.hpp"
 #include "usb_utils.hpp"
+#include "rtl_fsm_states.hpp"
 #include "Vpacket_decoder.h"
+#include "Vpacket_decoder___024root.h"
 
-typedef UsbModTest<Vpacket_decoder> PacketDecoderTest;
+class PacketDecoderTest : public UsbModTest<Vpacket_decoder> {
+
+    public:
+    void SetUp() override {
+        UsbModTest::SetUp();
+        profile_fsm("packet_state", [this] { return mod->rootp->packet_decoder__DOT__packet_state; },
+                    PACKET_DECODER_STATES);
+        profile_fsm("jk0.decoder_state", [this] { return mod->rootp->packet_decoder__DOT__jk0__DOT__decoder_state; },
+                    JK_DECODER_STATES);
+    }
+};
 
 TEST_F(PacketDecoderTest, Reset) {
     reset();
@@ -19,20 +34,14 @@ TEST_F(PacketDecoderTest, Reset) {
 TEST_F(PacketDecoderTest, SOF) {
     reset();
 
-    std::vector<USBCaptureInput> capture_entries = load_usb_capture("bus_captures/sof_capture.csv");
-    ASSERT_GT(capture_entries.size(), 0);
+    USBCaptureFile capture("bus_captures/sof_capture.csv");
+    ASSERT_GT(capture.size(), 0);
     this->mod->dn = 0;
     this->mod->dp = 0;
 
-    auto cap_iter = capture_entries.begin();
+    auto until_eop = [this] { return !mod->packet_eop; };
 
-    while (cap_iter != capture_entries.end()) {
-        cap_iter = this->step_capture(cap_iter);
-
-        if (mod->packet_eop) {
-            break;
-        }
-    }
+    play_capture(capture.begin(), capture.end(), until_eop);
 
     ASSERT_EQ(mod->packet_eop, 1);
     ASSERT_EQ(mod->packet_good, 1);
@@ -41,25 +50,41 @@ TEST_F(PacketDecoderTest, SOF) {
     ASSERT_EQ(mod->packet_frame, 0x0b9);
 }
 
+// The capture whose uneven bit times the three sample vote and edge
+// tracking of jk_decoder are there for
+TEST_F(PacketDecoderTest, AckPoorTiming) {
+    reset();
+
+    USBCaptureFile capture("bus_captures/ack_poor_capture.csv");
+    ASSERT_GT(capture.size(), 0);
+    this->mod->dn = 0;
+    this->mod->dp = 0;
+
+    auto until_eop = [this] { return !mod->packet_eop; };
+
+    play_capture(capture.begin(), capture.end(), until_eop);
+
+    ASSERT_EQ(mod->packet_eop, 1);
+    ASSERT_EQ(mod->packet_good, 1);
+    ASSERT_EQ(mod->packet_pid_out, UsbUtils::PID_ACK);
+    ASSERT_EQ(mod->packet_pid_valid, 1);
+}
+
 
 TEST_F(PacketDecoderTest, SetupTransaction) {
     reset();
 
-    std::vector<USBCaptureInput> capture_entries = load_usb_capture("bus_captures/setup_txn_capture.csv");
-    ASSERT_GT(capture_entries.size(), 0);
+    USBCaptureFile capture("bus_captures/setup_txn_capture.csv");
+    ASSERT_GT(capture.size(), 0);
     this->mod->dn = 0;
     this->mod->dp = 0;
 
-    auto cap_iter = capture_entries.begin();
+    auto until_eop = [this] { return !mod->packet_eop; };
 
-    // Setup packet
-    while (cap_iter != capture_entries.end()) {
-        cap_iter = this->step_capture(cap_iter);
+    auto edge = capture.begin();
 
-        if (mod->packet_eop) {
-            break;
-        }
-    }
+    // Setup packet
+    edge = play_capture(edge, capture.end(), until_eop);
 
     ASSERT_EQ(mod->packet_eop, 1);
     ASSERT_EQ(mod->packet_good, 1);
@@ -72,17 +97,12 @@ TEST_F(PacketDecoderTest, SetupTransaction) {
     clk();
     ASSERT_EQ(mod->packet_eop, 0);
     std::vector<uint8_t> byte_buffer;
-    while (cap_iter != capture_entries.end()) {
-        cap_iter = this->step_capture(cap_iter);
-
+    edge = play_capture(edge, capture.end(), [&] {
         if (mod->byte_out_valid) {
             byte_buffer.push_back(mod->byte_out);
         }
-
-        if (mod->packet_eop) {
-            break;
-        }
-    }
+        return !mod->packet_eop;
+    });
     std::vector<uint8_t> exp_byte_buffer = {0x80,0x06,0x00,0x01,0x00,0x00,0x40,0x00,0xdd,0x94};
 
     ASSERT_EQ(mod->packet_eop, 1);
@@ -94,49 +114,20 @@ TEST_F(PacketDecoderTest, SetupTransaction) {
     // ACK packet
     clk();
     ASSERT_EQ(mod->packet_eop, 0);
-    while (cap_iter != capture_entries.end()) {
-        cap_iter = this->step_capture(cap_iter);
-
-        if (mod->packet_eop) {
-            break;
-        }
-    }
+    play_capture(edge, capture.end(), until_eop);
     ASSERT_EQ(mod->packet_eop, 1);
     ASSERT_EQ(mod->packet_pid_out, UsbUtils::PID_ACK);
     ASSERT_EQ(mod->packet_pid_valid, 1);
 }
 
-void step_packet(PacketDecoderTest& tester, UsbUtils::JKEncoder encoder, std::vector<uint8_t>* payload) {
-
-    while (!encoder.is_complete()) {
-
-        UsbUtils::BusState next_state = encoder.step();
-
-        ASSERT_NE(next_state, UsbUtils::BUS_INVALID);
-        switch (next_state) {
-            case UsbUtils::BUS_SE0:
-                tester.mod->dn = 0;
-                tester.mod->dp = 0;
-                break;
-            case UsbUtils::BUS_J:
-                tester.mod->dn = 0;
-                tester.mod->dp = 1;
-                break;
-            case UsbUtils::BUS_K:
-                tester.mod->dn = 1;
-                tester.mod->dp = 0;
-                break;
-            default:
-                ASSERT_TRUE(false);
-                break;
-        }
-        tester.clk();
+void step_packet(PacketDecoderTest& tester, const UsbUtils::JKWaveform& wave, std::vector<uint8_t>* payload) {
 
+    tester.play_waveform(wave, [&] {
         if (tester.mod->byte_out_valid &&
             payload != nullptr) {
             payload->push_back(tester.mod->byte_out);
         }
-    }
+    });
 
     tester.clk();
 }
@@ -144,10 +135,10 @@ void step_packet(PacketDecoderTest& tester, UsbUtils::JKEncoder encoder, std::ve
 TEST_F(PacketDecoderTest, InPacket) {
     reset();
 
-    UsbUtils::JKEncoder encoder =
-        UsbUtils::JKEncoder::create_token_packet(UsbUtils::PID_IN, 0x32, 0x4);
+    UsbUtils::JKWaveform wave;
+    UsbUtils::JKBatchEncoder::append_token_packet(wave, UsbUtils::PID_IN, 0x32, 0x4);
 
-    step_packet(*this, encoder, nullptr);
+    step_packet(*this, wave, nullptr);
 
     ASSERT_EQ(mod->packet_eop, 1);
     ASSERT_EQ(mod->packet_good, 1);
@@ -160,10 +151,10 @@ TEST_F(PacketDecoderTest, InPacket) {
 TEST_F(PacketDecoderTest, OutPacket) {
     reset();
 
-    UsbUtils::JKEncoder encoder =
-        UsbUtils::JKEncoder::create_token_packet(UsbUtils::PID_OUT, 0x5C, 0x1);
+    UsbUtils::JKWaveform wave;
+    UsbUtils::JKBatchEncoder::append_token_packet(wave, UsbUtils::PID_OUT, 0x5C, 0x1);
 
-    step_packet(*this, encoder, nullptr);
+    step_packet(*this, wave, nullptr);
 
     ASSERT_EQ(mod->packet_eop, 1);
     ASSERT_EQ(mod->packet_good, 1);
@@ -176,10 +167,10 @@ TEST_F(PacketDecoderTest, OutPacket) {
 TEST_F(PacketDecoderTest, SetupPacket) {
     reset();
 
-    UsbUtils::JKEncoder encoder =
-        UsbUtils::JKEncoder::create_token_packet(UsbUtils::PID_SETUP, 0, 0);
+    UsbUtils::JKWaveform wave;
+    UsbUtils::JKBatchEncoder::append_token_packet(wave, UsbUtils::PID_SETUP, 0, 0);
 
-    step_packet(*this, encoder, nullptr);
+    step_packet(*this, wave, nullptr);
 
     ASSERT_EQ(mod->packet_eop, 1);
     ASSERT_EQ(mod->packet_good, 1);
@@ -192,10 +183,10 @@ TEST_F(PacketDecoderTest, SetupPacket) {
 TEST_F(PacketDecoderTest, SofPacket) {
     reset();
 
-    UsbUtils::JKEncoder encoder =
-        UsbUtils::JKEncoder::create_sof_packet(0x321);
+    UsbUtils::JKWaveform wave;
+    UsbUtils::JKBatchEncoder::append_sof_packet(wave, 0x321);
 
-    step_packet(*this, encoder, nullptr);
+    step_packet(*this, wave, nullptr);
 
     ASSERT_EQ(mod->packet_eop, 1);
     ASSERT_EQ(mod->packet_good, 1);
@@ -208,10 +199,10 @@ TEST_F(PacketDecoderTest, SofPacket) {
 TEST_F(PacketDecoderTest, AckPacket) {
     reset();
 
-    UsbUtils::JKEncoder encoder =
-        UsbUtils::JKEncoder::create_handshake_packet(UsbUtils::PID_ACK);
+    UsbUtils::JKWaveform wave;
+    UsbUtils::JKBatchEncoder::append_handshake_packet(wave, UsbUtils::PID_ACK);
 
-    step_packet(*this, encoder, nullptr);
+    step_packet(*this, wave, nullptr);
 
     ASSERT_EQ(mod->packet_eop, 1);
     ASSERT_EQ(mod->packet_good, 1);
@@ -222,10 +213,10 @@ TEST_F(PacketDecoderTest, AckPacket) {
 TEST_F(PacketDecoderTest, NakPacket) {
     reset();
 
-    UsbUtils::JKEncoder encoder =
-        UsbUtils::JKEncoder::create_handshake_packet(UsbUtils::PID_NAK);
+    UsbUtils::JKWaveform wave;
+    UsbUtils::JKBatchEncoder::append_handshake_packet(wave, UsbUtils::PID_NAK);
 
-    step_packet(*this, encoder, nullptr);
+    step_packet(*this, wave, nullptr);
 
     ASSERT_EQ(mod->packet_eop, 1);
     ASSERT_EQ(mod->packet_good, 1);
@@ -237,12 +228,12 @@ TEST_F(PacketDecoderTest, Data0Packet) {
     reset();
 
     std::vector<uint8_t> exp_data = {0x55,0xAB, 0xF7, 0x02};
-    UsbUtils::JKEncoder encoder =
-        UsbUtils::JKEncoder::create_data_packet(UsbUtils::PID_DATA0,
-                           exp_data);
+    UsbUtils::JKWaveform wave;
+    UsbUtils::JKBatchEncoder::append_data_packet(wave, UsbUtils::PID_DATA0,
+                                                 exp_data);
 
     std::vector<uint8_t> act_data;
-    step_packet(*this, encoder, &act_data);
+    step_packet(*this, wave, &act_data);
     
 
     ASSERT_EQ(mod->packet_eop, 1);
@@ -261,12 +252,12 @@ TEST_F(PacketDecoderTest, Data1Packet) {
     reset();
 
     std::vector<uint8_t> exp_data = {0xFF, 0xFF, 0xFF, 0xFF, 0x75, 0x77, 0x22, 0xFF};
-    UsbUtils::JKEncoder encoder =
-        UsbUtils::JKEncoder::create_data_packet(UsbUtils::PID_DATA1,
-                           exp_data);
+    UsbUtils::JKWaveform wave;
+    UsbUtils::JKBatchEncoder::append_data_packet(wave, UsbUtils::PID_DATA1,
+                                                 exp_data);
 
     std::vector<uint8_t> act_data;
-    step_packet(*this, encoder, &act_data);
+    step_packet(*this, wave, &act_data);
     
 
     ASSERT_EQ(mod->packet_eop, 1);
@@ -285,12 +276,12 @@ TEST_F(PacketDecoderTest, DataZero) {
     reset();
 
     std::vector<uint8_t> exp_data;
-    UsbUtils::JKEncoder encoder =
-        UsbUtils::JKEncoder::create_data_packet(UsbUtils::PID_DATA0,
-                           exp_data);
+    UsbUtils::JKWaveform wave;
+    UsbUtils::JKBatchEncoder::append_data_packet(wave, UsbUtils::PID_DATA0,
+                                                 exp_data);
 
     std::vector<uint8_t> act_data;
-    step_packet(*this, encoder, &act_data);
+    step_packet(*this, wave, &act_data);
     
 
     ASSERT_EQ(mod->packet_eop, 1);
@@ -311,6 +302,8 @@ TEST_F(PacketDecoderTest, DataRandomPacket) {
     std::uniform_int_distribution<std::mt19937::result_type> dist_pid(0,1);
     std::uniform_int_distribution<std::mt19937::result_type> dist_len(0,1023);
 
+    UsbUtils::JKWaveform wave;
+
     for (int i = 0; i < 100; i++) {
         int len = dist_len(rng);
         std::vector<uint8_t> data(len);
@@ -320,11 +313,11 @@ TEST_F(PacketDecoderTest, DataRandomPacket) {
 
         UsbUtils::Pid pid = dist_pid(rng) == 0 ? UsbUtils::PID_DATA0 : UsbUtils::PID_DATA1;
 
-        UsbUtils::JKEncoder encoder = 
-            UsbUtils::JKEncoder::create_data_packet(pid, data);
+        wave.clear();
+        UsbUtils::JKBatchEncoder::append_data_packet(wave, pid, data);
 
         std::vector<uint8_t> act_data;
-        step_packet(*this, encoder, &act_data);
+        step_packet(*this, wave, &act_data);
 
         ASSERT_EQ(mod->packet_eop, 1);
         ASSERT_EQ(mod->packet_good, 1);
@@ -341,3 +334,337 @@ TEST_F(PacketDecoderTest, DataRandomPacket) {
     }
 }
 
+
+// The DATA packet CRC check is registered from the byte stream ahead of the
+// EOP, so packet_good has nothing left to compute when packet_eop rises.
+// Reports how many clocks ahead it settles
+TEST_F(PacketDecoderTest, Crc16Slack) {
+    reset();
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist_byte(0, 255);
+
+    for (size_t len : {0, 1, 8, 64, 1023}) {
+        std::vector<uint8_t> data(len);
+        for (auto& b : data) {
+            b = dist_byte(rng);
+        }
+
+        UsbUtils::JKWaveform wave;
+        UsbUtils::JKBatchEncoder::append_data_packet(wave, UsbUtils::PID_DATA0, data);
+
+        uint64_t settled_clk = 0;
+        bool crc16_good = false;
+        auto track = [&] {
+            const bool good = mod->rootp->packet_decoder__DOT__crc16_good;
+            if (good && !crc16_good) {
+                settled_clk = clk_cnt;
+            }
+            crc16_good = good;
+            return !mod->packet_eop;
+        };
+
+        if (play_waveform(wave, track)) {
+            run_until([&] { return !track(); }, 16);
+        }
+
+        ASSERT_EQ(mod->packet_eop, 1);
+        ASSERT_EQ(mod->packet_good, 1);
+        ASSERT_TRUE(crc16_good);
+
+        const uint64_t slack = clk_cnt - settled_clk;
+        ASSERT_GE(slack, 2) << len << " bytes";
+        std::println("{:>4} bytes: CRC16 settled {} clks before packet_eop", len, slack);
+
+        clk();
+    }
+}
+
+// One random DATA packet per seed, run in parallel over REGRESS_SEEDS seeds.
+// See mod_regress.hpp for scaling the run up and replaying failures
+TEST(PacketDecoderRegression, DataRandomPacket) {
+    ModRegressionConfig config = mod_regression_config_from_env(256);
+
+    run_regression<PacketDecoderTest>(config, [](PacketDecoderTest& tester, uint64_t seed) {
+        tester.reset();
+
+        std::mt19937_64 rng(seed);
+        std::uniform_int_distribution<int> dist_byte(0,255);
+        std::uniform_int_distribution<int> dist_pid(0,1);
+        std::uniform_int_distribution<int> dist_len(0,1023);
+
+        std::vector<uint8_t> data(dist_len(rng));
+        for (auto& b : data) {
+            b = dist_byte(rng);
+        }
+
+        UsbUtils::Pid pid = dist_pid(rng) == 0 ? UsbUtils::PID_DATA0 : UsbUtils::PID_DATA1;
+
+        UsbUtils::JKWaveform wave;
+        UsbUtils::JKBatchEncoder::append_data_packet(wave, pid, data);
+
+        std::vector<uint8_t> act_data;
+        step_packet(tester, wave, &act_data);
+
+        ASSERT_EQ(tester.mod->packet_eop, 1);
+        ASSERT_EQ(tester.mod->packet_good, 1);
+        ASSERT_EQ(tester.mod->packet_pid_valid, 1);
+        ASSERT_EQ(tester.mod->packet_pid_out, pid);
+
+        ASSERT_EQ(act_data.size(), data.size() + 2);
+        // Pop CRC bytes off
+        act_data.pop_back();
+        act_data.pop_back();
+        ASSERT_EQ(act_data, data);
+    });
+}
+
+// The waveform of wave, four clocks per bit, re-timed to clks_per_bit with
+// every edge moved by up to jitter_clks either way. The single J after the
+// EOP is kept as it is
+template <typename Rng>
+static UsbUtils::JKWaveform retime_waveform(const UsbUtils::JKWaveform& wave, double clks_per_bit,
+                                            double jitter_clks, Rng& rng) {
+    std::uniform_real_distribution<double> dist_jitter(-jitter_clks, jitter_clks);
+
+    const size_t bits = wave.size() / 4;
+    UsbUtils::JKWaveform out;
+    size_t clk = 0;
+    for (size_t i = 0; i < bits; i++) {
+        const double edge = (i + 1) * clks_per_bit + (i + 1 < bits ? dist_jitter(rng) : 0.0);
+        for (; clk < edge; clk++) {
+            out.append(wave.line(4 * i), 1);
+        }
+    }
+    for (size_t i = bits * 4; i < wave.size(); i++) {
+        out.append(wave.line(i), 1);
+    }
+    return out;
+}
+
+// Max length packets from a host off 12 Mbit/s by as much as the spec allows
+// either way, with and without edge jitter. Over a packet the bits drift
+// more than a bit time from where SOP put them, so the decoder only gets
+// them right by following the edges
+TEST_F(PacketDecoderTest, ClockDrift) {
+    reset();
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist_byte(0, 255);
+
+    for (double drift : {-0.0025, 0.0025}) {
+        for (double jitter : {0.0, 0.4}) {
+            std::vector<uint8_t> data(1023);
+            for (auto& b : data) {
+                b = dist_byte(rng);
+            }
+
+            UsbUtils::JKWaveform wave;
+            UsbUtils::JKBatchEncoder::append_data_packet(wave, UsbUtils::PID_DATA0, data);
+
+            std::vector<uint8_t> act_data;
+            step_packet(*this, retime_waveform(wave, 4 * (1 + drift), jitter, rng), &act_data);
+
+            ASSERT_EQ(mod->packet_eop, 1) << "drift " << drift << " jitter " << jitter;
+            ASSERT_EQ(mod->packet_good, 1) << "drift " << drift << " jitter " << jitter;
+            ASSERT_EQ(mod->packet_pid_out, UsbUtils::PID_DATA0);
+
+            ASSERT_EQ(act_data.size(), data.size() + 2);
+            act_data.resize(data.size());
+            ASSERT_EQ(act_data, data);
+
+            clk();
+        }
+    }
+}
+
+// Random packets at a random rate within the spec's tolerance and random
+// edge jitter, one per seed
+TEST(PacketDecoderRegression, ClockDrift) {
+    ModRegressionConfig config = mod_regression_config_from_env(64);
+
+    run_regression<PacketDecoderTest>(config, [](PacketDecoderTest& tester, uint64_t seed) {
+        tester.reset();
+
+        std::mt19937_64 rng(seed);
+        std::uniform_int_distribution<int> dist_byte(0, 255);
+        std::uniform_int_distribution<int> dist_len(0, 1023);
+        std::uniform_real_distribution<double> dist_drift(-0.0025, 0.0025);
+        std::uniform_real_distribution<double> dist_jitter(0.0, 0.4);
+
+        std::vector<uint8_t> data(dist_len(rng));
+        for (auto& b : data) {
+            b = dist_byte(rng);
+        }
+
+        UsbUtils::JKWaveform wave;
+        UsbUtils::JKBatchEncoder::append_data_packet(wave, UsbUtils::PID_DATA1, data);
+
+        const double drift = dist_drift(rng);
+        const double jitter = dist_jitter(rng);
+        std::vector<uint8_t> act_data;
+        step_packet(tester, retime_waveform(wave, 4 * (1 + drift), jitter, rng), &act_data);
+
+        ASSERT_EQ(tester.mod->packet_eop, 1) << "drift " << drift << " jitter " << jitter;
+        ASSERT_EQ(tester.mod->packet_good, 1) << "drift " << drift << " jitter " << jitter;
+        ASSERT_EQ(tester.mod->packet_pid_out, UsbUtils::PID_DATA1);
+
+        ASSERT_EQ(act_data.size(), data.size() + 2);
+        act_data.resize(data.size());
+        ASSERT_EQ(act_data, data);
+    });
+}
+
+static PacketDecoderProbe probe(PacketDecoderTest& tester) {
+    return {
+        .bit_valid = tester.mod->rootp->packet_decoder__DOT__bus_bit_valid == 1,
+        .bit = tester.mod->rootp->packet_decoder__DOT__bus_bit_out,
+        .byte_valid = tester.mod->byte_out_valid == 1,
+        .byte = tester.mod->byte_out,
+        .eop = tester.mod->packet_eop == 1,
+        .pid_valid = tester.mod->packet_pid_valid == 1,
+        .pid = tester.mod->packet_pid_out,
+        .good = tester.mod->packet_good == 1
+    };
+}
+
+// Play a waveform with the RTL and the reference decoder in lockstep.
+// Returns false at the first mismatch
+static bool lockstep_waveform(PacketDecoderTest& tester, const UsbUtils::JKWaveform& wave,
+                              PacketDecoderLockstep& lockstep) {
+    return tester.play_waveform(wave, [&] {
+        return lockstep.step(tester.mod->dp, tester.mod->dn, probe(tester));
+    });
+}
+
+static void append_idle(UsbUtils::JKWaveform& wave, unsigned clks) {
+    for (unsigned i = 0; i < clks; i++) {
+        wave.append(UsbUtils::pack_line_state(1, 0), 1);
+    }
+}
+
+// A random token, SOF, handshake or DATA packet of up to 1023 bytes,
+// followed by a random stretch of idle
+template <typename Rng>
+static void append_random_packet(UsbUtils::JKWaveform& wave, Rng& rng) {
+    std::uniform_int_distribution<int> dist_kind(0, 3);
+    std::uniform_int_distribution<int> dist_byte(0, 255);
+    std::uniform_int_distribution<int> dist_len(0, 1023);
+    std::uniform_int_distribution<int> dist_idle(16, 48);
+
+    static const UsbUtils::Pid TOKEN_PIDS[] = {UsbUtils::PID_OUT, UsbUtils::PID_IN, UsbUtils::PID_SETUP};
+    static const UsbUtils::Pid HANDSHAKE_PIDS[] = {UsbUtils::PID_ACK, UsbUtils::PID_NAK, UsbUtils::PID_STALL};
+
+    switch (dist_kind(rng)) {
+        case 0:
+            UsbUtils::JKBatchEncoder::append_token_packet(wave, TOKEN_PIDS[dist_byte(rng) % 3],
+                                                          dist_byte(rng) & 0x7F, dist_byte(rng) & 0xF);
+            break;
+        case 1:
+            UsbUtils::JKBatchEncoder::append_sof_packet(wave, (dist_byte(rng) << 3) | (dist_byte(rng) & 0x7));
+            break;
+        case 2:
+            UsbUtils::JKBatchEncoder::append_handshake_packet(wave, HANDSHAKE_PIDS[dist_byte(rng) % 3]);
+            break;
+        default:
+        {
+            std::vector<uint8_t> data(dist_len(rng));
+            for (auto& b : data) {
+                b = dist_byte(rng);
+            }
+            UsbUtils::JKBatchEncoder::append_data_packet(wave, dist_byte(rng) & 1 ? UsbUtils::PID_DATA1 :
+                                                                                    UsbUtils::PID_DATA0,
+                                                         data);
+        }
+        break;
+    }
+
+    append_idle(wave, dist_idle(rng));
+}
+
+// Every decoded bit, byte and end of packet checked against the reference
+// decoder as it happens, over a stream of back to back packets
+TEST_F(PacketDecoderTest, Lockstep) {
+    reset();
+
+    std::mt19937 rng(42);
+    PacketDecoderLockstep lockstep;
+    UsbUtils::JKWaveform wave;
+
+    append_idle(wave, 16);
+    ASSERT_TRUE(lockstep_waveform(*this, wave, lockstep)) << lockstep.mismatch();
+
+    const int packets = 200;
+    for (int i = 0; i < packets; i++) {
+        wave.clear();
+        append_random_packet(wave, rng);
+        ASSERT_TRUE(lockstep_waveform(*this, wave, lockstep)) << lockstep.mismatch();
+    }
+
+    // Let anything still queued on one side time out
+    wave.clear();
+    append_idle(wave, 128);
+    ASSERT_TRUE(lockstep_waveform(*this, wave, lockstep)) << lockstep.mismatch();
+
+    ASSERT_EQ(lockstep.packets_checked(), packets);
+    ASSERT_EQ(lockstep.packets_skipped(), 0);
+    ASSERT_GT(lockstep.bytes_checked(), 0);
+}
+
+// A single corrupted RTL bit stops the run within a few clocks of it
+TEST_F(PacketDecoderTest, LockstepMismatch) {
+    reset();
+
+    std::vector<uint8_t> data(1023);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = i;
+    }
+
+    UsbUtils::JKWaveform wave;
+    append_idle(wave, 16);
+    UsbUtils::JKBatchEncoder::append_data_packet(wave, UsbUtils::PID_DATA0, data);
+    append_idle(wave, 128);
+
+    PacketDecoderLockstep lockstep;
+    uint64_t bits = 0;
+    uint64_t flip_clk = 0;
+    const bool complete = play_waveform(wave, [&] {
+        PacketDecoderProbe rtl = probe(*this);
+        if (rtl.bit_valid && bits++ == 1000) {
+            rtl.bit ^= 1;
+            flip_clk = lockstep.clks();
+        }
+        return lockstep.step(mod->dp, mod->dn, rtl);
+    });
+
+    ASSERT_FALSE(complete);
+    ASSERT_TRUE(lockstep.failed());
+    ASSERT_EQ(lockstep.bits_checked(), 1000);
+    ASSERT_LT(lockstep.clks() - flip_clk, 8);
+    ASSERT_NE(lockstep.mismatch().find("Bit 1000 of packet 0"), std::string::npos) << lockstep.mismatch();
+}
+
+// Streams of random packets per seed in lockstep with the reference decoder.
+// A failing seed stops at its first mismatch, with the clocks around it
+TEST(PacketDecoderRegression, Lockstep) {
+    ModRegressionConfig config = mod_regression_config_from_env(64);
+
+    run_regression<PacketDecoderTest>(config, [](PacketDecoderTest& tester, uint64_t seed) {
+        tester.reset();
+
+        std::mt19937_64 rng(seed);
+        PacketDecoderLockstep lockstep;
+        UsbUtils::JKWaveform wave;
+
+        append_idle(wave, 16);
+        for (int i = 0; i < 32; i++) {
+            append_random_packet(wave, rng);
+            ASSERT_TRUE(lockstep_waveform(tester, wave, lockstep)) << lockstep.mismatch();
+            wave.clear();
+        }
+
+        append_idle(wave, 128);
+        ASSERT_TRUE(lockstep_waveform(tester, wave, lockstep)) << lockstep.mismatch();
+        ASSERT_EQ(lockstep.packets_checked(), 32);
+    });
+}
@@ -0,0 +1,46 @@
+#include "mod_bench.hpp"
+#include "Vpacket_encoder.h"
+
+// The encoder starts sending on reset and holds done afterwards, so every
+// packet starts from reset()
+template <ModBenchTrace Trace>
+static void run_packet(benchmark::State& state, const UsbUtils::UsbPacket& packet) {
+    ModBench<ModBenchFixture<UsbModTest, Vpacket_encoder, Trace>, Trace> bench(state, "packet_encoder");
+
+    const auto& payload = packet.payload;
+
+    for (auto _ : state) {
+        bench->reset();
+
+        uint32_t idx = 0;
+        bench->mod->pid = packet.pid;
+        bench->mod->byte_in = payload.size() > 0 ? payload[0] : 0xFF;
+        bench->mod->last_byte = payload.size() <= 1;
+
+        while (!bench->mod->done) {
+            bench->clk();
+            if (bench->mod->byte_ack) {
+                idx++;
+                bench->mod->byte_in = idx < payload.size() ? payload[idx] : 0xFF;
+                bench->mod->last_byte = idx + 1 >= payload.size();
+            }
+        }
+        bench.count_packets(1, payload.size());
+    }
+}
+
+template <ModBenchTrace Trace>
+static void BM_PacketEncoderAck(benchmark::State& state) {
+    run_packet<Trace>(state, UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK));
+}
+MOD_BENCHMARK(BM_PacketEncoderAck);
+
+template <ModBenchTrace Trace>
+static void BM_PacketEncoderData64(benchmark::State& state) {
+    std::vector<uint8_t> data(64);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = i * 37;
+    }
+    run_packet<Trace>(state, UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA1, data));
+}
+MOD_BENCHMARK(BM_PacketEncoderData64);
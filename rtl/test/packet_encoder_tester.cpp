@@ -1,9 +1,22 @@
+#include <random>
 
 #include "mod_test.hpp"
 #include "usb_utils.hpp"
+#include "rtl_fsm_states.hpp"
 #include "Vpacket_encoder.h"
+#include "Vpacket_encoder___024root.h"
 
-typedef UsbModTest<Vpacket_encoder> PacketEncoderTest;
+class PacketEncoderTest : public UsbModTest<Vpacket_encoder> {
+
+    public:
+    void SetUp() override {
+        UsbModTest::SetUp();
+        profile_fsm("encoder_state", [this] { return mod->rootp->packet_encoder__DOT__encoder_state; },
+                    PACKET_ENCODER_STATES);
+        profile_fsm("jkenc0.encoder_state", [this] { return mod->rootp->packet_encoder__DOT__jkenc0__DOT__encoder_state; },
+                    JK_ENCODER_STATES);
+    }
+};
 
 TEST_F(PacketEncoderTest, Reset) {
     reset();
@@ -25,6 +38,7 @@ std::optional<UsbUtils::UsbPacket> packet_test(PacketEncoderTest& tester,
     UsbUtils::JKDecoder decoder;
 
     tester.mod->pid = packet.pid;
+    tester.mod->empty = packet.payload.empty();
 
     uint32_t idx = 0;
     int max_cycles = 10000;
@@ -104,6 +118,21 @@ TEST_F(PacketEncoderTest, PacketData) {
     ASSERT_EQ(*decoded_packet, data_packet);
 }
 
+// A zero length DATA1, as sent in a control status stage
+TEST_F(PacketEncoderTest, PacketDataZero) {
+    reset();
+
+    auto data_packet =
+        UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA1, {});
+
+    std::optional<UsbUtils::UsbPacket> decoded_packet =
+        packet_test(*this, data_packet);
+
+    ASSERT_EQ(mod->done, 1);
+    ASSERT_TRUE(decoded_packet.has_value());
+    ASSERT_EQ(*decoded_packet, data_packet);
+}
+
 TEST_F(PacketEncoderTest, MultiplePackets) {
     reset();
 
@@ -143,3 +172,61 @@ TEST_F(PacketEncoderTest, MultiplePackets) {
     ASSERT_EQ(*decoded_packet, handshake_packet);
 
 }
+
+// Back to back packets checked by one JKStreamDecoder, a sample per clock
+TEST_F(PacketEncoderTest, StreamDecoder) {
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> dist_byte(0,255);
+    std::uniform_int_distribution<int> dist_len(0,64);
+
+    UsbUtils::JKStreamDecoder stream;
+    std::vector<UsbUtils::UsbPacket> packets;
+
+    for (int i = 0; i < 16; i++) {
+        std::vector<uint8_t> data(dist_len(rng));
+        for (auto& b : data) {
+            b = dist_byte(rng);
+        }
+        auto packet = UsbUtils::UsbPacket::create_data_packet(
+            (i & 1) ? UsbUtils::PID_DATA1 : UsbUtils::PID_DATA0, data);
+        packets.push_back(packet);
+
+        reset();
+        mod->pid = packet.pid;
+        mod->empty = packet.payload.empty();
+        mod->byte_in = packet.payload.size() > 0 ? packet.payload[0] : 0xFF;
+        mod->last_byte = 0;
+
+        // Same handshaking as packet_test()
+        uint32_t idx = 0;
+        bool done = run_until([&] {
+            stream.push_sample(mod->dp, mod->dn);
+            if (packet.payload.size() == 0 ||
+                idx == (packet.payload.size() - 1)) {
+                mod->last_byte = 1;
+            }
+            if (mod->byte_ack) {
+                idx++;
+                mod->byte_in = idx < packet.payload.size() ? packet.payload[idx] : 0xFF;
+            }
+            return mod->done;
+        }, 10000);
+        ASSERT_TRUE(done);
+
+        // Idle J until the EOP completes
+        for (int j = 0; j < 8; j++) {
+            clk();
+            stream.push_sample(mod->dp, mod->dn);
+        }
+    }
+    stream.flush();
+
+    ASSERT_TRUE(stream.errors().empty()) << stream.errors()[0].format();
+    ASSERT_FALSE(stream.in_packet());
+    ASSERT_EQ(stream.packet_count(), packets.size());
+    for (size_t i = 0; i < packets.size(); i++) {
+        auto decoded = UsbUtils::UsbPacketView::decode(stream.packet_bytes(i));
+        ASSERT_TRUE(decoded.has_value()) << i;
+        ASSERT_EQ(packets[i], *decoded);
+    }
+}
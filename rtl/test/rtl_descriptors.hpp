@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Descriptors served from rtl/src/descriptor_rom.sv. Keep in sync with it
+
+// bMaxPacketSize0, the packet size of descriptor_engine
+inline constexpr size_t EP0_MAX_PACKET = 64;
+
+inline const std::vector<uint8_t> DEVICE_DESCRIPTOR = {
+    0x12, 0x01, 0x10, 0x01, 0x00, 0x00, 0x00, 0x40,
+    0x83, 0x04, 0x2a, 0x57, 0x00, 0x01, 0x00, 0x01,
+    0x00, 0x01
+};
+
+// With its interface and two bulk endpoints, wTotalLength bytes
+inline const std::vector<uint8_t> CONFIGURATION_DESCRIPTOR = {
+    0x09, 0x02, 0x20, 0x00, 0x01, 0x01, 0x00, 0x80, 0x32,
+    0x09, 0x04, 0x00, 0x00, 0x02, 0xff, 0x00, 0x00, 0x02,
+    0x07, 0x05, 0x01, 0x02, 0x40, 0x00, 0x00,
+    0x07, 0x05, 0x82, 0x02, 0x40, 0x00, 0x00
+};
+
+inline std::vector<uint8_t> string_descriptor(std::string_view text) {
+    std::vector<uint8_t> desc = {(uint8_t)(2 + 2 * text.size()), 0x03};
+    for (char c : text) {
+        desc.push_back(c);
+        desc.push_back(0);
+    }
+    return desc;
+}
+
+// String 0 lists the language IDs, US English only
+inline const std::vector<uint8_t> STRING_DESCRIPTORS[] = {
+    {0x04, 0x03, 0x09, 0x04},
+    // Exactly one full packet
+    string_descriptor("usbfs USB 1.1 full speed device"),
+    // A full packet and a short one
+    string_descriptor("Bulk data interface, OUT endpoint 1 and IN endpoint 2")
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// State names of the RTL state machines, in the declaration order of their
+// enums. Keep in sync with the typedefs in rtl/src
+
+// jk_decoder.sv DecoderState
+inline const std::vector<std::string> JK_DECODER_STATES = {
+    "IDLE", "SOP", "SYNC", "PAYLOAD", "EOP"
+};
+
+// jk_encoder.sv EncoderState
+inline const std::vector<std::string> JK_ENCODER_STATES = {
+    "SYNC", "PAYLOAD", "EOP", "COMPLETE"
+};
+
+// packet_decoder.sv PacketState
+inline const std::vector<std::string> PACKET_DECODER_STATES = {
+    "WAIT", "PID", "PAYLOAD", "EOP", "COMPLETE"
+};
+
+// packet_encoder.sv EncoderState
+inline const std::vector<std::string> PACKET_ENCODER_STATES = {
+    "PID", "PAYLOAD", "CRC_START", "CRC", "COMPLETE"
+};
+
+// transaction_core.sv TransactionState
+inline const std::vector<std::string> TRANSACTION_SM_STATES = {
+    "TXN_IDLE",
+    "TXN_TOKEN",
+    "TXN_DATA_RECV_WAIT",
+    "TXN_DATA_RECV",
+    "TXN_DATA_SEND_WAIT",
+    "TXN_DATA_SEND",
+    "TXN_HANDSHAKE_SEND_WAIT",
+    "TXN_HANDSHAKE_SEND",
+    "TXN_HANDSHAKE_RECV_WAIT",
+    "TXN_HANDSHAKE_RECV"
+};
+
+// ep0_handler.sv CtrlState
+inline const std::vector<std::string> EP0_HANDLER_STATES = {
+    "CTRL_IDLE",
+    "CTRL_SETUP_DATA",
+    "CTRL_SETUP_HANDSHAKE",
+    "CTRL_IN_DATA",
+    "CTRL_IN_STATUS",
+    "CTRL_OUT_DATA",
+    "CTRL_OUT_STATUS",
+    "CTRL_NODATA_STATUS"
+};
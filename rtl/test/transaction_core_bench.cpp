@@ -0,0 +1,31 @@
+#include "mod_bench.hpp"
+#include "Vtransaction_core.h"
+
+// BM_TransactionSMSetupTxn at the packet_decoder interface
+template <ModBenchTrace Trace>
+static void BM_TransactionCoreSetupTxn(benchmark::State& state) {
+    ModBench<ModBenchFixture<PacketModTest, Vtransaction_core, Trace>, Trace> bench(state, "transaction_core");
+
+    std::vector<uint8_t> request = {0x80,0x06,0x00,0x01,0x00,0x00,0x40,0x00};
+
+    std::vector<uint8_t> token;
+    std::vector<uint8_t> data;
+    UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_SETUP, 0, 0).view().append_bytes(token);
+    UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0, request).view().append_bytes(data);
+
+    bench->reset();
+
+    for (auto _ : state) {
+        bench->play_packet(token, true);
+        bench->run_cycles(4);
+        bench->play_packet(data, true);
+        // Handshake turnaround, then the ACK is sent in a clock
+        bench->run_until([&] { return bench->mod->tx_active == 1; }, 32);
+        bench->mod->tx_done = 1;
+        bench->clk();
+        bench->mod->tx_done = 0;
+        bench->run_cycles(4);
+        bench.count_packets(2, request.size());
+    }
+}
+MOD_BENCHMARK(BM_TransactionCoreSetupTxn);
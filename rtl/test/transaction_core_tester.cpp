@@ -0,0 +1,828 @@
+
+#include "mod_test.hpp"
+#include "usb_utils.hpp"
+#include "rtl_fsm_states.hpp"
+#include "rtl_descriptors.hpp"
+#include "Vtransaction_core.h"
+#include "Vtransaction_core___024root.h"
+
+// Transaction and control endpoint regressions at the packet_decoder
+// interface. The same protocol runs through the PHY in transaction_sm_test
+class TransactionCoreTest : public PacketModTest<Vtransaction_core> {
+
+    public:
+    void SetUp() override {
+        PacketModTest::SetUp();
+        profile_fsm("txn_state", [this] { return mod->rootp->transaction_core__DOT__txn_state; },
+                    TRANSACTION_SM_STATES);
+        profile_fsm("ep0.ctrl_state", [this] { return mod->rootp->transaction_core__DOT__ep0__DOT__ctrl_state; },
+                    EP0_HANDLER_STATES);
+    }
+
+    uint32_t txn_state() {
+        return mod->rootp->transaction_core__DOT__txn_state;
+    }
+
+    uint32_t ctrl_state() {
+        return mod->rootp->transaction_core__DOT__ep0__DOT__ctrl_state;
+    }
+
+    // Stand in for the packet_encoder for the core's next response: wait
+    // for tx_active, ack each byte of a DATA packet and signal done. Returns
+    // nothing if no response starts within timeout clocks
+    std::optional<UsbUtils::UsbPacket> send_response(uint64_t timeout = 64) {
+        if (!run_until([this] { return mod->tx_active == 1; }, timeout)) {
+            return std::nullopt;
+        }
+
+        const auto pid = static_cast<UsbUtils::Pid>(mod->tx_pid);
+        std::optional<UsbUtils::UsbPacket> packet;
+        if (pid == UsbUtils::PID_DATA0 || pid == UsbUtils::PID_DATA1) {
+            std::vector<uint8_t> payload;
+            while (!mod->tx_empty) {
+                const bool last = mod->tx_last_byte;
+                payload.push_back(mod->tx_byte);
+                mod->tx_byte_ack = 1;
+                clk();
+                mod->tx_byte_ack = 0;
+                clk();
+                if (last) {
+                    break;
+                }
+            }
+            packet = UsbUtils::UsbPacket::create_data_packet(pid, payload);
+        } else {
+            packet = UsbUtils::UsbPacket::create_handshake_packet(pid);
+        }
+
+        mod->tx_done = 1;
+        clk();
+        mod->tx_done = 0;
+        return packet;
+    }
+
+    // Take everything endpoint 1 has for the application
+    std::vector<uint8_t> ep1_drain() {
+        std::vector<uint8_t> data;
+        mod->ep1_out_ready = 1;
+        while (mod->ep1_out_valid) {
+            data.push_back(mod->ep1_out_data);
+            clk();
+        }
+        mod->ep1_out_ready = 0;
+        return data;
+    }
+
+    // Queue data for endpoint 2, as far as it has room. Returns the bytes
+    // queued
+    size_t ep2_write(const std::vector<uint8_t>& data) {
+        size_t i = 0;
+        mod->ep2_in_valid = 1;
+        while (i < data.size() && mod->ep2_in_ready) {
+            mod->ep2_in_data = data[i++];
+            clk();
+        }
+        mod->ep2_in_valid = 0;
+        return i;
+    }
+};
+
+enum {
+    TXN_IDLE = 0,
+    TXN_DATA_RECV_WAIT = 2,
+    TXN_HANDSHAKE_RECV_WAIT = 8
+};
+
+enum {
+    CTRL_IDLE = 0,
+    CTRL_SETUP_DATA = 1,
+    CTRL_SETUP_HANDSHAKE = 2,
+    CTRL_IN_DATA = 3,
+    CTRL_IN_STATUS = 4,
+    CTRL_OUT_DATA = 5,
+    CTRL_NODATA_STATUS = 7
+};
+
+static const uint32_t TURN_AROUND_CLKS = 18 * 4;
+
+TEST_F(TransactionCoreTest, Reset) {
+    reset();
+
+    ASSERT_EQ(txn_state(), TXN_IDLE);
+    ASSERT_EQ(ctrl_state(), CTRL_IDLE);
+}
+
+void setup_txn(TransactionCoreTest& tester, const std::vector<uint8_t>& request, uint8_t addr = 0) {
+
+    tester.play_packet(UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_SETUP, addr, 0));
+    ASSERT_EQ(tester.txn_state(), TXN_DATA_RECV_WAIT);
+    ASSERT_EQ(tester.ctrl_state(), CTRL_SETUP_DATA);
+
+    tester.play_packet(UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0, request));
+    ASSERT_EQ(tester.ctrl_state(), CTRL_SETUP_HANDSHAKE);
+
+    auto handshake = tester.send_response();
+    ASSERT_TRUE(handshake.has_value());
+    ASSERT_EQ(*handshake, UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK));
+
+    // ep0 moves on once the transaction ends
+    tester.run_until([&] { return tester.ctrl_state() != CTRL_SETUP_HANDSHAKE; }, 16);
+    ASSERT_EQ(tester.txn_state(), TXN_IDLE);
+}
+
+// An IN token to ep0 and the response to it
+std::optional<UsbUtils::UsbPacket> in_txn(TransactionCoreTest& tester, uint8_t addr = 0) {
+    tester.play_packet(UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_IN, addr, 0));
+    return tester.send_response();
+}
+
+// An OUT token and DATA packet to ep0 and the handshake to them
+std::optional<UsbUtils::UsbPacket> out_txn(TransactionCoreTest& tester,
+                                           UsbUtils::Pid pid,
+                                           const std::vector<uint8_t>& data) {
+    tester.play_packet(UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_OUT, 0, 0));
+    tester.play_packet(UsbUtils::UsbPacket::create_data_packet(pid, data));
+    return tester.send_response();
+}
+
+// An OUT token and DATA packet to bulk endpoint 1 and the handshake to them
+std::optional<UsbUtils::UsbPacket> bulk_out_txn(TransactionCoreTest& tester,
+                                                UsbUtils::Pid pid,
+                                                const std::vector<uint8_t>& data) {
+    tester.play_packet(UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_OUT, 0, 1));
+    tester.play_packet(UsbUtils::UsbPacket::create_data_packet(pid, data));
+    return tester.send_response();
+}
+
+static std::vector<uint8_t> bulk_payload(size_t len, uint8_t first) {
+    std::vector<uint8_t> data(len);
+    for (size_t i = 0; i < len; i++) {
+        data[i] = first + i;
+    }
+    return data;
+}
+
+TEST_F(TransactionCoreTest, SetupIn) {
+    reset();
+
+    setup_txn(*this, {0x80,0x06,0x00,0x01,0x00,0x00,0x40,0x00});
+    ASSERT_EQ(ctrl_state(), CTRL_IN_DATA);
+}
+
+TEST_F(TransactionCoreTest, SetupOut) {
+    reset();
+
+    setup_txn(*this, {0x00,0x07,0x00,0x01,0x00,0x00,0x12,0x00});
+    ASSERT_EQ(ctrl_state(), CTRL_OUT_DATA);
+}
+
+TEST_F(TransactionCoreTest, SetupNoData) {
+    reset();
+
+    setup_txn(*this, {0x00,0x05,0x12,0x00,0x00,0x00,0x00,0x00});
+    ASSERT_EQ(ctrl_state(), CTRL_NODATA_STATUS);
+}
+
+// The status stage IN gets a zero length DATA1, and the host's ACK ends
+// the transfer
+TEST_F(TransactionCoreTest, NoDataStatus) {
+    reset();
+
+    setup_txn(*this, {0x00,0x05,0x12,0x00,0x00,0x00,0x00,0x00});
+
+    auto data = in_txn(*this);
+    ASSERT_TRUE(data.has_value());
+    ASSERT_EQ(*data, UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA1, {}));
+    ASSERT_EQ(txn_state(), TXN_HANDSHAKE_RECV_WAIT);
+    ASSERT_EQ(ctrl_state(), CTRL_NODATA_STATUS);
+
+    play_packet(UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK));
+    ASSERT_TRUE(run_until([this] { return ctrl_state() == CTRL_IDLE; }, 16));
+    ASSERT_EQ(txn_state(), TXN_IDLE);
+}
+
+// Without the host's ACK the status stage is retried
+TEST_F(TransactionCoreTest, NoDataStatusRetry) {
+    reset();
+
+    setup_txn(*this, {0x00,0x05,0x12,0x00,0x00,0x00,0x00,0x00});
+
+    auto data = in_txn(*this);
+    ASSERT_TRUE(data.has_value());
+    run_cycles(TURN_AROUND_CLKS + 2);
+    ASSERT_EQ(txn_state(), TXN_IDLE);
+    clk();
+    ASSERT_EQ(ctrl_state(), CTRL_NODATA_STATUS);
+
+    data = in_txn(*this);
+    ASSERT_TRUE(data.has_value());
+    ASSERT_EQ(*data, UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA1, {}));
+}
+
+// Requests with a data stage other than GET_DESCRIPTOR are not supported:
+// their data stage is STALLed until the next SETUP
+TEST_F(TransactionCoreTest, InDataStall) {
+    reset();
+
+    setup_txn(*this, {0xC0,0x01,0x00,0x00,0x00,0x00,0x04,0x00});
+
+    for (int i = 0; i < 2; i++) {
+        auto handshake = in_txn(*this);
+        ASSERT_TRUE(handshake.has_value());
+        ASSERT_EQ(*handshake, UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_STALL));
+        ASSERT_EQ(txn_state(), TXN_IDLE);
+        clk();
+        ASSERT_EQ(ctrl_state(), CTRL_IN_DATA);
+    }
+
+    setup_txn(*this, {0x00,0x05,0x12,0x00,0x00,0x00,0x00,0x00});
+    ASSERT_EQ(ctrl_state(), CTRL_NODATA_STATUS);
+}
+
+static std::vector<uint8_t> get_descriptor(uint8_t type, uint8_t index, uint16_t length) {
+    const uint8_t lang = type == 3 && index != 0 ? 0x09 : 0x00;
+    const uint8_t lang_hi = type == 3 && index != 0 ? 0x04 : 0x00;
+    return {0x80, 0x06, index, type, lang, lang_hi, (uint8_t)length, (uint8_t)(length >> 8)};
+}
+
+// The packets of a data stage sending desc to a host asking for length
+// bytes: full packets from DATA1 on, ending in a short one unless length
+// bytes end a full one
+static std::vector<UsbUtils::UsbPacket> data_stage(const std::vector<uint8_t>& desc, uint16_t length) {
+    const size_t len = std::min<size_t>(desc.size(), length);
+    std::vector<UsbUtils::UsbPacket> packets;
+    size_t sent = 0;
+    while (true) {
+        const size_t n = std::min(EP0_MAX_PACKET, len - sent);
+        packets.push_back(UsbUtils::UsbPacket::create_data_packet(
+            packets.size() % 2 ? UsbUtils::PID_DATA0 : UsbUtils::PID_DATA1,
+            std::vector<uint8_t>(desc.begin() + sent, desc.begin() + sent + n)));
+        sent += n;
+        if (n < EP0_MAX_PACKET || sent == length) {
+            return packets;
+        }
+    }
+}
+
+// An IN token to ep0 and the response to it, ACKed if it is data. INs
+// NAKed while ep0 looks the descriptor up, which takes longer than these
+// back to back packets, are retried
+std::optional<UsbUtils::UsbPacket> control_in_txn(TransactionCoreTest& tester, bool ack = true,
+                                                  uint8_t addr = 0) {
+    const auto nak = UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_NAK);
+    std::optional<UsbUtils::UsbPacket> response;
+    for (int i = 0; i < 16; i++) {
+        response = in_txn(tester, addr);
+        if (response != nak) {
+            break;
+        }
+    }
+    if (ack && response.has_value() &&
+        (response->pid == UsbUtils::PID_DATA0 || response->pid == UsbUtils::PID_DATA1)) {
+        tester.play_packet(UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK));
+        tester.run_until([&] { return tester.txn_state() == TXN_IDLE; }, 16);
+    }
+    return response;
+}
+
+// Reads a descriptor through its data stage and checks the status stage
+void read_descriptor(TransactionCoreTest& tester, uint8_t type, uint8_t index, uint16_t length,
+                     const std::vector<UsbUtils::UsbPacket>& expected) {
+    setup_txn(tester, get_descriptor(type, index, length));
+    ASSERT_EQ(tester.ctrl_state(), CTRL_IN_DATA);
+
+    for (size_t i = 0; i < expected.size(); i++) {
+        auto data = control_in_txn(tester);
+        ASSERT_TRUE(data.has_value());
+        ASSERT_EQ(*data, expected[i]) << "packet " << i;
+    }
+    tester.clk();
+    ASSERT_EQ(tester.ctrl_state(), CTRL_IN_STATUS);
+
+    // Past the end of the data the host may only start the status stage
+    auto handshake = in_txn(tester);
+    ASSERT_TRUE(handshake.has_value());
+    ASSERT_EQ(*handshake, UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_STALL));
+
+    handshake = out_txn(tester, UsbUtils::PID_DATA1, {});
+    ASSERT_TRUE(handshake.has_value());
+    ASSERT_EQ(*handshake, UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK));
+    ASSERT_TRUE(tester.run_until([&] { return tester.ctrl_state() == CTRL_IDLE; }, 16));
+}
+
+TEST_F(TransactionCoreTest, GetDeviceDescriptor) {
+    reset();
+
+    read_descriptor(*this, 1, 0, 0x40, data_stage(DEVICE_DESCRIPTOR, 0x40));
+}
+
+// wLength cuts the descriptor short, the first 8 bytes as in the first
+// request of an enumeration
+TEST_F(TransactionCoreTest, GetDescriptorShortLength) {
+    reset();
+
+    const auto expected = data_stage(DEVICE_DESCRIPTOR, 8);
+    ASSERT_EQ(expected.size(), 1);
+    ASSERT_EQ(expected[0].payload.size(), 8);
+    read_descriptor(*this, 1, 0, 8, expected);
+
+    read_descriptor(*this, 2, 0, 9, data_stage(CONFIGURATION_DESCRIPTOR, 9));
+    read_descriptor(*this, 2, 0, 0xFF, data_stage(CONFIGURATION_DESCRIPTOR, 0xFF));
+}
+
+// A descriptor longer than a packet is split, the toggle alternating
+TEST_F(TransactionCoreTest, GetDescriptorMultiPacket) {
+    reset();
+
+    const auto expected = data_stage(STRING_DESCRIPTORS[2], 0xFF);
+    ASSERT_EQ(expected.size(), 2);
+    ASSERT_EQ(expected[0].payload.size(), EP0_MAX_PACKET);
+    ASSERT_EQ(expected[1].pid, UsbUtils::PID_DATA0);
+    read_descriptor(*this, 3, 2, 0xFF, expected);
+}
+
+// A descriptor of exactly a packet, shorter than wLength, is ended with a
+// zero length packet. When it is exactly wLength no more is sent
+TEST_F(TransactionCoreTest, GetDescriptorZeroLengthPacket) {
+    reset();
+
+    auto expected = data_stage(STRING_DESCRIPTORS[1], 0xFF);
+    ASSERT_EQ(expected.size(), 2);
+    ASSERT_TRUE(expected[1].payload.empty());
+    read_descriptor(*this, 3, 1, 0xFF, expected);
+
+    expected = data_stage(STRING_DESCRIPTORS[1], EP0_MAX_PACKET);
+    ASSERT_EQ(expected.size(), 1);
+    read_descriptor(*this, 3, 1, EP0_MAX_PACKET, expected);
+}
+
+// Without the host's ACK the same packet is sent again
+TEST_F(TransactionCoreTest, GetDescriptorRetry) {
+    reset();
+
+    const auto expected = data_stage(STRING_DESCRIPTORS[2], 0xFF);
+    setup_txn(*this, get_descriptor(3, 2, 0xFF));
+
+    for (const auto& packet : expected) {
+        auto data = control_in_txn(*this, false);
+        ASSERT_TRUE(data.has_value());
+        ASSERT_EQ(*data, packet);
+        run_cycles(TURN_AROUND_CLKS + 2);
+        ASSERT_EQ(txn_state(), TXN_IDLE);
+
+        data = control_in_txn(*this);
+        ASSERT_TRUE(data.has_value());
+        ASSERT_EQ(*data, packet);
+    }
+    clk();
+    ASSERT_EQ(ctrl_state(), CTRL_IN_STATUS);
+}
+
+// An IN before the lookup is done is NAKed. A descriptor not in the ROM is
+// STALLed
+TEST_F(TransactionCoreTest, GetDescriptorLookup) {
+    reset();
+
+    setup_txn(*this, get_descriptor(3, 2, 0xFF));
+    auto handshake = in_txn(*this);
+    ASSERT_TRUE(handshake.has_value());
+    ASSERT_EQ(*handshake, UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_NAK));
+
+    run_cycles(64);
+    auto data = control_in_txn(*this);
+    ASSERT_TRUE(data.has_value());
+    ASSERT_EQ(*data, data_stage(STRING_DESCRIPTORS[2], 0xFF)[0]);
+
+    for (const auto& request : {get_descriptor(3, 3, 0xFF), get_descriptor(6, 0, 0x0A)}) {
+        setup_txn(*this, request);
+        run_cycles(64);
+        handshake = in_txn(*this);
+        ASSERT_TRUE(handshake.has_value());
+        ASSERT_EQ(*handshake, UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_STALL));
+        clk();
+        ASSERT_EQ(ctrl_state(), CTRL_IN_DATA);
+    }
+}
+
+// The host may end the data stage early with its status OUT
+TEST_F(TransactionCoreTest, GetDescriptorEarlyStatus) {
+    reset();
+
+    setup_txn(*this, get_descriptor(3, 2, 0xFF));
+    auto data = control_in_txn(*this);
+    ASSERT_TRUE(data.has_value());
+
+    auto handshake = out_txn(*this, UsbUtils::PID_DATA1, {});
+    ASSERT_TRUE(handshake.has_value());
+    ASSERT_EQ(*handshake, UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK));
+    ASSERT_TRUE(run_until([this] { return ctrl_state() == CTRL_IDLE; }, 16));
+}
+
+TEST_F(TransactionCoreTest, OutDataStall) {
+    reset();
+
+    setup_txn(*this, {0x00,0x07,0x00,0x01,0x00,0x00,0x12,0x00});
+
+    auto handshake = out_txn(*this, UsbUtils::PID_DATA1, {0x12, 0x01});
+    ASSERT_TRUE(handshake.has_value());
+    ASSERT_EQ(*handshake, UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_STALL));
+    clk();
+    ASSERT_EQ(ctrl_state(), CTRL_OUT_DATA);
+}
+
+// IN and OUT to ep0 outside of a control transfer are NAKed
+TEST_F(TransactionCoreTest, IdleNak) {
+    reset();
+
+    auto handshake = in_txn(*this);
+    ASSERT_TRUE(handshake.has_value());
+    ASSERT_EQ(*handshake, UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_NAK));
+    ASSERT_EQ(txn_state(), TXN_IDLE);
+
+    handshake = out_txn(*this, UsbUtils::PID_DATA0, {0x01});
+    ASSERT_TRUE(handshake.has_value());
+    ASSERT_EQ(*handshake, UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_NAK));
+    ASSERT_EQ(txn_state(), TXN_IDLE);
+    ASSERT_EQ(ctrl_state(), CTRL_IDLE);
+}
+
+// The PHY spaces bytes at least 32 clocks apart
+TEST_F(TransactionCoreTest, SetupWireSpacing) {
+    reset();
+
+    byte_clks = 32;
+    setup_txn(*this, {0x80,0x06,0x00,0x01,0x00,0x00,0x40,0x00});
+    ASSERT_EQ(ctrl_state(), CTRL_IN_DATA);
+}
+
+TEST_F(TransactionCoreTest, SetupBadCrc) {
+    reset();
+
+    play_packet(UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_SETUP, 0, 0));
+
+    std::vector<uint8_t> bytes;
+    UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0,
+        {0x80,0x06,0x00,0x01,0x00,0x00,0x40,0x00}).view().append_bytes(bytes);
+    bytes.back() ^= 0x01;
+    play_packet(bytes);
+
+    ASSERT_EQ(txn_state(), TXN_IDLE);
+    ASSERT_NE(ctrl_state(), CTRL_SETUP_HANDSHAKE);
+    ASSERT_FALSE(send_response().has_value());
+}
+
+TEST_F(TransactionCoreTest, SetupDataTimeout) {
+    reset();
+
+    play_packet(UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_SETUP, 0, 0));
+    ASSERT_EQ(txn_state(), TXN_DATA_RECV_WAIT);
+
+    run_cycles(TURN_AROUND_CLKS + 2);
+    ASSERT_EQ(txn_state(), TXN_IDLE);
+    clk();
+    ASSERT_EQ(ctrl_state(), CTRL_IDLE);
+}
+
+TEST_F(TransactionCoreTest, Sof) {
+    reset();
+
+    play_packet(UsbUtils::UsbPacket::create_sof_packet(UsbUtils::PID_SOF, 0x0b9));
+    ASSERT_EQ(txn_state(), TXN_IDLE);
+    ASSERT_EQ(ctrl_state(), CTRL_IDLE);
+}
+
+TEST_F(TransactionCoreTest, OtherEndpoint) {
+    reset();
+
+    play_packet(UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_SETUP, 0, 1));
+    ASSERT_EQ(txn_state(), TXN_DATA_RECV_WAIT);
+    ASSERT_EQ(ctrl_state(), CTRL_IDLE);
+
+    // Endpoint 1 only takes OUTs, so the host times out
+    play_packet(UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0,
+        {0x80,0x06,0x00,0x01,0x00,0x00,0x40,0x00}));
+    ASSERT_FALSE(send_response().has_value());
+    ASSERT_EQ(txn_state(), TXN_IDLE);
+
+    play_packet(UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_IN, 0, 1));
+    ASSERT_FALSE(send_response().has_value());
+    ASSERT_EQ(txn_state(), TXN_IDLE);
+}
+
+TEST_F(TransactionCoreTest, BulkOut) {
+    reset();
+
+    ASSERT_EQ(mod->ep1_out_valid, 0);
+
+    bool toggle = false;
+    for (size_t len : {64, 1, 0, 37}) {
+        const auto data = bulk_payload(len, len);
+        const auto pid = toggle ? UsbUtils::PID_DATA1 : UsbUtils::PID_DATA0;
+        auto handshake = bulk_out_txn(*this, pid, data);
+        ASSERT_TRUE(handshake.has_value()) << len;
+        ASSERT_EQ(*handshake, UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK)) << len;
+        ASSERT_EQ(txn_state(), TXN_IDLE);
+        toggle = !toggle;
+
+        ASSERT_EQ(ep1_drain(), data) << len;
+        ASSERT_EQ(mod->ep1_out_valid, 0);
+    }
+}
+
+// Packets are ACKed while the application still holds earlier ones. The
+// host is NAKed once the FIFO has no room for a full packet, whatever the
+// size of the one it sends, and data is streamed out in order across
+// packets
+TEST_F(TransactionCoreTest, BulkOutFifoFull) {
+    reset();
+
+    const auto ack = UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK);
+    const auto nak = UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_NAK);
+
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA0, bulk_payload(64, 0)), ack);
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA1, bulk_payload(64, 64)), ack);
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA0, bulk_payload(64, 128)), ack);
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA1, bulk_payload(64, 192)), nak);
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA1, bulk_payload(8, 192)), nak);
+
+    ASSERT_EQ(ep1_drain(), bulk_payload(192, 0));
+
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA1, bulk_payload(64, 192)), ack);
+    ASSERT_EQ(ep1_drain(), bulk_payload(64, 192));
+}
+
+// The application can stall the stream at any byte
+TEST_F(TransactionCoreTest, BulkOutBackpressure) {
+    reset();
+
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA0, bulk_payload(64, 0)),
+              UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK));
+
+    std::vector<uint8_t> data;
+    for (int i = 0; data.size() < 64 && i < 1000; i++) {
+        mod->ep1_out_ready = i % 3 == 0;
+        const bool take = mod->ep1_out_ready && mod->ep1_out_valid;
+        const uint8_t byte = mod->ep1_out_data;
+        clk();
+        if (take) {
+            data.push_back(byte);
+        }
+    }
+    mod->ep1_out_ready = 0;
+
+    ASSERT_EQ(data, bulk_payload(64, 0));
+}
+
+// The host resends a packet whose ACK it missed with the same toggle. It
+// is ACKed again, but only kept once
+TEST_F(TransactionCoreTest, BulkOutRetransmit) {
+    reset();
+
+    const auto ack = UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK);
+
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA0, bulk_payload(8, 0)), ack);
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA0, bulk_payload(8, 0)), ack);
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA1, bulk_payload(8, 8)), ack);
+
+    ASSERT_EQ(ep1_drain(), bulk_payload(16, 0));
+}
+
+// A packet with a bad CRC gets no handshake and is not kept
+TEST_F(TransactionCoreTest, BulkOutBadCrc) {
+    reset();
+
+    play_packet(UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_OUT, 0, 1));
+
+    std::vector<uint8_t> bytes;
+    UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0, bulk_payload(16, 0)).view().append_bytes(bytes);
+    bytes.back() ^= 0x01;
+    play_packet(bytes);
+
+    ASSERT_FALSE(send_response().has_value());
+    ASSERT_TRUE(ep1_drain().empty());
+
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA0, bulk_payload(16, 100)),
+              UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK));
+    ASSERT_EQ(ep1_drain(), bulk_payload(16, 100));
+}
+
+// An IN token to bulk endpoint 2, the response to it and, for data, the
+// host's handshake if it has one
+std::optional<UsbUtils::UsbPacket> bulk_in_txn(TransactionCoreTest& tester, bool ack = true) {
+    tester.play_packet(UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_IN, 0, 2));
+    auto response = tester.send_response();
+    if (ack && response.has_value() && !response->view().payload.empty()) {
+        tester.play_packet(UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK));
+    }
+    return response;
+}
+
+// Queued data goes out in full packets and a short one, with alternating
+// toggles. An empty FIFO is NAKed
+TEST_F(TransactionCoreTest, BulkIn) {
+    reset();
+
+    const auto nak = UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_NAK);
+
+    ASSERT_EQ(bulk_in_txn(*this), nak);
+
+    ASSERT_EQ(ep2_write(bulk_payload(100, 0)), 100);
+    ASSERT_EQ(bulk_in_txn(*this), UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0, bulk_payload(64, 0)));
+    ASSERT_EQ(bulk_in_txn(*this), UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA1, bulk_payload(36, 64)));
+    ASSERT_EQ(bulk_in_txn(*this), nak);
+
+    ASSERT_EQ(ep2_write(bulk_payload(1, 100)), 1);
+    ASSERT_EQ(bulk_in_txn(*this), UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0, bulk_payload(1, 100)));
+}
+
+// Without the host's ACK the same packet is sent again, even if more data
+// has been queued since
+TEST_F(TransactionCoreTest, BulkInRetry) {
+    reset();
+
+    ASSERT_EQ(ep2_write(bulk_payload(10, 0)), 10);
+    const auto first = UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0, bulk_payload(10, 0));
+    ASSERT_EQ(bulk_in_txn(*this, false), first);
+    run_cycles(TURN_AROUND_CLKS + 2);
+    ASSERT_EQ(txn_state(), TXN_IDLE);
+
+    ASSERT_EQ(ep2_write(bulk_payload(10, 10)), 10);
+    ASSERT_EQ(bulk_in_txn(*this), first);
+    ASSERT_EQ(bulk_in_txn(*this), UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA1, bulk_payload(10, 10)));
+}
+
+// The application is held off once the FIFO is full, until the host takes
+// a packet
+TEST_F(TransactionCoreTest, BulkInBackpressure) {
+    reset();
+
+    const auto data = bulk_payload(300, 0);
+    ASSERT_EQ(ep2_write(data), 256);
+    ASSERT_EQ(mod->ep2_in_ready, 0);
+
+    ASSERT_EQ(bulk_in_txn(*this), UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0, bulk_payload(64, 0)));
+    clk();
+    ASSERT_EQ(mod->ep2_in_ready, 1);
+    ASSERT_EQ(ep2_write(std::vector<uint8_t>(data.begin() + 256, data.end())), 44);
+}
+
+// A control transfer without a data stage: the SETUP, then the status stage
+// IN, ACKed if it gets its zero length DATA1. Returns the status response
+std::optional<UsbUtils::UsbPacket> control_nodata(TransactionCoreTest& tester,
+                                                  const std::vector<uint8_t>& request,
+                                                  uint8_t addr = 0) {
+    setup_txn(tester, request, addr);
+    auto response = control_in_txn(tester, true, addr);
+    tester.run_until([&] { return tester.ctrl_state() == CTRL_IDLE; }, 16);
+    return response;
+}
+
+// A control read of a short reply, through its status stage. Returns the
+// data stage response
+std::optional<UsbUtils::UsbPacket> control_read(TransactionCoreTest& tester,
+                                                const std::vector<uint8_t>& request) {
+    setup_txn(tester, request);
+    auto response = control_in_txn(tester);
+    if (response.has_value() && response->pid == UsbUtils::PID_DATA1) {
+        auto handshake = out_txn(tester, UsbUtils::PID_DATA1, {});
+        EXPECT_EQ(handshake, UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK));
+        tester.run_until([&] { return tester.ctrl_state() == CTRL_IDLE; }, 16);
+    }
+    return response;
+}
+
+static const std::vector<uint8_t> GET_CONFIGURATION = {0x80,0x08,0x00,0x00,0x00,0x00,0x01,0x00};
+
+static std::vector<uint8_t> get_endpoint_status(uint8_t endp) {
+    return {0x82, 0x00, 0x00, 0x00, endp, 0x00, 0x02, 0x00};
+}
+
+static std::vector<uint8_t> endpoint_halt(bool set, uint8_t endp) {
+    return {0x02, (uint8_t)(set ? 0x03 : 0x01), 0x00, 0x00, endp, 0x00, 0x00, 0x00};
+}
+
+static UsbUtils::UsbPacket data1(std::vector<uint8_t> payload) {
+    return UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA1, std::move(payload));
+}
+
+// The new address takes effect once the status stage completes. From then
+// on tokens to the default address go unanswered, and a bus reset brings it
+// back
+TEST_F(TransactionCoreTest, SetAddress) {
+    reset();
+
+    const std::vector<uint8_t> set_address = {0x00,0x05,0x12,0x00,0x00,0x00,0x00,0x00};
+    ASSERT_EQ(control_nodata(*this, set_address), data1({}));
+    ASSERT_EQ(mod->rootp->transaction_core__DOT__device_address, 0x12);
+
+    ASSERT_FALSE(in_txn(*this, 0).has_value());
+    ASSERT_EQ(txn_state(), TXN_IDLE);
+    ASSERT_EQ(in_txn(*this, 0x12), UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_NAK));
+
+    // Without the status stage's ACK the address is not changed
+    setup_txn(*this, {0x00,0x05,0x34,0x00,0x00,0x00,0x00,0x00}, 0x12);
+    ASSERT_EQ(control_in_txn(*this, false, 0x12), data1({}));
+    run_cycles(TURN_AROUND_CLKS + 2);
+    ASSERT_EQ(mod->rootp->transaction_core__DOT__device_address, 0x12);
+
+    mod->bus_reset = 1;
+    clk();
+    mod->bus_reset = 0;
+    clk();
+    ASSERT_EQ(mod->rootp->transaction_core__DOT__device_address, 0);
+    ASSERT_EQ(in_txn(*this, 0), UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_NAK));
+}
+
+TEST_F(TransactionCoreTest, Configuration) {
+    reset();
+
+    ASSERT_EQ(control_read(*this, GET_CONFIGURATION), data1({0x00}));
+    ASSERT_EQ(mod->configured, 0);
+
+    ASSERT_EQ(control_nodata(*this, {0x00,0x09,0x01,0x00,0x00,0x00,0x00,0x00}), data1({}));
+    ASSERT_EQ(mod->configured, 1);
+    ASSERT_EQ(control_read(*this, GET_CONFIGURATION), data1({0x01}));
+
+    // There is no second configuration
+    ASSERT_EQ(control_nodata(*this, {0x00,0x09,0x02,0x00,0x00,0x00,0x00,0x00}),
+              UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_STALL));
+    ASSERT_EQ(mod->configured, 1);
+
+    ASSERT_EQ(control_nodata(*this, {0x00,0x09,0x00,0x00,0x00,0x00,0x00,0x00}), data1({}));
+    ASSERT_EQ(mod->configured, 0);
+}
+
+// Device and interface status are all zero. wLength may cut the reply
+// short. Status of an endpoint the device does not have is STALLed
+TEST_F(TransactionCoreTest, GetStatus) {
+    reset();
+
+    ASSERT_EQ(control_read(*this, {0x80,0x00,0x00,0x00,0x00,0x00,0x02,0x00}), data1({0x00, 0x00}));
+    ASSERT_EQ(control_read(*this, {0x81,0x00,0x00,0x00,0x00,0x00,0x02,0x00}), data1({0x00, 0x00}));
+    ASSERT_EQ(control_read(*this, {0x80,0x00,0x00,0x00,0x00,0x00,0x01,0x00}), data1({0x00}));
+    for (uint8_t endp : {0x00, 0x80, 0x01, 0x82}) {
+        ASSERT_EQ(control_read(*this, get_endpoint_status(endp)), data1({0x00, 0x00})) << (int)endp;
+    }
+
+    ASSERT_EQ(control_read(*this, get_endpoint_status(0x83)),
+              UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_STALL));
+    ASSERT_EQ(control_read(*this, {0x81,0x00,0x00,0x00,0x01,0x00,0x02,0x00}),
+              UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_STALL));
+}
+
+// A no data request not handled in hardware is STALLed in its status stage
+TEST_F(TransactionCoreTest, NoDataStall) {
+    reset();
+
+    // SET_FEATURE(DEVICE_REMOTE_WAKEUP)
+    ASSERT_EQ(control_nodata(*this, {0x00,0x03,0x01,0x00,0x00,0x00,0x00,0x00}),
+              UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_STALL));
+    ASSERT_EQ(ctrl_state(), CTRL_NODATA_STATUS);
+}
+
+// A halted bulk IN endpoint STALLs until the halt is cleared, which also
+// restarts its toggle at DATA0
+TEST_F(TransactionCoreTest, BulkInHalt) {
+    reset();
+
+    const auto stall = UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_STALL);
+
+    ASSERT_EQ(ep2_write(bulk_payload(10, 0)), 10);
+    ASSERT_EQ(bulk_in_txn(*this), UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0, bulk_payload(10, 0)));
+
+    ASSERT_EQ(control_nodata(*this, endpoint_halt(true, 0x82)), data1({}));
+    ASSERT_EQ(control_read(*this, get_endpoint_status(0x82)), data1({0x01, 0x00}));
+    ASSERT_EQ(bulk_in_txn(*this), stall);
+    ASSERT_EQ(ep2_write(bulk_payload(20, 10)), 20);
+    ASSERT_EQ(bulk_in_txn(*this), stall);
+
+    ASSERT_EQ(control_nodata(*this, endpoint_halt(false, 0x82)), data1({}));
+    ASSERT_EQ(control_read(*this, get_endpoint_status(0x82)), data1({0x00, 0x00}));
+    ASSERT_EQ(bulk_in_txn(*this), UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0, bulk_payload(20, 10)));
+}
+
+// A halted bulk OUT endpoint STALLs and drops the data until the halt is
+// cleared. SET_CONFIGURATION clears it too
+TEST_F(TransactionCoreTest, BulkOutHalt) {
+    reset();
+
+    const auto ack = UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK);
+    const auto stall = UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_STALL);
+
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA0, bulk_payload(8, 0)), ack);
+    ASSERT_EQ(ep1_drain(), bulk_payload(8, 0));
+
+    ASSERT_EQ(control_nodata(*this, endpoint_halt(true, 0x01)), data1({}));
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA1, bulk_payload(8, 8)), stall);
+    clk();
+    ASSERT_TRUE(ep1_drain().empty());
+
+    ASSERT_EQ(control_nodata(*this, endpoint_halt(false, 0x01)), data1({}));
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA0, bulk_payload(8, 16)), ack);
+    ASSERT_EQ(ep1_drain(), bulk_payload(8, 16));
+
+    ASSERT_EQ(control_nodata(*this, endpoint_halt(true, 0x01)), data1({}));
+    ASSERT_EQ(control_nodata(*this, {0x00,0x09,0x01,0x00,0x00,0x00,0x00,0x00}), data1({}));
+    ASSERT_EQ(bulk_out_txn(*this, UsbUtils::PID_DATA0, bulk_payload(8, 24)), ack);
+    ASSERT_EQ(ep1_drain(), bulk_payload(8, 24));
+}
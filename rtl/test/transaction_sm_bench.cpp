@@ -0,0 +1,88 @@
+#include "mod_bench.hpp"
+#include "usb_host.hpp"
+#include "Vtransaction_sm.h"
+
+// 19 64 byte bulk transactions a frame, the most full speed allows
+static constexpr double FS_BULK_CEILING_BYTES_PER_S = 19 * 64 * 1000.0;
+
+// The SETUP stage of a GET_DESCRIPTOR control transfer, repeated
+template <ModBenchTrace Trace>
+static void BM_TransactionSMSetupTxn(benchmark::State& state) {
+    ModBench<ModBenchFixture<UsbModTest, Vtransaction_sm, Trace>, Trace> bench(state, "transaction_sm");
+
+    std::vector<uint8_t> request = {0x80,0x06,0x00,0x01,0x00,0x00,0x40,0x00};
+
+    std::vector<UsbUtils::BusState> states;
+    for (auto encoder : {
+            UsbUtils::JKEncoder::create_token_packet(UsbUtils::PID_SETUP, 0, 0),
+            UsbUtils::JKEncoder::create_data_packet(UsbUtils::PID_DATA0, request)}) {
+        auto packet = bus_states(encoder);
+        states.insert(states.end(), packet.begin(), packet.end());
+        states.insert(states.end(), 16, UsbUtils::BUS_J);
+    }
+    // Leave room for the handshake turnaround
+    states.insert(states.end(), 128, UsbUtils::BUS_J);
+
+    bench->reset();
+
+    for (auto _ : state) {
+        for (auto bus : states) {
+            drive_bus_state(bench->mod.get(), bus);
+            bench->clk();
+        }
+        bench.count_packets(2, request.size());
+    }
+}
+MOD_BENCHMARK(BM_TransactionSMSetupTxn);
+
+// An idle bus between transactions, the bulk of simulated time
+template <ModBenchTrace Trace>
+static void BM_TransactionSMIdle(benchmark::State& state) {
+    ModBench<ModBenchFixture<UsbModTest, Vtransaction_sm, Trace>, Trace> bench(state, "transaction_sm");
+
+    bench->reset();
+    drive_bus_state(bench->mod.get(), UsbUtils::BUS_J);
+
+    for (auto _ : state) {
+        bench->run_cycles(1000);
+    }
+}
+MOD_BENCHMARK(BM_TransactionSMIdle);
+
+// Bulk OUT to endpoint 1 and bulk IN from endpoint 2 sharing the bus, a
+// frame at a time, with the application streaming both at full rate.
+// Reports the payload moved per second of simulated time, alone and as a
+// fraction of the full speed bulk ceiling
+template <ModBenchTrace Trace>
+static void BM_TransactionSMBulkStream(benchmark::State& state) {
+    ModBench<ModBenchFixture<UsbModTest, Vtransaction_sm, Trace>, Trace> bench(state, "transaction_sm");
+
+    UsbHost::Endpoint out = {UsbHost::TRANSFER_BULK, 0, 1, false, 64, 0, 1, {}};
+    UsbHost::Endpoint in = {UsbHost::TRANSFER_BULK, 0, 2, true, 64, 0, 1, {}};
+    UsbHost::HostModel host({.endpoints = {out, in}});
+
+    bench->reset();
+
+    auto* mod = bench->mod.get();
+    mod->ep1_out_ready = 1;
+    mod->ep2_in_valid = 1;
+
+    for (auto _ : state) {
+        const uint64_t transactions = host.stats().transactions();
+        const uint64_t bytes = host.stats().bytes();
+
+        UsbHost::run_host(host, *bench, UsbHost::FRAME_CLKS, [mod] {
+            return std::pair<uint8_t, bool>{UsbUtils::pack_line_state(mod->tx_dp, mod->tx_dn), mod->tx_en == 1};
+        });
+
+        // Token, data and handshake
+        bench.count_packets(3 * (host.stats().transactions() - transactions),
+                            host.stats().bytes() - bytes);
+    }
+
+    const auto& stats = host.stats();
+    state.counters["usb_bytes_per_s"] = stats.throughput();
+    state.counters["fs_ceiling"] = stats.throughput() / FS_BULK_CEILING_BYTES_PER_S;
+    state.counters["nak_rate"] = stats.nak_rate();
+}
+MOD_BENCHMARK(BM_TransactionSMBulkStream);
@@ -1,62 +1,536 @@
 
+#include <optional>
+#include <print>
+
 #include "mod_test.hpp"
 #include "usb_utils.hpp"
+#include "usb_host.hpp"
+#include "rtl_fsm_states.hpp"
+#include "rtl_descriptors.hpp"
 #include "Vtransaction_sm.h"
+#include "Vtransaction_sm___024root.h"
+
+// A device packet, and the clocks from the end of the host's EOP (its
+// first J) to the device's first SYNC K
+struct DeviceResponse {
+    std::vector<uint8_t> bytes;
+    uint64_t latency;
+};
+
+class TransactionSMTest : public UsbModTest<Vtransaction_sm> {
+
+    public:
+    void SetUp() override {
+        UsbModTest::SetUp();
+        profile_fsm("core0.txn_state", [this] { return mod->rootp->transaction_sm__DOT__core0__DOT__txn_state; },
+                    TRANSACTION_SM_STATES);
+        profile_fsm("core0.ep0.ctrl_state", [this] { return mod->rootp->transaction_sm__DOT__core0__DOT__ep0__DOT__ctrl_state; },
+                    EP0_HANDLER_STATES);
+        profile_fsm("pkt_dec0.packet_state", [this] { return mod->rootp->transaction_sm__DOT__pkt_dec0__DOT__packet_state; },
+                    PACKET_DECODER_STATES);
+        profile_fsm("pkt_dec0.jk0.decoder_state", [this] { return mod->rootp->transaction_sm__DOT__pkt_dec0__DOT__jk0__DOT__decoder_state; },
+                    JK_DECODER_STATES);
+        profile_fsm("pkt_enc0.encoder_state", [this] { return mod->rootp->transaction_sm__DOT__pkt_enc0__DOT__encoder_state; },
+                    PACKET_ENCODER_STATES);
+    }
+
+    // Play a host packet, then idle J. The device's response, if one starts
+    // within timeout clocks, is decoded from tx_dp/tx_dn until it releases
+    // the bus
+    std::optional<DeviceResponse> host_packet(const UsbUtils::UsbPacket& packet,
+                                              uint64_t timeout = 64) {
+        UsbUtils::JKWaveform wave;
+        UsbUtils::JKWaveformCache::shared().append_packet(wave, packet);
+
+        uint64_t eop_clk = 0;
+        bool se0 = false;
+        auto watch_eop = [&] {
+            const bool line_se0 = mod->dp == 0 && mod->dn == 0;
+            if (se0 && !line_se0) {
+                eop_clk = clk_cnt;
+            }
+            se0 = line_se0;
+        };
+
+        play_waveform(wave, watch_eop);
+
+        mod->dp = 1;
+        mod->dn = 0;
+        const bool sop = run_until([&] {
+            watch_eop();
+            return mod->tx_en == 1 && mod->tx_dp == 0 && mod->tx_dn == 1;
+        }, timeout);
+        if (!sop) {
+            return std::nullopt;
+        }
+
+        DeviceResponse response = {{}, clk_cnt - eop_clk};
+
+        UsbUtils::JKDecoder decoder;
+        decoder.step(mod->tx_dp, mod->tx_dn);
+        run_until([&] {
+            if (!mod->tx_en) {
+                return true;
+            }
+            decoder.step(mod->tx_dp, mod->tx_dn);
+            return false;
+        }, UsbHost::FRAME_CLKS);
+
+        response.bytes = decoder.get_decoded();
+        return response;
+    }
+};
 
-typedef UsbModTest<Vtransaction_sm> TransactionSMTest;
+// 2.5 bit times. See SEND_DELAY_COUNT in transaction_core.sv
+static const uint64_t RESPONSE_LATENCY_CLKS = 10;
 
 TEST_F(TransactionSMTest, Reset) {
     reset();
 
+    ASSERT_EQ(mod->tx_en, 0);
 }
 
-void step_packet(TransactionSMTest& tester, UsbUtils::JKEncoder encoder) {
+TEST_F(TransactionSMTest, SetupTxn) {
+    reset();
 
-    while (!encoder.is_complete()) {
+    ASSERT_FALSE(host_packet(UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_SETUP, 0, 0), 16));
+
+    std::vector<uint8_t> data = {0x80,0x06,0x00,0x01,0x00,0x00,0x40,0x00};
+    auto response = host_packet(UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0, data));
 
-        UsbUtils::BusState next_state = encoder.step();
+    ASSERT_TRUE(response.has_value());
+    ASSERT_EQ(response->bytes, std::vector<uint8_t>{UsbUtils::pid_byte(UsbUtils::PID_ACK)});
+    ASSERT_EQ(response->latency, RESPONSE_LATENCY_CLKS);
+    ASSERT_EQ(mod->tx_en, 0);
+}
+
+// EOP to SOP latency of every kind of response. It bounds how many
+// transactions fit in a frame
+TEST_F(TransactionSMTest, ResponseLatency) {
+    reset();
 
-        ASSERT_NE(next_state, UsbUtils::BUS_INVALID);
-        switch (next_state) {
-            case UsbUtils::BUS_SE0:
-                tester.mod->dn = 0;
-                tester.mod->dp = 0;
-                break;
-            case UsbUtils::BUS_J:
-                tester.mod->dn = 0;
-                tester.mod->dp = 1;
-                break;
-            case UsbUtils::BUS_K:
-                tester.mod->dn = 1;
-                tester.mod->dp = 0;
-                break;
-            default:
-                ASSERT_TRUE(false);
-                break;
+    using UsbUtils::UsbPacket;
+
+    const std::vector<uint8_t> set_configuration = {0x00,0x09,0x01,0x00,0x00,0x00,0x00,0x00};
+    const std::vector<uint8_t> get_descriptor = {0x80,0x06,0x00,0x01,0x00,0x00,0x12,0x00};
+    const std::vector<uint8_t> set_descriptor = {0x00,0x07,0x00,0x01,0x00,0x00,0x12,0x00};
+    const std::vector<uint8_t> vendor_in = {0xC0,0x01,0x00,0x00,0x00,0x00,0x04,0x00};
+
+    const auto in = UsbPacket::create_token_packet(UsbUtils::PID_IN, 0, 0);
+    const auto out = UsbPacket::create_token_packet(UsbUtils::PID_OUT, 0, 0);
+    const auto setup = UsbPacket::create_token_packet(UsbUtils::PID_SETUP, 0, 0);
+    const auto ack = UsbPacket::create_handshake_packet(UsbUtils::PID_ACK);
+    const auto nak = UsbPacket::create_handshake_packet(UsbUtils::PID_NAK);
+    const auto stall = UsbPacket::create_handshake_packet(UsbUtils::PID_STALL);
+
+    std::vector<std::pair<std::string, uint64_t>> latencies;
+
+    // Host packets of a transaction, the last of which gets the response
+    auto transact = [&](const std::string& name,
+                        const std::vector<UsbPacket>& packets,
+                        const UsbPacket& exp_response) {
+        for (size_t i = 0; i + 1 < packets.size(); i++) {
+            ASSERT_FALSE(host_packet(packets[i], 16).has_value()) << name;
         }
-        tester.clk();
+        auto response = host_packet(packets.back());
+        ASSERT_TRUE(response.has_value()) << name;
+        auto decoded = UsbUtils::UsbPacketView::decode(response->bytes);
+        ASSERT_TRUE(decoded.has_value()) << name;
+        ASSERT_EQ(exp_response.view(), *decoded) << name;
+        latencies.push_back({name, response->latency});
+    };
+
+    transact("IN -> NAK", {in}, nak);
+    transact("OUT -> NAK", {out, UsbPacket::create_data_packet(UsbUtils::PID_DATA0, {0x01})}, nak);
+
+    transact("SETUP -> ACK", {setup, UsbPacket::create_data_packet(UsbUtils::PID_DATA0, set_configuration)}, ack);
+    transact("IN -> DATA1", {in}, UsbPacket::create_data_packet(UsbUtils::PID_DATA1, {}));
+    ASSERT_FALSE(host_packet(ack, 16).has_value());
+
+    transact("SETUP -> ACK", {setup, UsbPacket::create_data_packet(UsbUtils::PID_DATA0, get_descriptor)}, ack);
+    transact("IN -> DATA1[18]", {in}, UsbPacket::create_data_packet(UsbUtils::PID_DATA1, DEVICE_DESCRIPTOR));
+    ASSERT_FALSE(host_packet(ack, 16).has_value());
+
+    transact("SETUP -> ACK", {setup, UsbPacket::create_data_packet(UsbUtils::PID_DATA0, vendor_in)}, ack);
+    transact("IN -> STALL", {in}, stall);
+
+    transact("SETUP -> ACK", {setup, UsbPacket::create_data_packet(UsbUtils::PID_DATA0, set_descriptor)}, ack);
+    transact("OUT -> STALL", {out, UsbPacket::create_data_packet(UsbUtils::PID_DATA1, {0x12, 0x01})}, stall);
+
+    for (const auto& [name, latency] : latencies) {
+        std::println("{:<16} {} clks ({:.2f} bit times)", name, latency, latency / 4.0);
+        // The USB inter-packet delay is 2 to 7.5 bit times
+        ASSERT_GE(latency, 2 * 4) << name;
+        ASSERT_LE(2 * latency, 15 * 4) << name;
+        ASSERT_EQ(latency, RESPONSE_LATENCY_CLKS) << name;
     }
+}
+
+// The decoder is held in reset while the device transmits, so it never
+// follows the device's own packets on the shared bus. From the second clock
+// of each response it is idle
+TEST_F(TransactionSMTest, DecoderIdleWhileSending) {
+    reset();
 
-    tester.clk();
+    UsbHost::Endpoint ctrl = {UsbHost::TRANSFER_CONTROL, 0, 0, false, 64, 0, 1,
+                              {0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00}};
+    UsbHost::Endpoint bulk = {UsbHost::TRANSFER_BULK, 0, 1, false, 64, 0, 1, {}};
+    UsbHost::HostModel host({.endpoints = {ctrl, bulk}});
+
+    bool tx_en_last = false;
+    uint64_t sending_clks = 0;
+    uint64_t decoding_clks = 0;
+    UsbHost::run_host(host, *this, UsbHost::FRAME_CLKS, [&] {
+        if (tx_en_last && mod->tx_en) {
+            sending_clks++;
+            if (mod->rootp->transaction_sm__DOT__pkt_dec0__DOT__packet_state != 0 ||
+                mod->rootp->transaction_sm__DOT__pkt_dec0__DOT__jk0__DOT__decoder_state != 0) {
+                decoding_clks++;
+            }
+        }
+        tx_en_last = mod->tx_en;
+        return std::pair<uint8_t, bool>{UsbUtils::pack_line_state(mod->tx_dp, mod->tx_dn), mod->tx_en == 1};
+    });
+
+    ASSERT_GE(host.stats().endpoints[0].transfers, 1);
+    ASSERT_GT(host.stats().endpoints[1].acks, 0);
+    ASSERT_GT(sending_clks, 0);
+    ASSERT_EQ(decoding_clks, 0);
 }
 
+// Full speed control and bulk traffic from the host model. A GET_DESCRIPTOR
+// for the device descriptor completes every frame. Nothing drains endpoint
+// 1, so after three bulk OUTs fill its FIFO the rest are NAKed. SOFs keep
+// coming every frame
+TEST_F(TransactionSMTest, HostTraffic) {
+    reset();
 
-TEST_F(TransactionSMTest, SetupTxn) {
+    UsbHost::Endpoint ctrl = {UsbHost::TRANSFER_CONTROL, 0, 0, false, 64, 0, 1,
+                              {0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00}};
+    UsbHost::Endpoint bulk = {UsbHost::TRANSFER_BULK, 0, 1, false, 64, 0, 1, {}};
+    UsbHost::HostModel host({.endpoints = {ctrl, bulk}});
+
+    UsbHost::run_host(host, *this, 4 * UsbHost::FRAME_CLKS, [this] {
+        return std::pair<uint8_t, bool>{UsbUtils::pack_line_state(mod->tx_dp, mod->tx_dn), mod->tx_en == 1};
+    });
+
+    const auto& stats = host.stats();
+    ASSERT_EQ(stats.frames, 4);
+    ASSERT_EQ(stats.late_sofs, 0);
+    ASSERT_EQ(stats.collisions, 0);
+    ASSERT_EQ(mod->bus_reset, 0);
+
+    ASSERT_GE(stats.endpoints[0].transfers, 3);
+    ASSERT_EQ(stats.endpoints[0].stalls, 0);
+    ASSERT_EQ(stats.endpoints[0].timeouts, 0);
+    ASSERT_EQ(stats.endpoints[0].errors, 0);
+    ASSERT_FALSE(stats.endpoints[0].halted);
+
+    ASSERT_EQ(stats.endpoints[1].acks, 3);
+    ASSERT_GT(stats.endpoints[1].naks, 0);
+    ASSERT_EQ(stats.endpoints[1].timeouts, 0);
+    ASSERT_FALSE(stats.endpoints[1].halted);
+    ASSERT_EQ(mod->ep1_out_valid, 1);
+}
+
+// No data control transfers every frame complete with their zero length
+// status stage
+TEST_F(TransactionSMTest, HostControlNoData) {
     reset();
 
-    UsbUtils::JKEncoder setup_encoder =
-        UsbUtils::JKEncoder::create_token_packet(UsbUtils::PID_SETUP, 0, 0);
+    UsbHost::Endpoint ctrl = {UsbHost::TRANSFER_CONTROL, 0, 0, false, 64, 0, 1,
+                              {0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00}};
+    UsbHost::HostModel host({.endpoints = {ctrl}});
 
-    step_packet(*this, setup_encoder);
+    UsbHost::run_host(host, *this, 4 * UsbHost::FRAME_CLKS, [this] {
+        return std::pair<uint8_t, bool>{UsbUtils::pack_line_state(mod->tx_dp, mod->tx_dn), mod->tx_en == 1};
+    });
 
-    clk();
+    const auto& stats = host.stats();
+    ASSERT_EQ(stats.collisions, 0);
+    ASSERT_GE(stats.endpoints[0].transfers, 3);
+    ASSERT_EQ(stats.endpoints[0].timeouts, 0);
+    ASSERT_EQ(stats.endpoints[0].errors, 0);
+    ASSERT_FALSE(stats.endpoints[0].halted);
+    ASSERT_EQ(mod->configured, 1);
+}
 
-    std::vector<uint8_t> data = {0x80,0x06,0x00,0x01,0x00,0x00,0x40,0x00};
-    UsbUtils::JKEncoder data_encoder =
-        UsbUtils::JKEncoder::create_data_packet(UsbUtils::PID_DATA0, data);
+// The device takes the address of a SET_ADDRESS once its status stage
+// completes and from then on answers only tokens sent to it. The host
+// reads the device descriptor there and selects the configuration
+TEST_F(TransactionSMTest, HostSetAddress) {
+    reset();
+
+    const uint8_t addr = 0x12;
+    UsbHost::Config config;
+    // Once each, in the first frame. The host runs them in order
+    config.endpoints.push_back({UsbHost::TRANSFER_CONTROL, 0, 0, false, EP0_MAX_PACKET, 0, 100000,
+                                {0x00, 0x05, addr, 0x00, 0x00, 0x00, 0x00, 0x00}});
+    config.endpoints.push_back({UsbHost::TRANSFER_CONTROL, addr, 0, false, EP0_MAX_PACKET, 0, 100000,
+                                {0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00}});
+    config.endpoints.push_back({UsbHost::TRANSFER_CONTROL, addr, 0, false, EP0_MAX_PACKET, 0, 100000,
+                                {0x00, 0x09, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00}});
+
+    UsbHost::HostModel host(config);
+    std::vector<uint8_t> received;
+    host.set_in_handler([&](size_t ep, std::span<const uint8_t> data) {
+        if (ep == 1) {
+            received.insert(received.end(), data.begin(), data.end());
+        }
+    });
+
+    UsbHost::run_host(host, *this, 2 * UsbHost::FRAME_CLKS, [this] {
+        return std::pair<uint8_t, bool>{UsbUtils::pack_line_state(mod->tx_dp, mod->tx_dn), mod->tx_en == 1};
+    });
 
-    step_packet(*this, data_encoder);
+    const auto& stats = host.stats();
+    ASSERT_EQ(stats.collisions, 0);
+    for (size_t i = 0; i < config.endpoints.size(); i++) {
+        const auto& ep = stats.endpoints[i];
+        ASSERT_EQ(ep.transfers, 1) << i;
+        ASSERT_EQ(ep.stalls, 0) << i;
+        ASSERT_EQ(ep.timeouts, 0) << i;
+        ASSERT_EQ(ep.errors, 0) << i;
+    }
+    ASSERT_EQ(received, DEVICE_DESCRIPTOR);
+    ASSERT_EQ(mod->rootp->transaction_sm__DOT__core0__DOT__device_address, addr);
+    ASSERT_EQ(mod->configured, 1);
 
-    clk();
+    // Tokens for the default address are no longer answered
+    auto in = UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_IN, 0, 0);
+    ASSERT_FALSE(host_packet(in).has_value());
 }
 
+// The descriptor reads of an enumeration, one control transfer after the
+// other as a host stack issues them, through to the last status stage. With
+// 64 byte packets most reads take a single data stage IN. String 1 is
+// exactly one packet, so it needs a zero length packet after it, and string
+// 2 spans two packets. At 8 bytes, as the legacy EP0Registers sent them,
+// the same reads take several times as many
+TEST_F(TransactionSMTest, Enumeration) {
+    reset();
+
+    struct Read {
+        uint8_t type;
+        uint8_t index;
+        uint16_t length;
+        std::vector<uint8_t> desc;
+    };
+    const std::vector<Read> reads = {
+        {1, 0, 64, DEVICE_DESCRIPTOR},
+        {1, 0, 18, DEVICE_DESCRIPTOR},
+        {2, 0, 9, CONFIGURATION_DESCRIPTOR},
+        {2, 0, 255, CONFIGURATION_DESCRIPTOR},
+        {3, 0, 255, STRING_DESCRIPTORS[0]},
+        {3, 1, 255, STRING_DESCRIPTORS[1]},
+        {3, 2, 255, STRING_DESCRIPTORS[2]}
+    };
+
+    // Data stage INs at max_packet bytes a packet
+    auto data_ins = [](size_t len, uint16_t length, size_t max_packet) {
+        return len / max_packet + (len % max_packet != 0 || len < length ? 1 : 0);
+    };
+
+    UsbHost::Config config;
+    size_t exp_ins = 0;
+    size_t exp_ins_8 = 0;
+    for (const auto& read : reads) {
+        const uint8_t lang = read.type == 3 && read.index != 0 ? 0x09 : 0x00;
+        const uint8_t lang_hi = read.type == 3 && read.index != 0 ? 0x04 : 0x00;
+        // Once, in the first frame. The host runs them in order
+        config.endpoints.push_back({UsbHost::TRANSFER_CONTROL, 0, 0, false, EP0_MAX_PACKET, 0, 100000,
+                                    {0x80, 0x06, read.index, read.type, lang, lang_hi,
+                                     (uint8_t)read.length, (uint8_t)(read.length >> 8)}});
+        const size_t len = std::min<size_t>(read.desc.size(), read.length);
+        exp_ins += data_ins(len, read.length, EP0_MAX_PACKET);
+        exp_ins_8 += data_ins(len, read.length, 8);
+    }
+
+    UsbHost::HostModel host(config);
+    std::vector<std::vector<uint8_t>> received(reads.size());
+    host.set_in_handler([&](size_t ep, std::span<const uint8_t> data) {
+        received[ep].insert(received[ep].end(), data.begin(), data.end());
+    });
+
+    auto transfers = [&] {
+        uint64_t n = 0;
+        for (const auto& ep : host.stats().endpoints) {
+            n += ep.transfers;
+        }
+        return n;
+    };
+
+    while (transfers() < reads.size() && host.stats().clks < 16 * UsbHost::FRAME_CLKS) {
+        UsbHost::run_host(host, *this, 1, [this] {
+            return std::pair<uint8_t, bool>{UsbUtils::pack_line_state(mod->tx_dp, mod->tx_dn), mod->tx_en == 1};
+        });
+    }
+
+    const auto& stats = host.stats();
+    ASSERT_EQ(transfers(), reads.size());
+    ASSERT_EQ(stats.collisions, 0);
+
+    size_t ins = 0;
+    for (size_t i = 0; i < reads.size(); i++) {
+        const auto& ep = stats.endpoints[i];
+        ASSERT_EQ(ep.stalls, 0) << i;
+        ASSERT_EQ(ep.timeouts, 0) << i;
+        ASSERT_EQ(ep.errors, 0) << i;
+        // The descriptor is looked up well before the first IN
+        ASSERT_EQ(ep.naks, 0) << i;
+        const size_t len = std::min<size_t>(reads[i].desc.size(), reads[i].length);
+        ASSERT_EQ(received[i], std::vector<uint8_t>(reads[i].desc.begin(), reads[i].desc.begin() + len)) << i;
+        // SETUP, data stage INs and the status OUT
+        ins += ep.transactions - 2;
+    }
+    ASSERT_EQ(ins, exp_ins);
+
+    std::println("Enumeration: {} clks, {} frames, {} data stage INs ({} at 8 byte packets, {:.1f}x)",
+                 stats.clks, stats.frames, ins, exp_ins_8, (double)exp_ins_8 / ins);
+    ASSERT_EQ(stats.frames, 1);
+    ASSERT_LT(ins * 3, exp_ins_8);
+}
+
+// Application taking a byte from endpoint 1 every clks_per_byte clocks,
+// driven once per clock before it
+class BulkOutConsumer {
+
+    public:
+    explicit BulkOutConsumer(unsigned clks_per_byte) :
+        clks_per_byte_(clks_per_byte),
+        wait_(0) {
+    }
+
+    void step(Vtransaction_sm& m) {
+        if (wait_ < clks_per_byte_) {
+            wait_++;
+        }
+        m.ep1_out_ready = wait_ == clks_per_byte_;
+        if (m.ep1_out_ready && m.ep1_out_valid) {
+            received_.push_back(m.ep1_out_data);
+            wait_ = 0;
+        }
+    }
+
+    const std::vector<uint8_t>& received() const {
+        return received_;
+    }
+
+    private:
+    unsigned clks_per_byte_;
+    unsigned wait_;
+    std::vector<uint8_t> received_;
+};
+
+struct BulkOutThroughput {
+    double bytes_per_frame;
+    uint64_t naks;
+};
+
+// See bulk_out_endpoint.sv and bulk_in_endpoint.sv
+static const size_t FIFO_BYTES = 256;
+
+// Saturating bulk OUT traffic to endpoint 1 for frames frames
+static BulkOutThroughput bulk_out_throughput(TransactionSMTest& tester, unsigned clks_per_byte,
+                                             unsigned frames) {
+    tester.reset();
+
+    UsbHost::Endpoint bulk = {UsbHost::TRANSFER_BULK, 0, 1, false, 64, 0, 1, {}};
+    UsbHost::HostModel host({.endpoints = {bulk}});
+    BulkOutConsumer consumer(clks_per_byte);
+
+    UsbHost::run_host(host, tester, frames * UsbHost::FRAME_CLKS, [&] {
+        consumer.step(*tester.mod);
+        return std::pair<uint8_t, bool>{UsbUtils::pack_line_state(tester.mod->tx_dp, tester.mod->tx_dn),
+                                        tester.mod->tx_en == 1};
+    });
+
+    const auto& stats = host.stats();
+    EXPECT_EQ(stats.collisions, 0);
+    EXPECT_EQ(stats.endpoints[0].timeouts, 0);
+    EXPECT_EQ(stats.endpoints[0].errors, 0);
+
+    // Everything ACKed reaches the application in order, bar what is still
+    // buffered
+    EXPECT_LE(consumer.received().size(), stats.endpoints[0].bytes);
+    EXPECT_GE(consumer.received().size() + FIFO_BYTES, stats.endpoints[0].bytes);
+    for (size_t i = 0; i < consumer.received().size(); i++) {
+        EXPECT_EQ(consumer.received()[i], (uint8_t)i) << i;
+        if (consumer.received()[i] != (uint8_t)i) {
+            break;
+        }
+    }
+
+    const BulkOutThroughput result = {(double)stats.endpoints[0].bytes / frames,
+                                      stats.endpoints[0].naks};
+    std::println("{:>3} clks/byte: {:.1f} bytes/frame, {} NAKs",
+                 clks_per_byte, result.bytes_per_frame, result.naks);
+    return result;
+}
+
+// Bulk OUT throughput against applications of different speeds. With a
+// FIFO of several packets an application that drains a packet in less time
+// than the host takes to send one keeps the bus saturated; with a single
+// packet buffer it would be NAKed every other packet and get half as much
+TEST_F(TransactionSMTest, BulkOutThroughput) {
+    const unsigned frames = 10;
+
+    const auto fast = bulk_out_throughput(*this, 1, frames);
+    ASSERT_EQ(fast.naks, 0);
+    // As UsbHost.BulkOutSaturates
+    ASSERT_GE(fast.bytes_per_frame, 14 * 64);
+
+    // 2048 clocks a packet, against some 2500 for a 64 byte OUT transaction
+    const auto matched = bulk_out_throughput(*this, 32, frames);
+    ASSERT_GE(matched.bytes_per_frame, 0.95 * fast.bytes_per_frame);
+
+    // The application is the bottleneck and the host is NAKed while it
+    // catches up
+    const unsigned slow_clks_per_byte = 128;
+    const double slow_bytes_per_frame = (double)UsbHost::FRAME_CLKS / slow_clks_per_byte;
+    const auto slow = bulk_out_throughput(*this, slow_clks_per_byte, frames);
+    ASSERT_GT(slow.naks, 0);
+    ASSERT_LE(slow.bytes_per_frame, slow_bytes_per_frame + (double)FIFO_BYTES / frames);
+    ASSERT_GE(slow.bytes_per_frame, 0.9 * slow_bytes_per_frame);
+}
+
+// Bulk IN traffic from endpoint 2, fed as fast as it will take data. It is
+// never NAKed, the data arrives in order and the bus is close to full
+TEST_F(TransactionSMTest, BulkInThroughput) {
+    reset();
+
+    const unsigned frames = 10;
+
+    UsbHost::Endpoint bulk = {UsbHost::TRANSFER_BULK, 0, 2, true, 64, 0, 1, {}};
+    UsbHost::HostModel host({.endpoints = {bulk}});
+
+    uint8_t exp = 0;
+    uint64_t received = 0;
+    host.set_in_handler([&](size_t, std::span<const uint8_t> data) {
+        for (auto b : data) {
+            EXPECT_EQ(b, exp++);
+        }
+        received += data.size();
+    });
+
+    uint8_t next = 0;
+    UsbHost::run_host(host, *this, frames * UsbHost::FRAME_CLKS, [&] {
+        mod->ep2_in_valid = 1;
+        mod->ep2_in_data = next;
+        if (mod->ep2_in_ready) {
+            next++;
+        }
+        return std::pair<uint8_t, bool>{UsbUtils::pack_line_state(mod->tx_dp, mod->tx_dn), mod->tx_en == 1};
+    });
+
+    const auto& stats = host.stats();
+    ASSERT_EQ(stats.collisions, 0);
+    ASSERT_EQ(stats.endpoints[0].naks, 0);
+    ASSERT_EQ(stats.endpoints[0].timeouts, 0);
+    ASSERT_EQ(stats.endpoints[0].errors, 0);
+    ASSERT_EQ(received, stats.endpoints[0].bytes);
+
+    const double bytes_per_frame = (double)received / frames;
+    std::println("IN: {:.1f} bytes/frame", bytes_per_frame);
+    ASSERT_GE(bytes_per_frame, 14 * 64);
+}
@@ -0,0 +1,209 @@
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "usb_capture.hpp"
+
+static const double CLK_PERIOD = 1. / (48.*1000.*1000.);
+
+USBCaptureFile::USBCaptureFile(const std::string& fname) :
+    open_(false),
+    map_(nullptr),
+    map_bytes_(0),
+    encoded_(),
+    data_(nullptr),
+    data_bytes_(0),
+    edge_count_(0) {
+
+    if (is_usb_capture_binary(fname)) {
+        open_ = map_binary(fname);
+    } else {
+        auto edges = resample_usb_capture(load_usb_capture(fname));
+        encoded_ = encode_usb_capture(edges);
+        data_ = encoded_.data();
+        data_bytes_ = encoded_.size();
+        edge_count_ = edges.size();
+        open_ = edges.size() > 0;
+    }
+}
+
+USBCaptureFile::~USBCaptureFile() {
+    if (map_ != nullptr) {
+        munmap(map_, map_bytes_);
+    }
+}
+
+bool USBCaptureFile::map_binary(const std::string& fname) {
+
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (std::size_t)st.st_size < sizeof(USBCaptureHeader)) {
+        close(fd);
+        return false;
+    }
+
+    map_bytes_ = st.st_size;
+    map_ = mmap(nullptr, map_bytes_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map_ == MAP_FAILED) {
+        map_ = nullptr;
+        return false;
+    }
+
+    // Edges are only ever walked front to back
+    madvise(map_, map_bytes_, MADV_SEQUENTIAL);
+
+    USBCaptureHeader header;
+    std::memcpy(&header, map_, sizeof(header));
+    if (header.version != USB_CAPTURE_VERSION ||
+        header.data_bytes > map_bytes_ - sizeof(header)) {
+        return false;
+    }
+
+    // A truncated or corrupt file can end inside a varint. Every varint
+    // ends within the data if its last byte does
+    const uint8_t* data = static_cast<const uint8_t*>(map_) + sizeof(header);
+    if (header.data_bytes > 0 && (data[header.data_bytes - 1] & 0x80)) {
+        return false;
+    }
+
+    data_ = data;
+    data_bytes_ = header.data_bytes;
+    edge_count_ = header.edge_count;
+
+    return true;
+}
+
+bool is_usb_capture_binary(const std::string& fname) {
+
+    std::ifstream capture_f(fname, std::ios_base::binary);
+    char magic[sizeof(USB_CAPTURE_MAGIC)];
+
+    if (!capture_f.read(magic, sizeof(magic))) {
+        return false;
+    }
+    return std::equal(magic, magic + sizeof(magic), USB_CAPTURE_MAGIC);
+}
+
+std::vector<USBCaptureInput> load_usb_capture(std::string capture_fname) {
+
+    std::vector<USBCaptureInput> entries;
+
+    if (is_usb_capture_binary(capture_fname)) {
+        USBCaptureFile capture(capture_fname);
+        entries.reserve(capture.size());
+        for (const auto& edge : capture) {
+            // Half a clock before the clock that drives the edge
+            USBCaptureInput entry;
+            entry.time = (edge.cycle - 1.5) * CLK_PERIOD;
+            entry.dn = edge.dn;
+            entry.dp = edge.dp;
+            entries.push_back(entry);
+        }
+        return entries;
+    }
+
+    std::fstream captures_f(capture_fname, std::ios_base::in);
+    std::string line;
+
+    // Skip header
+    std::getline(captures_f, line);
+
+    double min_time = 0;
+    while (std::getline(captures_f, line)) {
+        USBCaptureInput entry;
+        sscanf(line.c_str(), "%lf,%d,%d\n",
+               &entry.time,
+               &entry.dn, &entry.dp);
+        if (entries.size() == 0) {
+            min_time = entry.time;
+        }
+        entry.time -= min_time;
+        entry.time += 8 * CLK_PERIOD;
+        entries.push_back(entry);
+    }
+
+    return entries;
+}
+
+std::vector<USBCaptureEdge> resample_usb_capture(const std::vector<USBCaptureInput>& capture) {
+
+    std::vector<USBCaptureEdge> edges;
+    edges.reserve(capture.size());
+
+    uint64_t next_cycle = 0;
+    for (const auto& entry : capture) {
+        // Find the first clock that starts strictly after the entry. The
+        // estimate is corrected with the same comparison the per-clock
+        // playback used so resampled captures replay identically
+        uint64_t start = entry.time > 0 ? static_cast<uint64_t>(entry.time / CLK_PERIOD) : 0;
+        while (start > 0 && (start - 1) * CLK_PERIOD > entry.time) {
+            start--;
+        }
+        while (start * CLK_PERIOD <= entry.time) {
+            start++;
+        }
+
+        // The entry is driven once that clock completes. Only one entry is
+        // driven per clock
+        const uint64_t cycle = std::max(start + 1, next_cycle);
+        edges.push_back({cycle, (uint8_t)entry.dn, (uint8_t)entry.dp});
+        next_cycle = cycle + 1;
+    }
+
+    return edges;
+}
+
+std::vector<uint8_t> encode_usb_capture(const std::vector<USBCaptureEdge>& edges) {
+
+    std::vector<uint8_t> encoded;
+    encoded.reserve(edges.size() + edges.size() / 4);
+
+    uint64_t last_cycle = 0;
+    for (const auto& edge : edges) {
+        assert(edge.cycle >= last_cycle);
+
+        uint64_t val = ((edge.cycle - last_cycle) << 2) |
+                       ((edge.dn & 1) << 1) |
+                       (edge.dp & 1);
+        while (val >= 0x80) {
+            encoded.push_back((val & 0x7F) | 0x80);
+            val >>= 7;
+        }
+        encoded.push_back(val);
+
+        last_cycle = edge.cycle;
+    }
+
+    return encoded;
+}
+
+bool write_usb_capture(const std::string& fname, const std::vector<USBCaptureEdge>& edges) {
+
+    std::vector<uint8_t> encoded = encode_usb_capture(edges);
+
+    USBCaptureHeader header;
+    std::memcpy(header.magic, USB_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = USB_CAPTURE_VERSION;
+    header.flags = 0;
+    header.edge_count = edges.size();
+    header.data_bytes = encoded.size();
+
+    std::ofstream capture_f(fname, std::ios_base::binary | std::ios_base::trunc);
+    capture_f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    capture_f.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+
+    return capture_f.good();
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <vector>
+
+struct USBCaptureInput {
+    double time;
+    int dn, dp;
+};
+
+// A capture entry resampled onto the 48 MHz clock grid. The line state is
+// driven once clk_cnt reaches cycle
+struct USBCaptureEdge {
+    uint64_t cycle;
+    uint8_t dn, dp;
+};
+
+// Binary edge list capture (.ucap)
+//
+// A fixed header followed by one LEB128 varint per edge holding
+// (cycle delta << 2) | (dn << 1) | dp. The first delta is from cycle 0.
+// A typical full speed edge costs a single byte
+struct USBCaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t edge_count;
+    uint64_t data_bytes;
+};
+
+constexpr char USB_CAPTURE_MAGIC[8] = {'U', 'S', 'B', 'C', 'A', 'P', '\0', '\0'};
+constexpr uint32_t USB_CAPTURE_VERSION = 1;
+
+// Lazily decodes edges from an encoded edge list
+class USBCaptureEdgeIterator {
+
+    public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = USBCaptureEdge;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const USBCaptureEdge*;
+    using reference = const USBCaptureEdge&;
+
+    USBCaptureEdgeIterator() :
+        pos_(nullptr),
+        next_(nullptr),
+        end_(nullptr),
+        edge_({0, 0, 0})
+    {}
+
+    USBCaptureEdgeIterator(const uint8_t* pos, const uint8_t* end) :
+        pos_(pos),
+        next_(pos),
+        end_(end),
+        edge_({0, 0, 0}) {
+        decode();
+    }
+
+    reference operator*() const {
+        return edge_;
+    }
+
+    pointer operator->() const {
+        return &edge_;
+    }
+
+    USBCaptureEdgeIterator& operator++() {
+        pos_ = next_;
+        decode();
+        return *this;
+    }
+
+    USBCaptureEdgeIterator operator++(int) {
+        USBCaptureEdgeIterator prev = *this;
+        ++(*this);
+        return prev;
+    }
+
+    bool operator==(const USBCaptureEdgeIterator& rhs) const {
+        return pos_ == rhs.pos_;
+    }
+
+    private:
+    // The encoder always terminates the final varint and USBCaptureFile
+    // rejects files that do not, so decoding never reads past end_
+    void decode() {
+        if (pos_ == end_) {
+            return;
+        }
+
+        uint64_t val = 0;
+        int shift = 0;
+        const uint8_t* p = pos_;
+        uint8_t b;
+        do {
+            b = *p++;
+            val |= (uint64_t)(b & 0x7F) << shift;
+            shift += 7;
+        } while (b & 0x80);
+        next_ = p;
+
+        edge_.cycle += val >> 2;
+        edge_.dp = val & 1;
+        edge_.dn = (val >> 1) & 1;
+    }
+
+    const uint8_t* pos_;
+    const uint8_t* next_;
+    const uint8_t* end_;
+    USBCaptureEdge edge_;
+};
+
+// A capture opened from either a logic analyzer CSV export or a .ucap file.
+// .ucap files are memory mapped and decoded as they are iterated. CSV files
+// are resampled and encoded into memory when opened
+class USBCaptureFile {
+
+    public:
+    explicit USBCaptureFile(const std::string& fname);
+    ~USBCaptureFile();
+
+    USBCaptureFile(const USBCaptureFile&) = delete;
+    USBCaptureFile& operator=(const USBCaptureFile&) = delete;
+
+    bool is_open() const {
+        return open_;
+    }
+
+    uint64_t size() const {
+        return edge_count_;
+    }
+
+    USBCaptureEdgeIterator begin() const {
+        return USBCaptureEdgeIterator(data_, data_ + data_bytes_);
+    }
+
+    USBCaptureEdgeIterator end() const {
+        return USBCaptureEdgeIterator(data_ + data_bytes_, data_ + data_bytes_);
+    }
+
+    private:
+    bool map_binary(const std::string& fname);
+
+    bool open_;
+    void* map_;
+    std::size_t map_bytes_;
+    std::vector<uint8_t> encoded_;
+    const uint8_t* data_;
+    uint64_t data_bytes_;
+    uint64_t edge_count_;
+};
+
+bool is_usb_capture_binary(const std::string& fname);
+
+// Loads either capture format. Binary captures are converted back to
+// times that resample onto the same cycles
+std::vector<USBCaptureInput> load_usb_capture(std::string capture_fname);
+std::vector<USBCaptureEdge> resample_usb_capture(const std::vector<USBCaptureInput>& capture);
+
+std::vector<uint8_t> encode_usb_capture(const std::vector<USBCaptureEdge>& edges);
+bool write_usb_capture(const std::string& fname, const std::vector<USBCaptureEdge>& edges);
@@ -0,0 +1,67 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <print>
+
+#include "usb_capture_analyzer.hpp"
+
+// Decodes a logic analyzer CSV export or .ucap edge list with the reference
+// decoder, on all cores, into a packet and transaction log. With --packets
+// only the packet bytes are written, in the format of bus_captures/*_jk.csv
+int main(int argc, char** argv) {
+
+    unsigned threads = 0;
+    bool packets = false;
+    std::vector<std::string> fnames;
+
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--packets") == 0) {
+            packets = true;
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+        } else {
+            fnames.push_back(argv[i]);
+        }
+    }
+
+    if (fnames.size() < 1 || fnames.size() > 2) {
+        std::println(stderr, "Usage: {} [--threads N] [--packets] <input.csv|input.ucap> [output.csv]", argv[0]);
+        return 1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    USBCaptureFile capture(fnames[0]);
+    if (!capture.is_open()) {
+        std::println(stderr, "Failed to open {}", fnames[0]);
+        return 1;
+    }
+
+    const auto analysis = analyze_usb_capture(capture, threads);
+
+    FILE* out_f = stdout;
+    if (fnames.size() == 2) {
+        out_f = fopen(fnames[1].c_str(), "w");
+        if (out_f == nullptr) {
+            std::println(stderr, "Failed to open {}", fnames[1]);
+            return 1;
+        }
+    }
+
+    if (packets) {
+        write_usb_capture_packets(out_f, analysis);
+    } else {
+        write_usb_capture_log(out_f, analysis);
+    }
+
+    if (out_f != stdout) {
+        fclose(out_f);
+    }
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::println(stderr, "{} edges, {} chunks, {} packets, {} transactions, {} errors in {:.3f} s",
+                 capture.size(), analysis.chunks, analysis.packets,
+                 analysis.transactions, analysis.errors, elapsed.count());
+
+    return 0;
+}
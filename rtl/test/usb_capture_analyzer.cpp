@@ -0,0 +1,339 @@
+#include <algorithm>
+#include <atomic>
+#include <format>
+#include <print>
+#include <span>
+#include <thread>
+
+#include "usb_capture_analyzer.hpp"
+
+// Chunks taken by a worker at a time. Most chunks are a single transaction
+static const size_t CHUNKS_PER_TASK = 16;
+
+std::vector<USBCaptureChunk> split_usb_capture(const USBCaptureFile& capture,
+                                               uint64_t split_clks) {
+
+    std::vector<USBCaptureChunk> chunks;
+
+    // The line is SE0 until the first edge
+    uint8_t dn = 0, dp = 0;
+    uint64_t state_cycle = 0;
+    USBCaptureChunk chunk = {0, 0, capture.begin(), 0, 0, 0, 0};
+    bool chunk_edges = false;
+
+    for (auto edge = capture.begin(); edge != capture.end(); ++edge) {
+        const uint64_t held = edge->cycle - state_cycle;
+        const bool idle = dp == 1 && dn == 0;
+        const bool se0 = dp == 0 && dn == 0;
+
+        if ((idle || se0) && held >= split_clks) {
+            chunk.end_cycle = state_cycle + USB_CAPTURE_CHUNK_MARGIN_CLKS;
+            if (chunk_edges || chunk.reset_clks > 0) {
+                chunks.push_back(chunk);
+            }
+
+            chunk = {edge->cycle - USB_CAPTURE_CHUNK_MARGIN_CLKS, 0, edge, dn, dp, 0, 0};
+            chunk_edges = false;
+            if (se0 && held >= USB_CAPTURE_RESET_CLKS) {
+                chunk.reset_cycle = state_cycle;
+                chunk.reset_clks = held;
+            }
+        }
+
+        // Idle alone is not worth a chunk, unless it follows a bus reset
+        if (edge->dp != 1 || edge->dn != 0) {
+            chunk_edges = true;
+        }
+        dn = edge->dn;
+        dp = edge->dp;
+        state_cycle = edge->cycle;
+    }
+
+    if (chunk_edges || chunk.reset_clks > 0) {
+        chunk.end_cycle = state_cycle + split_clks;
+        chunks.push_back(chunk);
+    }
+
+    return chunks;
+}
+
+static USBCapturePacketStatus packet_status(std::span<const uint8_t> bytes) {
+
+    if (bytes.empty() ||
+        (bytes[0] & 0xF) != ((~bytes[0] >> 4) & 0xF)) {
+        return CAPTURE_PACKET_BAD_PID;
+    }
+
+    if (UsbUtils::UsbPacketView::decode(bytes).has_value()) {
+        return CAPTURE_PACKET_OK;
+    }
+
+    switch (static_cast<UsbUtils::Pid>(bytes[0] & 0xF)) {
+        case UsbUtils::PID_OUT:
+        case UsbUtils::PID_IN:
+        case UsbUtils::PID_SETUP:
+        case UsbUtils::PID_SOF:
+            return bytes.size() != 3 ? CAPTURE_PACKET_BAD_LENGTH : CAPTURE_PACKET_BAD_CRC;
+        case UsbUtils::PID_DATA0:
+        case UsbUtils::PID_DATA1:
+            return bytes.size() < 3 ? CAPTURE_PACKET_BAD_LENGTH : CAPTURE_PACKET_BAD_CRC;
+        case UsbUtils::PID_ACK:
+        case UsbUtils::PID_NAK:
+        case UsbUtils::PID_STALL:
+            return CAPTURE_PACKET_BAD_LENGTH;
+        default:
+            // Not a full speed PID
+            return CAPTURE_PACKET_BAD_PID;
+    }
+}
+
+// Expand a chunk's edges into packed samples and decode them. Captured
+// edges jitter by a clock or two, which throws off the fixed-phase sampling
+// of JKStreamDecoder. As jk_decoder does, the bit clock is resynced on each
+// edge instead: the time since the last edge is rounded to whole bits, and
+// a line state held for under half a bit, e.g. between dp and dn changing
+// at an EOP, is dropped. The decoder then sees exactly four samples a bit.
+// Each kept edge is recorded to map samples back to capture cycles
+static void decode_chunk(const USBCaptureChunk& chunk, const USBCaptureEdgeIterator& end,
+                         UsbUtils::JKWaveform& wave, UsbUtils::JKStreamDecoder& decoder,
+                         std::vector<USBCaptureResync>& resyncs,
+                         std::vector<USBCaptureEvent>& events) {
+
+    wave.clear();
+    resyncs.clear();
+
+    uint64_t sample = 0;
+    uint64_t line = UsbUtils::pack_line_state(chunk.dp, chunk.dn);
+    auto fill = [&](uint64_t samples) {
+        const uint64_t lines = line * 0x5555555555555555ull;
+        while (samples > 0) {
+            const unsigned n = std::min<uint64_t>(samples, UsbUtils::JK_SAMPLES_PER_WORD);
+            wave.append(lines, n);
+            sample += n;
+            samples -= n;
+        }
+    };
+
+    uint64_t bit_cycle = chunk.start_cycle;
+    resyncs.push_back({0, bit_cycle});
+    for (auto edge = chunk.edge; edge != end && edge->cycle < chunk.end_cycle; ++edge) {
+        const uint64_t bits = (edge->cycle - bit_cycle + USB_CAPTURE_CLKS_PER_BIT / 2) /
+                              USB_CAPTURE_CLKS_PER_BIT;
+        if (bits > 0) {
+            fill(bits * USB_CAPTURE_CLKS_PER_BIT);
+            bit_cycle = edge->cycle;
+            resyncs.push_back({sample, bit_cycle});
+        }
+        line = UsbUtils::pack_line_state(edge->dp, edge->dn);
+    }
+    fill(chunk.end_cycle - bit_cycle);
+
+    // Capture cycle of a sample, from the last resync at or before it
+    auto capture_cycle = [&](uint64_t s) {
+        auto resync = std::upper_bound(resyncs.begin(), resyncs.end(), s,
+                                       [](uint64_t s, const USBCaptureResync& r) {
+                                           return s < r.sample;
+                                       });
+        --resync;
+        return resync->cycle + (s - resync->sample);
+    };
+
+    decoder.reset();
+    decoder.push_waveform(wave);
+
+    for (size_t i = 0; i < decoder.packet_count(); i++) {
+        const auto bytes = decoder.packet_bytes(i);
+        USBCaptureEvent event = {};
+        event.kind = CAPTURE_PACKET;
+        event.cycle = capture_cycle(decoder.packet_info(i).start_sample);
+        event.bytes.assign(bytes.begin(), bytes.end());
+        event.status = packet_status(bytes);
+        events.push_back(std::move(event));
+    }
+
+    for (const auto& error : decoder.errors()) {
+        USBCaptureEvent event = {};
+        event.kind = CAPTURE_DECODE_ERROR;
+        event.cycle = capture_cycle(error.sample);
+        event.error = error;
+        events.push_back(std::move(event));
+    }
+
+    std::stable_sort(events.begin(), events.end(),
+                     [](const USBCaptureEvent& a, const USBCaptureEvent& b) {
+                         return a.cycle < b.cycle;
+                     });
+}
+
+static bool starts_transaction(const USBCaptureEvent& event) {
+    if (event.kind == CAPTURE_BUS_RESET) {
+        return true;
+    }
+    if (event.kind != CAPTURE_PACKET ||
+        event.status == CAPTURE_PACKET_BAD_PID) {
+        return false;
+    }
+    switch (static_cast<UsbUtils::Pid>(event.bytes[0] & 0xF)) {
+        case UsbUtils::PID_OUT:
+        case UsbUtils::PID_IN:
+        case UsbUtils::PID_SETUP:
+        case UsbUtils::PID_SOF:
+            return true;
+        default:
+            return false;
+    }
+}
+
+USBCaptureAnalysis analyze_usb_capture(const USBCaptureFile& capture, unsigned threads) {
+
+    const auto chunks = split_usb_capture(capture);
+    const auto end = capture.end();
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min<size_t>(threads, (chunks.size() + CHUNKS_PER_TASK - 1) / CHUNKS_PER_TASK);
+
+    std::vector<std::vector<USBCaptureEvent>> chunk_events(chunks.size());
+    std::atomic<size_t> next_chunk = 0;
+
+    auto worker = [&] {
+        UsbUtils::JKWaveform wave;
+        UsbUtils::JKStreamDecoder decoder;
+        std::vector<USBCaptureResync> resyncs;
+        for (;;) {
+            const size_t first = next_chunk.fetch_add(CHUNKS_PER_TASK);
+            if (first >= chunks.size()) {
+                break;
+            }
+            const size_t last = std::min(first + CHUNKS_PER_TASK, chunks.size());
+            for (size_t i = first; i < last; i++) {
+                decode_chunk(chunks[i], end, wave, decoder, resyncs, chunk_events[i]);
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : pool) {
+        t.join();
+    }
+
+    USBCaptureAnalysis analysis = {};
+    analysis.chunks = chunks.size();
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (chunks[i].reset_clks > 0) {
+            USBCaptureEvent event = {};
+            event.kind = CAPTURE_BUS_RESET;
+            event.cycle = chunks[i].reset_cycle;
+            event.clks = chunks[i].reset_clks;
+            analysis.events.push_back(std::move(event));
+        }
+        std::move(chunk_events[i].begin(), chunk_events[i].end(),
+                  std::back_inserter(analysis.events));
+    }
+
+    uint64_t transaction = 0;
+    for (auto& event : analysis.events) {
+        if (starts_transaction(event)) {
+            transaction = analysis.transactions++;
+        }
+        event.transaction = transaction;
+
+        if (event.kind == CAPTURE_PACKET) {
+            analysis.packets++;
+            if (event.status != CAPTURE_PACKET_OK) {
+                analysis.errors++;
+            }
+        } else if (event.kind == CAPTURE_DECODE_ERROR) {
+            analysis.errors++;
+        }
+    }
+
+    return analysis;
+}
+
+static std::string packet_fields(const USBCaptureEvent& event) {
+    if (event.status != CAPTURE_PACKET_OK) {
+        return "";
+    }
+
+    const auto packet = UsbUtils::UsbPacketView::decode(event.bytes);
+    switch (packet->pid) {
+        case UsbUtils::PID_OUT:
+        case UsbUtils::PID_IN:
+        case UsbUtils::PID_SETUP:
+            return std::format("addr={} endp={}", (int)packet->token.addr, (int)packet->token.endp);
+        case UsbUtils::PID_SOF:
+            return std::format("frame={}", (int)packet->frame);
+        case UsbUtils::PID_DATA0:
+        case UsbUtils::PID_DATA1:
+            return std::format("len={}", packet->payload.size());
+        default:
+            return "";
+    }
+}
+
+static const char* packet_status_name(USBCapturePacketStatus status) {
+    switch (status) {
+        case CAPTURE_PACKET_OK: return "ok";
+        case CAPTURE_PACKET_BAD_PID: return "bad pid";
+        case CAPTURE_PACKET_BAD_LENGTH: return "bad length";
+        case CAPTURE_PACKET_BAD_CRC: return "bad crc";
+    }
+    return "";
+}
+
+static std::string packet_hex(const std::vector<uint8_t>& bytes, char sep) {
+    std::string hex;
+    hex.reserve(3 * bytes.size());
+    for (size_t i = 0; i < bytes.size(); i++) {
+        if (i > 0) {
+            hex += sep;
+        }
+        hex += std::format("{:02X}", bytes[i]);
+    }
+    return hex;
+}
+
+void write_usb_capture_log(FILE* f, const USBCaptureAnalysis& analysis) {
+
+    std::println(f, "Time [s],Cycle,Transaction,Event,Fields,Bytes,Status");
+
+    for (const auto& event : analysis.events) {
+        switch (event.kind) {
+            case CAPTURE_PACKET:
+            {
+                const auto pid = event.status == CAPTURE_PACKET_BAD_PID ?
+                                 UsbUtils::PID_INVALID :
+                                 static_cast<UsbUtils::Pid>(event.bytes[0] & 0xF);
+                std::println(f, "{:.9f},{},{},{},{},{},{}",
+                             event.time(), event.cycle, event.transaction,
+                             UsbUtils::pid_name(pid), packet_fields(event),
+                             packet_hex(event.bytes, ' '), packet_status_name(event.status));
+            }
+            break;
+            case CAPTURE_DECODE_ERROR:
+                std::println(f, "{:.9f},{},{},ERROR,,,{}",
+                             event.time(), event.cycle, event.transaction,
+                             event.error.format());
+                break;
+            case CAPTURE_BUS_RESET:
+                std::println(f, "{:.9f},{},{},RESET,clks={},,ok",
+                             event.time(), event.cycle, event.transaction, event.clks);
+                break;
+        }
+    }
+}
+
+void write_usb_capture_packets(FILE* f, const USBCaptureAnalysis& analysis) {
+    for (const auto& event : analysis.events) {
+        if (event.kind == CAPTURE_PACKET) {
+            std::println(f, "{}", packet_hex(event.bytes, ','));
+        }
+    }
+}
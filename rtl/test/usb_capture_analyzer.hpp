@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "usb_capture.hpp"
+#include "usb_utils.hpp"
+
+// Offline capture analysis with the reference decoder
+//
+// A capture is split into chunks at long idle (J) or SE0 stretches, which
+// never occur inside a packet: bit stuffing forces a transition at least
+// every 7 bit times, and an EOP is 2 bit times of SE0. Chunks are then
+// decoded independently on a pool of threads, and the results merged back
+// into a single timestamped packet and transaction log.
+
+// Idle or SE0 clocks that split a capture. Well over 7 bit times
+constexpr uint64_t USB_CAPTURE_SPLIT_CLKS = 64;
+
+// SE0 clocks reported as a bus reset (2.5 us)
+constexpr uint64_t USB_CAPTURE_RESET_CLKS = 120;
+
+// Clocks of the surrounding line state kept at each end of a chunk, enough
+// to finish an EOP and to see idle before the next SYNC
+constexpr uint64_t USB_CAPTURE_CHUNK_MARGIN_CLKS = 16;
+
+// Clocks per full speed bit time
+constexpr uint64_t USB_CAPTURE_CLKS_PER_BIT = 4;
+
+// Decoded independently of the rest of the capture. The line state is
+// dp/dn from start_cycle until the first edge
+struct USBCaptureChunk {
+    uint64_t start_cycle;
+    uint64_t end_cycle;
+    USBCaptureEdgeIterator edge;
+    uint8_t dn, dp;
+    // A bus reset (long SE0) that ended the previous chunk, or 0 clks
+    uint64_t reset_cycle;
+    uint64_t reset_clks;
+};
+
+// A kept edge of a chunk: the decoded sample it moved to and the capture
+// cycle it came from
+struct USBCaptureResync {
+    uint64_t sample;
+    uint64_t cycle;
+};
+
+std::vector<USBCaptureChunk> split_usb_capture(const USBCaptureFile& capture,
+                                               uint64_t split_clks = USB_CAPTURE_SPLIT_CLKS);
+
+enum USBCaptureEventKind {
+    CAPTURE_PACKET,
+    // A packet dropped by the decoder
+    CAPTURE_DECODE_ERROR,
+    CAPTURE_BUS_RESET
+};
+
+enum USBCapturePacketStatus {
+    CAPTURE_PACKET_OK,
+    CAPTURE_PACKET_BAD_PID,
+    CAPTURE_PACKET_BAD_LENGTH,
+    CAPTURE_PACKET_BAD_CRC
+};
+
+struct USBCaptureEvent {
+    USBCaptureEventKind kind;
+    // First K of SYNC, the decode error or the start of SE0
+    uint64_t cycle;
+    // Starts at each token or SOF
+    uint64_t transaction;
+
+    // CAPTURE_PACKET
+    std::vector<uint8_t> bytes;
+    USBCapturePacketStatus status;
+
+    // CAPTURE_DECODE_ERROR
+    UsbUtils::JKStreamError error;
+
+    // CAPTURE_BUS_RESET
+    uint64_t clks;
+
+    double time() const {
+        return cycle / 48.0e6;
+    }
+};
+
+struct USBCaptureAnalysis {
+    std::vector<USBCaptureEvent> events;
+    size_t chunks;
+    size_t packets;
+    // Packets that failed decoding or their PID, length or CRC checks
+    size_t errors;
+    size_t transactions;
+};
+
+// Decode on threads threads, 0 for one per core
+USBCaptureAnalysis analyze_usb_capture(const USBCaptureFile& capture, unsigned threads = 0);
+
+// One line per event with its time, cycle, transaction, fields and status
+void write_usb_capture_log(FILE* f, const USBCaptureAnalysis& analysis);
+
+// Decoded packet bytes, one packet per line, as in bus_captures/*_jk.csv
+void write_usb_capture_packets(FILE* f, const USBCaptureAnalysis& analysis);
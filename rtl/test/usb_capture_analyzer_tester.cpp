@@ -0,0 +1,221 @@
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "usb_capture_analyzer.hpp"
+
+static std::vector<std::vector<uint8_t>> load_packets(const std::string& fname) {
+    std::ifstream f(fname);
+    std::string line;
+    std::vector<std::vector<uint8_t>> packets;
+    while (std::getline(f, line)) {
+        std::vector<uint8_t> packet;
+        std::stringstream line_stream(line);
+        std::string val;
+        while (std::getline(line_stream, val, ',')) {
+            packet.push_back(std::strtol(val.c_str(), NULL, 16));
+        }
+        packets.push_back(packet);
+    }
+    return packets;
+}
+
+static std::vector<std::vector<uint8_t>> packets(const USBCaptureAnalysis& analysis) {
+    std::vector<std::vector<uint8_t>> out;
+    for (const auto& event : analysis.events) {
+        if (event.kind == CAPTURE_PACKET) {
+            out.push_back(event.bytes);
+        }
+    }
+    return out;
+}
+
+static void capture_test(const std::string& capture_fname,
+                         const std::string& decoder_fname) {
+    USBCaptureFile capture(capture_fname);
+    ASSERT_TRUE(capture.is_open());
+
+    auto analysis = analyze_usb_capture(capture);
+    ASSERT_EQ(packets(analysis), load_packets(decoder_fname));
+}
+
+TEST(UsbCaptureAnalyzer, SofCapture) {
+    capture_test("bus_captures/sof_capture.csv",
+                 "bus_captures/sof_capture_jk.csv");
+}
+
+TEST(UsbCaptureAnalyzer, AckPoorCapture) {
+    capture_test("bus_captures/ack_poor_capture.csv",
+                 "bus_captures/ack_poor_capture_jk.csv");
+}
+
+// Real capture with jittery edges, decoded by resyncing on each edge
+TEST(UsbCaptureAnalyzer, SetupInCapture) {
+    capture_test("bus_captures/setupin_capture.csv",
+                 "bus_captures/setupin_capture_jk.csv");
+}
+
+// Packed samples, one per cycle from cycle 0, as capture edges
+static std::vector<USBCaptureEdge> waveform_edges(const UsbUtils::JKWaveform& wave) {
+    std::vector<USBCaptureEdge> edges;
+    uint8_t line = UsbUtils::pack_line_state(0, 0);
+    for (size_t i = 0; i < wave.size(); i++) {
+        if (wave.line(i) != line) {
+            line = wave.line(i);
+            edges.push_back({i, (uint8_t)((line >> 1) & 1), (uint8_t)(line & 1)});
+        }
+    }
+    return edges;
+}
+
+static void idle(UsbUtils::JKWaveform& wave, uint64_t clks, uint8_t line = 1) {
+    for (uint64_t i = 0; i < clks; i++) {
+        wave.append(line, 1);
+    }
+}
+
+class UsbCaptureAnalyzerFile : public ::testing::Test {
+
+    public:
+    void SetUp() override {
+        fname_ = std::filesystem::temp_directory_path() /
+                 std::format("usb_capture_analyzer.{}.ucap", getpid());
+    }
+
+    void TearDown() override {
+        std::error_code ec;
+        std::filesystem::remove(fname_, ec);
+    }
+
+    std::filesystem::path fname_;
+};
+
+// Frames of SOFs and bulk transactions, identical on any number of threads
+TEST_F(UsbCaptureAnalyzerFile, Threads) {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist_byte(0, 255);
+    std::uniform_int_distribution<int> dist_len(0, 64);
+
+    UsbUtils::JKWaveform wave;
+    std::vector<std::vector<uint8_t>> exp_packets;
+    auto append = [&](const UsbUtils::UsbPacket& packet) {
+        UsbUtils::JKWaveformCache::shared().append_packet(wave, packet);
+        std::vector<uint8_t> bytes;
+        packet.view().append_bytes(bytes);
+        exp_packets.push_back(bytes);
+        idle(wave, 24);
+    };
+
+    idle(wave, 100);
+    for (uint16_t frame = 0; frame < 200; frame++) {
+        append(UsbUtils::UsbPacket::create_sof_packet(UsbUtils::PID_SOF, frame));
+        for (int txn = 0; txn < 4; txn++) {
+            std::vector<uint8_t> data(dist_len(rng));
+            for (auto& b : data) {
+                b = dist_byte(rng);
+            }
+            append(UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_OUT, 3, 1));
+            append(UsbUtils::UsbPacket::create_data_packet(txn % 2 ? UsbUtils::PID_DATA1 : UsbUtils::PID_DATA0, data));
+            append(UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK));
+        }
+        idle(wave, 2000);
+    }
+
+    ASSERT_TRUE(write_usb_capture(fname_, waveform_edges(wave)));
+    USBCaptureFile capture(fname_);
+    ASSERT_TRUE(capture.is_open());
+
+    auto single = analyze_usb_capture(capture, 1);
+    ASSERT_EQ(single.chunks, 200);
+    ASSERT_EQ(single.errors, 0);
+    ASSERT_EQ(single.transactions, 200 * 5);
+    ASSERT_EQ(packets(single), exp_packets);
+
+    for (unsigned threads : {2, 4, 7}) {
+        auto multi = analyze_usb_capture(capture, threads);
+        ASSERT_EQ(multi.events.size(), single.events.size());
+        for (size_t i = 0; i < multi.events.size(); i++) {
+            ASSERT_EQ(multi.events[i].cycle, single.events[i].cycle);
+            ASSERT_EQ(multi.events[i].transaction, single.events[i].transaction);
+            ASSERT_EQ(multi.events[i].bytes, single.events[i].bytes);
+        }
+    }
+}
+
+// CRC and bitstuff errors, and a bus reset, are annotated in the log
+TEST_F(UsbCaptureAnalyzerFile, Errors) {
+    UsbUtils::JKWaveform wave;
+    idle(wave, 100);
+
+    // A DATA0 with a flipped CRC bit
+    std::vector<uint8_t> bad_crc;
+    UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0, {1, 2, 3}).view().append_bytes(bad_crc);
+    bad_crc.back() ^= 0x80;
+    UsbUtils::JKBatchEncoder::append_packet(wave, bad_crc);
+    idle(wave, 100);
+
+    // Seven ones in a row: the first stuffed bit is held at the level of
+    // the six ones before it. The run starts at the 0 bit before them
+    UsbUtils::JKWaveform stuffed;
+    UsbUtils::JKBatchEncoder::append_packet(stuffed, std::vector<uint8_t>{0xC3, 0xFF, 0xFF});
+    uint8_t prev = stuffed.line(0);
+    size_t held = 0;
+    size_t hold = 0;
+    for (size_t i = 0; i < stuffed.size(); i++) {
+        uint8_t line = stuffed.line(i);
+        if (hold > 0) {
+            line = prev;
+            hold--;
+        } else {
+            held = line == prev ? held + 1 : 1;
+            if (held == 7 * 4) {
+                hold = 4;
+            }
+        }
+        wave.append(line, 1);
+        prev = line;
+    }
+    idle(wave, 100);
+
+    idle(wave, 200, UsbUtils::pack_line_state(0, 0));
+    idle(wave, 100);
+    UsbUtils::JKBatchEncoder::append_sof_packet(wave, 7);
+    idle(wave, 100);
+
+    ASSERT_TRUE(write_usb_capture(fname_, waveform_edges(wave)));
+    USBCaptureFile capture(fname_);
+    auto analysis = analyze_usb_capture(capture);
+
+    ASSERT_EQ(analysis.events.size(), 4);
+    ASSERT_EQ(analysis.events[0].kind, CAPTURE_PACKET);
+    ASSERT_EQ(analysis.events[0].status, CAPTURE_PACKET_BAD_CRC);
+    ASSERT_EQ(analysis.events[0].bytes, bad_crc);
+    ASSERT_EQ(analysis.events[0].cycle, 100);
+    ASSERT_EQ(analysis.events[1].kind, CAPTURE_DECODE_ERROR);
+    ASSERT_EQ(analysis.events[1].error.code, UsbUtils::JK_ERR_BITSTUFF);
+    ASSERT_EQ(analysis.events[2].kind, CAPTURE_BUS_RESET);
+    ASSERT_EQ(analysis.events[2].clks, 200);
+    ASSERT_EQ(analysis.events[3].kind, CAPTURE_PACKET);
+    ASSERT_EQ(analysis.events[3].status, CAPTURE_PACKET_OK);
+    ASSERT_EQ(analysis.errors, 2);
+    ASSERT_EQ(analysis.transactions, 2);
+
+    char* log = nullptr;
+    size_t log_size = 0;
+    FILE* f = open_memstream(&log, &log_size);
+    write_usb_capture_log(f, analysis);
+    fclose(f);
+    std::string log_str(log, log_size);
+    free(log);
+
+    ASSERT_NE(log_str.find(",DATA0,,C3 01 02 03"), std::string::npos) << log_str;
+    ASSERT_NE(log_str.find(",bad crc\n"), std::string::npos) << log_str;
+    ASSERT_NE(log_str.find("ERROR,,,PAYLOAD: Expected bitstuff"), std::string::npos) << log_str;
+    ASSERT_NE(log_str.find("RESET,clks=200,,ok"), std::string::npos) << log_str;
+    ASSERT_NE(log_str.find("SOF,frame=7,A5 07"), std::string::npos) << log_str;
+}
@@ -0,0 +1,50 @@
+
+#include <print>
+
+#include "usb_capture.hpp"
+
+// Converts a logic analyzer CSV export to a .ucap edge list, or a .ucap
+// edge list back to a resampled CSV for inspection
+int main(int argc, char** argv) {
+
+    if (argc != 3) {
+        std::println(stderr, "Usage: {} <input.csv|input.ucap> <output>", argv[0]);
+        return 1;
+    }
+
+    const std::string in_fname = argv[1];
+    const std::string out_fname = argv[2];
+
+    if (is_usb_capture_binary(in_fname)) {
+        USBCaptureFile capture(in_fname);
+        if (!capture.is_open()) {
+            std::println(stderr, "Failed to open {}", in_fname);
+            return 1;
+        }
+
+        FILE* out_f = fopen(out_fname.c_str(), "w");
+        if (out_f == nullptr) {
+            std::println(stderr, "Failed to open {}", out_fname);
+            return 1;
+        }
+        std::println(out_f, "Cycle,Dn,Dp");
+        for (const auto& edge : capture) {
+            std::println(out_f, "{},{},{}", edge.cycle, edge.dn, edge.dp);
+        }
+        fclose(out_f);
+        return 0;
+    }
+
+    auto edges = resample_usb_capture(load_usb_capture(in_fname));
+    if (edges.size() == 0) {
+        std::println(stderr, "No capture entries in {}", in_fname);
+        return 1;
+    }
+
+    if (!write_usb_capture(out_fname, edges)) {
+        std::println(stderr, "Failed to write {}", out_fname);
+        return 1;
+    }
+
+    return 0;
+}
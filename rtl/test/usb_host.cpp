@@ -0,0 +1,478 @@
+#include <algorithm>
+#include <cassert>
+
+#include "usb_host.hpp"
+
+namespace UsbHost {
+
+static constexpr uint8_t LINE_SE0 = 0;
+static constexpr uint8_t LINE_J = 1;
+static constexpr uint8_t LINE_K = 2;
+
+uint64_t Stats::bytes() const {
+    uint64_t total = 0;
+    for (const auto& ep : endpoints) {
+        total += ep.bytes;
+    }
+    return total;
+}
+
+uint64_t Stats::transactions() const {
+    uint64_t total = 0;
+    for (const auto& ep : endpoints) {
+        total += ep.transactions;
+    }
+    return total;
+}
+
+uint64_t Stats::naks() const {
+    uint64_t total = 0;
+    for (const auto& ep : endpoints) {
+        total += ep.naks;
+    }
+    return total;
+}
+
+HostModel::HostModel(Config config) :
+    state_(IDLE),
+    phase_(PHASE_SOF),
+    config_(std::move(config)),
+    stats_(),
+    eps_(config_.endpoints.size(), EndpointState{UsbUtils::PID_DATA0, 0, false, 0, CONTROL_IDLE, 0, 0}),
+    in_handler_(),
+    clk_(0),
+    frame_(0),
+    sof_due_(false),
+    frame_full_(false),
+    next_bulk_(0),
+    txn_(),
+    tx_(),
+    tx_pos_(0),
+    data_tx_(),
+    gap_then_send_(false),
+    timer_(0),
+    rx_(),
+    rx_se0_(false),
+    rx_decoder_(),
+    out_payload_() {
+
+    stats_.endpoints.resize(config_.endpoints.size());
+}
+
+// Bit stuffing adds at most one bit in six
+uint64_t HostModel::packet_clks(size_t bytes) {
+    return CLKS_PER_BIT * (8 + (bytes * 8 * 7 + 5) / 6 + 3) + 1;
+}
+
+uint8_t HostModel::step(uint8_t dut_line, bool dut_oe) {
+
+    if (clk_ % FRAME_CLKS == 0) {
+        sof_due_ = true;
+        frame_full_ = false;
+    }
+
+    if (state_ == IDLE) {
+        schedule();
+    }
+
+    const uint8_t dut_bus = dut_oe ? dut_line : LINE_J;
+    uint8_t line = dut_bus;
+    bool host_oe = false;
+
+    switch (state_) {
+        case IDLE:
+            break;
+
+        case SEND:
+            line = tx_.line(tx_pos_++);
+            host_oe = true;
+            if (tx_pos_ == tx_.size()) {
+                sent();
+            }
+            break;
+
+        case GAP:
+            if (++timer_ >= config_.inter_packet_bits * CLKS_PER_BIT) {
+                if (gap_then_send_) {
+                    std::swap(tx_, data_tx_);
+                    tx_pos_ = 0;
+                    state_ = SEND;
+                } else {
+                    state_ = IDLE;
+                }
+            }
+            break;
+
+        case WAIT:
+            if (dut_bus == LINE_K) {
+                rx_.clear();
+                rx_.append(dut_bus, 1);
+                rx_se0_ = false;
+                state_ = RECEIVE;
+            } else if (++timer_ >= config_.turnaround_bits * CLKS_PER_BIT) {
+                timeout();
+            }
+            break;
+
+        case RECEIVE:
+            rx_.append(dut_bus, 1);
+            if (dut_bus == LINE_SE0) {
+                rx_se0_ = true;
+            } else if (rx_se0_ && dut_bus == LINE_J) {
+                received();
+            } else if (rx_.size() > packet_clks(1 + 1023 + 2)) {
+                error(false);
+            }
+            break;
+    }
+
+    if (host_oe && dut_oe) {
+        stats_.collisions++;
+    }
+    if (host_oe || dut_oe) {
+        stats_.busy_clks++;
+    }
+    stats_.clks++;
+    clk_++;
+
+    return line;
+}
+
+void HostModel::start_frame() {
+    sof_due_ = false;
+    stats_.frames++;
+    if (clk_ % FRAME_CLKS != 0) {
+        stats_.late_sofs++;
+    }
+
+    for (auto& ep : eps_) {
+        ep.frame_bytes = 0;
+        ep.polled = false;
+    }
+
+    tx_.clear();
+    UsbUtils::JKWaveformCache::shared().append_packet(tx_,
+        UsbUtils::UsbPacket::create_sof_packet(UsbUtils::PID_SOF, frame_));
+    frame_ = (frame_ + 1) & 0x7FF;
+    tx_pos_ = 0;
+    phase_ = PHASE_SOF;
+    state_ = SEND;
+}
+
+// Interrupt polls first, then control transfers, then bulk round robin
+bool HostModel::schedule() {
+
+    if (sof_due_) {
+        start_frame();
+        return true;
+    }
+    if (frame_full_) {
+        return false;
+    }
+
+    const uint64_t frame_left = FRAME_CLKS - clk_ % FRAME_CLKS;
+    const uint64_t margin = config_.eof_margin_bits * CLKS_PER_BIT;
+    const uint64_t remaining = frame_left > margin ? frame_left - margin : 0;
+
+    const size_t n = config_.endpoints.size();
+    for (TransferType type : {TRANSFER_INTERRUPT, TRANSFER_CONTROL}) {
+        for (size_t ep = 0; ep < n; ep++) {
+            if (config_.endpoints[ep].type == type && eligible(ep, remaining)) {
+                start_transaction(ep);
+                return true;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        const size_t ep = (next_bulk_ + i) % n;
+        if (config_.endpoints[ep].type == TRANSFER_BULK && eligible(ep, remaining)) {
+            next_bulk_ = ep + 1;
+            start_transaction(ep);
+            return true;
+        }
+    }
+
+    // Nothing more fits or is wanted before the next SOF
+    frame_full_ = true;
+    return false;
+}
+
+bool HostModel::eligible(size_t ep, uint64_t remaining_clks) {
+    const Endpoint& cfg = config_.endpoints[ep];
+    const EndpointState& s = eps_[ep];
+    const uint64_t frame = stats_.frames - 1;
+
+    if (stats_.endpoints[ep].halted ||
+        transaction_clks(ep) > remaining_clks) {
+        return false;
+    }
+
+    switch (cfg.type) {
+        case TRANSFER_INTERRUPT:
+            return !s.polled && frame % std::max(1u, cfg.interval) == 0;
+        case TRANSFER_CONTROL:
+            return s.stage != CONTROL_IDLE ||
+                   (!s.polled && frame % std::max(1u, cfg.interval) == 0);
+        case TRANSFER_BULK:
+            return cfg.bytes_per_frame == 0 || s.frame_bytes < cfg.bytes_per_frame;
+    }
+    return false;
+}
+
+uint64_t HostModel::transaction_clks(size_t ep) const {
+    const Endpoint& cfg = config_.endpoints[ep];
+    const uint64_t gap = config_.inter_packet_bits * CLKS_PER_BIT;
+    const uint64_t turnaround = config_.turnaround_bits * CLKS_PER_BIT;
+    const size_t data = std::max<size_t>(cfg.max_packet, 8);
+
+    // The worst case of either direction
+    return packet_clks(3) + gap + turnaround +
+           packet_clks(1 + data + 2) + gap +
+           packet_clks(1) + gap;
+}
+
+void HostModel::start_transaction(size_t ep) {
+    const Endpoint& cfg = config_.endpoints[ep];
+    EndpointState& s = eps_[ep];
+
+    stats_.endpoints[ep].transactions++;
+    txn_.ep = ep;
+    txn_.out_bytes = 0;
+    out_payload_.clear();
+
+    UsbUtils::Pid data_pid = s.toggle;
+
+    if (cfg.type == TRANSFER_CONTROL) {
+        if (s.stage == CONTROL_IDLE) {
+            s.stage = CONTROL_SETUP;
+            s.polled = true;
+        }
+        switch (s.stage) {
+            case CONTROL_SETUP:
+                txn_.token = UsbUtils::PID_SETUP;
+                data_pid = UsbUtils::PID_DATA0;
+                out_payload_.assign(cfg.setup.begin(), cfg.setup.end());
+                break;
+            case CONTROL_DATA_IN:
+            case CONTROL_STATUS_IN:
+                txn_.token = UsbUtils::PID_IN;
+                break;
+            case CONTROL_STATUS_OUT:
+            case CONTROL_IDLE:
+                txn_.token = UsbUtils::PID_OUT;
+                break;
+        }
+    } else {
+        if (cfg.type == TRANSFER_INTERRUPT) {
+            s.polled = true;
+        }
+        txn_.token = cfg.in ? UsbUtils::PID_IN : UsbUtils::PID_OUT;
+        if (!cfg.in) {
+            size_t len = cfg.max_packet;
+            if (cfg.type == TRANSFER_BULK && cfg.bytes_per_frame != 0) {
+                len = std::min<size_t>(len, cfg.bytes_per_frame - s.frame_bytes);
+            }
+            for (size_t i = 0; i < len; i++) {
+                out_payload_.push_back(s.out_seq + i);
+            }
+        }
+    }
+    txn_.out_bytes = out_payload_.size();
+
+    tx_.clear();
+    UsbUtils::JKWaveformCache::shared().append_packet(tx_,
+        UsbUtils::UsbPacket::create_token_packet(txn_.token, cfg.addr, cfg.endp));
+    if (txn_.token != UsbUtils::PID_IN) {
+        data_tx_.clear();
+        UsbUtils::JKBatchEncoder::append_data_packet(data_tx_, data_pid, out_payload_);
+    }
+
+    tx_pos_ = 0;
+    phase_ = PHASE_TOKEN;
+    state_ = SEND;
+}
+
+void HostModel::sent() {
+    switch (phase_) {
+        case PHASE_SOF:
+        case PHASE_ACK_IN:
+            gap(false);
+            break;
+        case PHASE_TOKEN:
+            if (txn_.token == UsbUtils::PID_IN) {
+                phase_ = PHASE_WAIT_DATA;
+                state_ = WAIT;
+                timer_ = 0;
+            } else {
+                phase_ = PHASE_DATA_OUT;
+                gap(true);
+            }
+            break;
+        case PHASE_DATA_OUT:
+            phase_ = PHASE_WAIT_HANDSHAKE;
+            state_ = WAIT;
+            timer_ = 0;
+            break;
+        case PHASE_WAIT_HANDSHAKE:
+        case PHASE_WAIT_DATA:
+            assert(false);
+            break;
+    }
+}
+
+void HostModel::gap(bool then_send) {
+    state_ = GAP;
+    timer_ = 0;
+    gap_then_send_ = then_send;
+}
+
+void HostModel::timeout() {
+    error(true);
+}
+
+void HostModel::received() {
+    rx_decoder_.reset();
+    rx_decoder_.push_waveform(rx_);
+
+    std::optional<UsbUtils::UsbPacketView> packet;
+    if (rx_decoder_.packet_count() == 1) {
+        packet = UsbUtils::UsbPacketView::decode(rx_decoder_.packet_bytes(0));
+    }
+    if (!packet.has_value()) {
+        error(false);
+        return;
+    }
+
+    const UsbUtils::Pid pid = packet->pid;
+    const bool handshake = pid == UsbUtils::PID_ACK ||
+                           pid == UsbUtils::PID_NAK ||
+                           pid == UsbUtils::PID_STALL;
+    const bool data = pid == UsbUtils::PID_DATA0 ||
+                      pid == UsbUtils::PID_DATA1;
+
+    if (phase_ == PHASE_WAIT_HANDSHAKE && handshake) {
+        out_complete(*packet);
+    } else if (phase_ == PHASE_WAIT_DATA && (data || (handshake && pid != UsbUtils::PID_ACK))) {
+        in_complete(*packet);
+    } else {
+        error(false);
+    }
+}
+
+static UsbUtils::Pid flip(UsbUtils::Pid toggle) {
+    return toggle == UsbUtils::PID_DATA0 ? UsbUtils::PID_DATA1 : UsbUtils::PID_DATA0;
+}
+
+void HostModel::out_complete(const UsbUtils::UsbPacketView& handshake) {
+    const Endpoint& cfg = config_.endpoints[txn_.ep];
+    EndpointState& s = eps_[txn_.ep];
+    EndpointStats& st = stats_.endpoints[txn_.ep];
+
+    switch (handshake.pid) {
+        case UsbUtils::PID_ACK:
+            st.acks++;
+            s.errors = 0;
+            if (s.stage == CONTROL_SETUP) {
+                const uint16_t length = cfg.setup[6] | (cfg.setup[7] << 8);
+                s.stage = (cfg.setup[0] & 0x80) && length > 0 ? CONTROL_DATA_IN : CONTROL_STATUS_IN;
+                s.stage_bytes = 0;
+                s.toggle = UsbUtils::PID_DATA1;
+            } else if (s.stage == CONTROL_STATUS_OUT) {
+                s.stage = CONTROL_IDLE;
+                st.transfers++;
+            } else {
+                s.toggle = flip(s.toggle);
+                s.out_seq += txn_.out_bytes;
+                s.frame_bytes += txn_.out_bytes;
+                st.bytes += txn_.out_bytes;
+            }
+            break;
+        case UsbUtils::PID_NAK:
+            st.naks++;
+            s.errors = 0;
+            break;
+        case UsbUtils::PID_STALL:
+        default:
+            st.stalls++;
+            st.halted = true;
+            s.stage = CONTROL_IDLE;
+            break;
+    }
+
+    gap(false);
+}
+
+void HostModel::in_complete(const UsbUtils::UsbPacketView& packet) {
+    const Endpoint& cfg = config_.endpoints[txn_.ep];
+    EndpointState& s = eps_[txn_.ep];
+    EndpointStats& st = stats_.endpoints[txn_.ep];
+
+    if (packet.pid == UsbUtils::PID_NAK) {
+        st.naks++;
+        s.errors = 0;
+        gap(false);
+        return;
+    }
+    if (packet.pid == UsbUtils::PID_STALL) {
+        st.stalls++;
+        st.halted = true;
+        s.stage = CONTROL_IDLE;
+        gap(false);
+        return;
+    }
+
+    s.errors = 0;
+    st.acks++;
+
+    if (packet.pid == s.toggle) {
+        const size_t len = packet.payload.size();
+        s.toggle = flip(s.toggle);
+        s.frame_bytes += len;
+        st.bytes += len;
+        if (in_handler_) {
+            in_handler_(txn_.ep, packet.payload);
+        }
+
+        if (s.stage == CONTROL_DATA_IN) {
+            const uint16_t length = cfg.setup[6] | (cfg.setup[7] << 8);
+            s.stage_bytes += len;
+            if (len < cfg.max_packet || s.stage_bytes >= length) {
+                s.stage = CONTROL_STATUS_OUT;
+                s.toggle = UsbUtils::PID_DATA1;
+            }
+        } else if (s.stage == CONTROL_STATUS_IN) {
+            s.stage = CONTROL_IDLE;
+            st.transfers++;
+        }
+    } else {
+        // The device missed our last ACK and resent. ACK it again, but
+        // the data is not new
+        st.errors++;
+    }
+
+    data_tx_.clear();
+    UsbUtils::JKWaveformCache::shared().append_packet(data_tx_,
+        UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK));
+    phase_ = PHASE_ACK_IN;
+    gap(true);
+}
+
+void HostModel::error(bool timed_out) {
+    EndpointState& s = eps_[txn_.ep];
+    EndpointStats& st = stats_.endpoints[txn_.ep];
+
+    if (timed_out) {
+        st.timeouts++;
+    } else {
+        st.errors++;
+    }
+    if (++s.errors >= config_.max_errors) {
+        st.halted = true;
+        s.stage = CONTROL_IDLE;
+    }
+
+    gap(false);
+}
+
+}
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <vector>
+
+#include "usb_utils.hpp"
+
+// Full speed host traffic generator
+//
+// A clocked host model for the 48 MHz simulation clock. Every 1 ms frame
+// starts with a SOF, and the rest of the frame is packed with transactions
+// for the configured endpoints until the next one would run past the end of
+// frame margin. Interrupt endpoints are polled on their interval, control
+// transfers are started on theirs, and bulk endpoints share what is left
+// round robin, each up to its bytes_per_frame target.
+//
+// The host reacts to the device: OUT and SETUP data is resent until ACKed,
+// IN data is ACKed and toggles are tracked, a NAK moves on to the next
+// endpoint, and a STALL or three errors in a row halt the endpoint. A
+// response that has not started within the turnaround timeout is an error.
+//
+// Control transfers run a SETUP stage, an IN data stage when the request is
+// device to host with a non-zero wLength, and a status stage. OUT data
+// stages are not generated.
+
+namespace UsbHost {
+
+constexpr uint64_t CLKS_PER_BIT = 4;
+constexpr uint64_t FRAME_CLKS = 48000;
+
+enum TransferType {
+    TRANSFER_CONTROL,
+    TRANSFER_BULK,
+    TRANSFER_INTERRUPT
+};
+
+struct Endpoint {
+    TransferType type;
+    uint8_t addr;
+    uint8_t endp;
+    // Device to host. Ignored for control endpoints
+    bool in;
+    uint16_t max_packet;
+    // Bulk: payload bytes to move per frame, 0 to saturate the bus
+    uint32_t bytes_per_frame;
+    // Interrupt: frames between polls. Control: frames between transfers
+    unsigned interval;
+    // Control: the request sent in the SETUP stage
+    std::array<uint8_t, 8> setup;
+};
+
+struct Config {
+    std::vector<Endpoint> endpoints;
+    // Idle bit times between two host packets of a transaction, and after
+    // the end of each transaction
+    unsigned inter_packet_bits = 4;
+    // Bit times from the end of a host packet to the device's SOP
+    unsigned turnaround_bits = 18;
+    // Bit times before the next SOF in which no transaction is started
+    unsigned eof_margin_bits = 32;
+    // Consecutive errors before an endpoint is halted
+    unsigned max_errors = 3;
+};
+
+struct EndpointStats {
+    uint64_t transactions;
+    // Transactions completed with an ACK, from either side
+    uint64_t acks;
+    uint64_t naks;
+    uint64_t stalls;
+    uint64_t timeouts;
+    // Corrupt or unexpected responses, and repeated IN data
+    uint64_t errors;
+    // Payload bytes acknowledged, either direction
+    uint64_t bytes;
+    // Completed control transfers
+    uint64_t transfers;
+    bool halted;
+};
+
+struct Stats {
+    uint64_t clks;
+    uint64_t frames;
+    // Clocks with either side driving the bus
+    uint64_t busy_clks;
+    // Clocks with both sides driving
+    uint64_t collisions;
+    // SOFs sent after the start of their frame
+    uint64_t late_sofs;
+    std::vector<EndpointStats> endpoints;
+
+    double seconds() const {
+        return clks / 48.0e6;
+    }
+
+    double utilization() const {
+        return clks == 0 ? 0.0 : (double)busy_clks / clks;
+    }
+
+    uint64_t bytes() const;
+    uint64_t transactions() const;
+    uint64_t naks() const;
+
+    double nak_rate() const {
+        return transactions() == 0 ? 0.0 : (double)naks() / transactions();
+    }
+
+    // Acknowledged payload bytes per second of simulated time
+    double throughput() const {
+        return clks == 0 ? 0.0 : bytes() / seconds();
+    }
+};
+
+class HostModel {
+
+    public:
+    explicit HostModel(Config config);
+
+    // Advance one clock. dut_line is the device transmitter's line state
+    // (as UsbUtils::pack_line_state) and dut_oe whether it is driving.
+    // Returns the line state of the bus
+    uint8_t step(uint8_t dut_line, bool dut_oe);
+
+    // IN data accepted from endpoint index ep
+    void set_in_handler(std::function<void(size_t ep, std::span<const uint8_t> data)> handler) {
+        in_handler_ = std::move(handler);
+    }
+
+    const Stats& stats() const {
+        return stats_;
+    }
+
+    const Config& config() const {
+        return config_;
+    }
+
+    // No transaction in flight
+    bool idle() const {
+        return state_ == IDLE;
+    }
+
+    private:
+    enum state_t {
+        IDLE,
+        SEND,
+        GAP,
+        WAIT,
+        RECEIVE
+    } state_;
+
+    enum phase_t {
+        PHASE_SOF,
+        PHASE_TOKEN,
+        PHASE_DATA_OUT,
+        PHASE_WAIT_HANDSHAKE,
+        PHASE_WAIT_DATA,
+        PHASE_ACK_IN
+    } phase_;
+
+    enum control_stage_t {
+        CONTROL_IDLE,
+        CONTROL_SETUP,
+        CONTROL_DATA_IN,
+        CONTROL_STATUS_IN,
+        CONTROL_STATUS_OUT
+    };
+
+    struct EndpointState {
+        UsbUtils::Pid toggle;
+        uint32_t frame_bytes;
+        bool polled;
+        unsigned errors;
+        control_stage_t stage;
+        uint32_t stage_bytes;
+        uint8_t out_seq;
+    };
+
+    // A transaction's token and direction
+    struct Transaction {
+        size_t ep;
+        UsbUtils::Pid token;
+        size_t out_bytes;
+    };
+
+    void start_frame();
+    bool schedule();
+    bool eligible(size_t ep, uint64_t remaining_clks);
+    void start_transaction(size_t ep);
+    uint64_t transaction_clks(size_t ep) const;
+
+    void sent();
+    void gap(bool then_send);
+    void received();
+    void timeout();
+
+    void out_complete(const UsbUtils::UsbPacketView& handshake);
+    void in_complete(const UsbUtils::UsbPacketView& data);
+    void error(bool timed_out);
+
+    static uint64_t packet_clks(size_t bytes);
+
+    Config config_;
+    Stats stats_;
+    std::vector<EndpointState> eps_;
+    std::function<void(size_t, std::span<const uint8_t>)> in_handler_;
+
+    uint64_t clk_;
+    uint16_t frame_;
+    bool sof_due_;
+    bool frame_full_;
+    size_t next_bulk_;
+
+    Transaction txn_;
+    UsbUtils::JKWaveform tx_;
+    size_t tx_pos_;
+    UsbUtils::JKWaveform data_tx_;
+    bool gap_then_send_;
+    uint64_t timer_;
+
+    UsbUtils::JKWaveform rx_;
+    bool rx_se0_;
+    UsbUtils::JKStreamDecoder rx_decoder_;
+    std::vector<uint8_t> out_payload_;
+};
+
+// Clock a UsbModTest model under host for clocks. dut() returns the model's
+// transmitter as a pair of (line state, output enable)
+template <typename Tester, typename DutFn>
+void run_host(HostModel& host, Tester& tester, uint64_t clocks, DutFn&& dut) {
+    for (uint64_t i = 0; i < clocks; i++) {
+        const auto [dut_line, dut_oe] = dut();
+        const uint8_t line = host.step(dut_line, dut_oe);
+        tester.mod->dp = line & 1;
+        tester.mod->dn = (line >> 1) & 1;
+        tester.clk();
+    }
+}
+
+}
@@ -0,0 +1,260 @@
+#include <optional>
+
+#include <gtest/gtest.h>
+
+#include "usb_host.hpp"
+
+// A device built from the C++ models. It answers a few bit times after each
+// host packet: OUT and SETUP data with on_out()'s handshake, and IN tokens
+// with on_in()'s payload, or a NAK when there is none
+class FakeDevice {
+
+    public:
+    std::function<UsbUtils::Pid(uint8_t endp, std::span<const uint8_t> data)> on_out =
+        [](uint8_t, std::span<const uint8_t>) { return UsbUtils::PID_ACK; };
+    std::function<std::optional<std::vector<uint8_t>>(uint8_t endp)> on_in =
+        [](uint8_t) { return std::nullopt; };
+
+    std::vector<uint16_t> sof_frames;
+    uint64_t setups = 0;
+
+    std::pair<uint8_t, bool> output() const {
+        if (tx_pos_ < tx_.size() && delay_ == 0) {
+            return {tx_.line(tx_pos_), true};
+        }
+        return {UsbUtils::pack_line_state(1, 0), false};
+    }
+
+    void observe(uint8_t line) {
+        if (tx_pos_ < tx_.size()) {
+            if (delay_ > 0) {
+                delay_--;
+            } else {
+                tx_pos_++;
+            }
+            return;
+        }
+
+        if (!receiving_) {
+            if (line == UsbUtils::pack_line_state(0, 1)) {
+                receiving_ = true;
+                rx_se0_ = false;
+                rx_.clear();
+                rx_.append(line, 1);
+            }
+            return;
+        }
+
+        rx_.append(line, 1);
+        if (line == UsbUtils::pack_line_state(0, 0)) {
+            rx_se0_ = true;
+        } else if (rx_se0_ && line == UsbUtils::pack_line_state(1, 0)) {
+            receiving_ = false;
+            packet();
+        }
+    }
+
+    private:
+    void packet() {
+        decoder_.reset();
+        decoder_.push_waveform(rx_);
+        ASSERT_EQ(decoder_.packet_count(), 1);
+        auto packet = UsbUtils::UsbPacketView::decode(decoder_.packet_bytes(0));
+        ASSERT_TRUE(packet.has_value());
+
+        switch (packet->pid) {
+            case UsbUtils::PID_SOF:
+                sof_frames.push_back(packet->frame);
+                break;
+            case UsbUtils::PID_SETUP:
+                in_toggle_[0] = UsbUtils::PID_DATA1;
+                setups++;
+                [[fallthrough]];
+            case UsbUtils::PID_OUT:
+                token_ = packet->pid;
+                endp_ = packet->token.endp;
+                break;
+            case UsbUtils::PID_IN:
+            {
+                token_ = packet->pid;
+                endp_ = packet->token.endp;
+                auto data = on_in(endp_);
+                if (data.has_value()) {
+                    send(UsbUtils::UsbPacket::create_data_packet(in_toggle_[endp_], *data));
+                } else {
+                    send(UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_NAK));
+                }
+            }
+            break;
+            case UsbUtils::PID_DATA0:
+            case UsbUtils::PID_DATA1:
+            {
+                UsbUtils::Pid handshake = on_out(endp_, packet->payload);
+                send(UsbUtils::UsbPacket::create_handshake_packet(handshake));
+            }
+            break;
+            case UsbUtils::PID_ACK:
+                if (token_ == UsbUtils::PID_IN) {
+                    in_toggle_[endp_] = in_toggle_[endp_] == UsbUtils::PID_DATA0 ?
+                                        UsbUtils::PID_DATA1 : UsbUtils::PID_DATA0;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void send(const UsbUtils::UsbPacket& packet) {
+        tx_.clear();
+        UsbUtils::JKWaveformCache::shared().append_packet(tx_, packet);
+        tx_pos_ = 0;
+        delay_ = 2 * UsbHost::CLKS_PER_BIT;
+    }
+
+    UsbUtils::JKWaveform tx_;
+    size_t tx_pos_ = 0;
+    unsigned delay_ = 0;
+
+    bool receiving_ = false;
+    bool rx_se0_ = false;
+    UsbUtils::JKWaveform rx_;
+    UsbUtils::JKStreamDecoder decoder_;
+
+    UsbUtils::Pid token_ = UsbUtils::PID_INVALID;
+    uint8_t endp_ = 0;
+    std::array<UsbUtils::Pid, 16> in_toggle_ = [] {
+        std::array<UsbUtils::Pid, 16> t;
+        t.fill(UsbUtils::PID_DATA0);
+        return t;
+    }();
+};
+
+static void run(UsbHost::HostModel& host, FakeDevice& dev, uint64_t frames) {
+    for (uint64_t i = 0; i < frames * UsbHost::FRAME_CLKS; i++) {
+        auto [line, oe] = dev.output();
+        dev.observe(host.step(line, oe));
+    }
+}
+
+static UsbHost::Endpoint bulk(uint8_t endp, bool in, uint32_t bytes_per_frame = 0) {
+    return {UsbHost::TRANSFER_BULK, 3, endp, in, 64, bytes_per_frame, 1, {}};
+}
+
+TEST(UsbHost, SofEveryFrame) {
+    UsbHost::HostModel host({});
+    FakeDevice dev;
+    run(host, dev, 5);
+
+    ASSERT_EQ(host.stats().frames, 5);
+    ASSERT_EQ(host.stats().late_sofs, 0);
+    ASSERT_EQ(dev.sof_frames, std::vector<uint16_t>({0, 1, 2, 3, 4}));
+}
+
+// Back to back 64 byte OUTs, in order, with the bus close to full
+TEST(UsbHost, BulkOutSaturates) {
+    UsbHost::HostModel host({.endpoints = {bulk(1, false)}});
+    FakeDevice dev;
+    uint8_t exp = 0;
+    uint64_t received = 0;
+    dev.on_out = [&](uint8_t endp, std::span<const uint8_t> data) {
+        EXPECT_EQ(endp, 1);
+        for (auto b : data) {
+            EXPECT_EQ(b, exp++);
+        }
+        received += data.size();
+        return UsbUtils::PID_ACK;
+    };
+    run(host, dev, 10);
+
+    const auto& stats = host.stats();
+    ASSERT_EQ(stats.late_sofs, 0);
+    ASSERT_EQ(stats.collisions, 0);
+    ASSERT_EQ(stats.bytes(), received);
+    ASSERT_EQ(stats.naks(), 0);
+    // At most 19 64 byte transactions fit a frame
+    ASSERT_GE(stats.bytes(), 10 * 14 * 64);
+    ASSERT_GT(stats.utilization(), 0.8);
+}
+
+// NAKed data is resent with the same toggle and payload
+TEST(UsbHost, BulkOutNak) {
+    UsbHost::HostModel host({.endpoints = {bulk(2, false)}});
+    FakeDevice dev;
+    uint8_t exp = 0;
+    uint64_t calls = 0;
+    dev.on_out = [&](uint8_t, std::span<const uint8_t> data) {
+        if (calls++ % 2 == 0) {
+            return UsbUtils::PID_NAK;
+        }
+        for (auto b : data) {
+            EXPECT_EQ(b, exp++);
+        }
+        return UsbUtils::PID_ACK;
+    };
+    run(host, dev, 4);
+
+    const auto& stats = host.stats();
+    ASSERT_NEAR(stats.nak_rate(), 0.5, 0.01);
+    ASSERT_EQ(stats.endpoints[0].acks, stats.endpoints[0].naks);
+    ASSERT_EQ(stats.bytes(), stats.endpoints[0].acks * 64);
+}
+
+TEST(UsbHost, BandwidthTargets) {
+    UsbHost::Endpoint intr = {UsbHost::TRANSFER_INTERRUPT, 3, 3, true, 8, 0, 2, {}};
+    UsbHost::HostModel host({.endpoints = {bulk(1, true, 256), intr}});
+    FakeDevice dev;
+    dev.on_in = [](uint8_t endp) -> std::optional<std::vector<uint8_t>> {
+        return std::vector<uint8_t>(endp == 1 ? 64 : 8, endp);
+    };
+    std::vector<size_t> in_bytes(2);
+    host.set_in_handler([&](size_t ep, std::span<const uint8_t> data) {
+        in_bytes[ep] += data.size();
+    });
+    run(host, dev, 8);
+
+    const auto& stats = host.stats();
+    ASSERT_EQ(stats.endpoints[0].bytes, 8 * 256);
+    ASSERT_EQ(stats.endpoints[1].transactions, 4);
+    ASSERT_EQ(stats.endpoints[1].bytes, 4 * 8);
+    ASSERT_EQ(in_bytes[0], stats.endpoints[0].bytes);
+    ASSERT_EQ(in_bytes[1], stats.endpoints[1].bytes);
+}
+
+// GET_DESCRIPTOR(DEVICE): SETUP, one IN data packet and an OUT status
+TEST(UsbHost, ControlTransfer) {
+    UsbHost::Endpoint ctrl = {UsbHost::TRANSFER_CONTROL, 0, 0, false, 64, 0, 1,
+                              {0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00}};
+    UsbHost::HostModel host({.endpoints = {ctrl}});
+    FakeDevice dev;
+    std::vector<uint8_t> setup;
+    dev.on_out = [&](uint8_t, std::span<const uint8_t> data) {
+        if (data.size() == 8) {
+            setup.assign(data.begin(), data.end());
+        }
+        return UsbUtils::PID_ACK;
+    };
+    dev.on_in = [](uint8_t) -> std::optional<std::vector<uint8_t>> {
+        return std::vector<uint8_t>(18, 0x12);
+    };
+    run(host, dev, 3);
+
+    const auto& stats = host.stats();
+    ASSERT_EQ(setup, std::vector<uint8_t>(ctrl.setup.begin(), ctrl.setup.end()));
+    ASSERT_EQ(dev.setups, 3);
+    ASSERT_EQ(stats.endpoints[0].transfers, 3);
+    ASSERT_EQ(stats.endpoints[0].transactions, 9);
+    ASSERT_EQ(stats.endpoints[0].bytes, 3 * 18);
+}
+
+// A device that never answers halts the endpoint after three timeouts
+TEST(UsbHost, Timeout) {
+    UsbHost::HostModel host({.endpoints = {bulk(1, true)}});
+    for (uint64_t i = 0; i < UsbHost::FRAME_CLKS; i++) {
+        host.step(UsbUtils::pack_line_state(1, 0), false);
+    }
+
+    const auto& ep = host.stats().endpoints[0];
+    ASSERT_EQ(ep.timeouts, 3);
+    ASSERT_EQ(ep.transactions, 3);
+    ASSERT_TRUE(ep.halted);
+}
@@ -1,12 +1,29 @@
+#pragma once
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <deque>
 #include <format>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <print>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 namespace UsbUtils {
 
@@ -40,8 +57,37 @@ enum Pid {
     PID_INVALID = 0x0
 };
 
+// The PID and its check nibble, as sent on the bus
+static constexpr uint8_t pid_byte(Pid pid) {
+    uint8_t pid_lo = std::to_underlying(pid);
+    return pid_lo | ((~(pid_lo << 4)) & 0xF0);
+}
+
+static constexpr std::string_view pid_name(Pid pid) {
+    switch (pid) {
+        case PID_OUT: return "OUT";
+        case PID_IN: return "IN";
+        case PID_SOF: return "SOF";
+        case PID_SETUP: return "SETUP";
+        case PID_DATA0: return "DATA0";
+        case PID_DATA1: return "DATA1";
+        case PID_DATA2: return "DATA2";
+        case PID_MDATA: return "MDATA";
+        case PID_ACK: return "ACK";
+        case PID_NAK: return "NAK";
+        case PID_STALL: return "STALL";
+        case PID_NYET: return "NYET";
+        case PID_ERR: return "ERR";
+        case PID_SPLIT: return "SPLIT";
+        case PID_PING: return "PING";
+        case PID_INVALID: return "INVALID";
+    }
+    return "INVALID";
+}
+
 // Taken from https://electronics.stackexchange.com/questions/718294/how-is-crc5-calculated-in-detail-for-a-usb-token
-static unsigned char crc5usb(unsigned short input)
+// Bit at a time reference for CRC5_TABLE
+static constexpr unsigned char crc5usb_bitwise(unsigned short input)
 {
         unsigned char res = 0x1f;
         unsigned char b;
@@ -60,7 +106,8 @@ static unsigned char crc5usb(unsigned short input)
 }
 
 // Modified from https://www.reddit.com/r/embedded/comments/1acoobg/crc16_again_with_a_little_gift_for_you_all/
-static uint16_t crc16usb(const uint8_t* data, size_t length) {
+// Byte at a time reference for the table driven and CLMUL paths
+static constexpr uint16_t crc16usb_bytewise(const uint8_t* data, size_t length) {
 
     uint16_t crc = 0xFFFF;
 
@@ -81,6 +128,186 @@ static uint16_t crc16usb(const uint8_t* data, size_t length) {
     return crc ^ 0xFFFF;
 }
 
+// Tokens and SOFs only ever carry 11 bits, so CRC5 is a single lookup
+static constexpr std::array<uint8_t, 2048> CRC5_TABLE = [] {
+    std::array<uint8_t, 2048> table = {};
+    for (unsigned short i = 0; i < table.size(); i++) {
+        table[i] = crc5usb_bitwise(i);
+    }
+    return table;
+}();
+
+static constexpr unsigned char crc5usb(unsigned short input) {
+    return CRC5_TABLE[input & 0x7FF];
+}
+
+// Slice-by-8 tables for the reflected CRC16 (poly 0x8005, reflected 0xA001).
+// CRC16_TABLES[k][b] advances byte b followed by k zero bytes
+static constexpr std::array<std::array<uint16_t, 256>, 8> CRC16_TABLES = [] {
+    std::array<std::array<uint16_t, 256>, 8> tables = {};
+    for (unsigned b = 0; b < 256; b++) {
+        uint16_t crc = b;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+        }
+        tables[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (unsigned b = 0; b < 256; b++) {
+            uint16_t prev = tables[k-1][b];
+            tables[k][b] = (prev >> 8) ^ tables[0][prev & 0xFF];
+        }
+    }
+    return tables;
+}();
+
+// Advance a CRC16 register (no init or final xor) eight bytes at a time
+static inline uint16_t crc16usb_update_slice8(uint16_t crc, const uint8_t* data, size_t length) {
+
+    const auto& t = CRC16_TABLES;
+
+    while (length >= 8) {
+        uint64_t v;
+        std::memcpy(&v, data, sizeof(v));
+        if constexpr (std::endian::native == std::endian::big) {
+            v = std::byteswap(v);
+        }
+        v ^= crc;
+        crc = t[7][v & 0xFF] ^
+              t[6][(v >> 8) & 0xFF] ^
+              t[5][(v >> 16) & 0xFF] ^
+              t[4][(v >> 24) & 0xFF] ^
+              t[3][(v >> 32) & 0xFF] ^
+              t[2][(v >> 40) & 0xFF] ^
+              t[1][(v >> 48) & 0xFF] ^
+              t[0][v >> 56];
+        data += 8;
+        length -= 8;
+    }
+
+    while (length-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define USB_UTILS_CRC16_CLMUL 1
+
+// Carry-less multiply folding for long payloads
+//
+// With 16 bytes loaded little endian, the low qword holds the earliest
+// (highest degree) bits of the reflected message, and clmul of two reflected
+// operands yields x * a * b. Folding a 128 bit block D bits forward is then
+// clmul(lo, x^(D+63) mod P) ^ clmul(hi, x^(D-1) mod P), which keeps the
+// block congruent mod P. The folded remainder is finished with the tables.
+
+// x^n mod P, P = x^16 + x^15 + x^2 + 1, encoded as a reflected qword
+static constexpr uint64_t crc16usb_fold_constant(unsigned n) {
+    uint32_t r = 1;
+    for (unsigned i = 0; i < n; i++) {
+        r <<= 1;
+        if (r & 0x10000) {
+            r ^= 0x18005;
+        }
+    }
+
+    uint64_t c = 0;
+    for (int d = 0; d < 16; d++) {
+        if (r & (1u << d)) {
+            c |= 1ull << (63 - d);
+        }
+    }
+    return c;
+}
+
+// Shorter payloads are faster through the tables
+constexpr size_t CRC16_CLMUL_MIN_LENGTH = 64;
+
+__attribute__((target("pclmul,sse2")))
+static inline __m128i crc16usb_fold(__m128i x, __m128i k) {
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+                         _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+// Requires length >= 16 and a CPU with PCLMULQDQ
+__attribute__((target("pclmul,sse2")))
+static inline uint16_t crc16usb_update_clmul(uint16_t crc, const uint8_t* data, size_t length) {
+
+    const __m128i k128 = _mm_set_epi64x(crc16usb_fold_constant(128 - 1),
+                                        crc16usb_fold_constant(128 + 63));
+    const __m128i k512 = _mm_set_epi64x(crc16usb_fold_constant(512 - 1),
+                                        crc16usb_fold_constant(512 + 63));
+
+    auto load = [](const uint8_t* p) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    };
+
+    // The register seeds the first two message bytes
+    __m128i x = _mm_xor_si128(load(data), _mm_cvtsi32_si128(crc));
+
+    if (length >= 64) {
+        // Four independent lanes hide the multiplier latency
+        __m128i x1 = load(data + 16);
+        __m128i x2 = load(data + 32);
+        __m128i x3 = load(data + 48);
+        data += 64;
+        length -= 64;
+
+        while (length >= 64) {
+            x = _mm_xor_si128(crc16usb_fold(x, k512), load(data));
+            x1 = _mm_xor_si128(crc16usb_fold(x1, k512), load(data + 16));
+            x2 = _mm_xor_si128(crc16usb_fold(x2, k512), load(data + 32));
+            x3 = _mm_xor_si128(crc16usb_fold(x3, k512), load(data + 48));
+            data += 64;
+            length -= 64;
+        }
+
+        x = _mm_xor_si128(crc16usb_fold(x, k128), x1);
+        x = _mm_xor_si128(crc16usb_fold(x, k128), x2);
+        x = _mm_xor_si128(crc16usb_fold(x, k128), x3);
+    } else {
+        data += 16;
+        length -= 16;
+    }
+
+    while (length >= 16) {
+        x = _mm_xor_si128(crc16usb_fold(x, k128), load(data));
+        data += 16;
+        length -= 16;
+    }
+
+    uint8_t folded[16];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(folded), x);
+
+    crc = crc16usb_update_slice8(0, folded, sizeof(folded));
+    return crc16usb_update_slice8(crc, data, length);
+}
+
+static inline bool crc16usb_has_clmul() {
+    static const bool has_clmul = __builtin_cpu_supports("pclmul");
+    return has_clmul;
+}
+#endif
+
+static inline uint16_t crc16usb(const uint8_t* data, size_t length) {
+
+    uint16_t crc = 0xFFFF;
+
+#ifdef USB_UTILS_CRC16_CLMUL
+    if (length >= CRC16_CLMUL_MIN_LENGTH && crc16usb_has_clmul()) {
+        crc = crc16usb_update_clmul(crc, data, length);
+    } else {
+        crc = crc16usb_update_slice8(crc, data, length);
+    }
+#else
+    crc = crc16usb_update_slice8(crc, data, length);
+#endif
+
+    return crc ^ 0xFFFF;
+}
+
 
 class JKDecoder {
 
@@ -199,6 +426,18 @@ class JKDecoder {
         return decoded_;
     }
 
+    // Payload bits decoded so far, PID included and stuffed bits removed
+    int get_bit_count() {
+        return payload_counter_;
+    }
+
+    // The most recently decoded payload bit
+    int get_last_bit() {
+        assert(payload_counter_ > 0);
+        uint8_t last = (payload_counter_ % 8) == 0 ? decoded_.back() : byte_in_;
+        return last >> 7;
+    }
+
     private:
 
     BusState get_busstate(uint8_t dp, uint8_t dn) {
@@ -243,6 +482,436 @@ class JKDecoder {
     std::optional<std::string> err_;
 };
 
+// Packed line state samples for JKStreamDecoder: 2 bits per 48 MHz sample,
+// bit 0 dp and bit 1 dn, 32 samples per word starting at the low bits
+constexpr unsigned JK_SAMPLES_PER_WORD = 32;
+
+static constexpr uint64_t pack_line_state(uint8_t dp, uint8_t dn) {
+    return (dp & 1) | ((dn & 1) << 1);
+}
+
+// A packed line state waveform. clear() keeps the words allocated, so a
+// waveform reused across packets stops allocating once it has grown
+class JKWaveform {
+
+    public:
+    void clear() {
+        words_.clear();
+        samples_ = 0;
+    }
+
+    void reserve(size_t samples) {
+        words_.reserve((samples + JK_SAMPLES_PER_WORD - 1) / JK_SAMPLES_PER_WORD);
+    }
+
+    // Append samples (at most 32) packed in the low bits of lines
+    void append(uint64_t lines, unsigned samples) {
+        assert(samples > 0 && samples <= JK_SAMPLES_PER_WORD);
+        if (samples < JK_SAMPLES_PER_WORD) {
+            lines &= (1ull << (2 * samples)) - 1;
+        }
+        const unsigned shift = 2 * (samples_ % JK_SAMPLES_PER_WORD);
+        if (shift == 0) {
+            words_.push_back(lines);
+        } else {
+            words_.back() |= lines << shift;
+            if (shift + 2 * samples > 64) {
+                words_.push_back(lines >> (64 - shift));
+            }
+        }
+        samples_ += samples;
+    }
+
+    void append(const JKWaveform& wave) {
+        if (samples_ % JK_SAMPLES_PER_WORD == 0) {
+            words_.insert(words_.end(), wave.words_.begin(), wave.words_.end());
+            samples_ += wave.samples_;
+            return;
+        }
+        for (size_t i = 0; i < wave.words_.size(); i++) {
+            append(wave.words_[i], wave.word_samples(i));
+        }
+    }
+
+    size_t size() const {
+        return samples_;
+    }
+
+    const std::vector<uint64_t>& words() const {
+        return words_;
+    }
+
+    // Samples held by word i
+    unsigned word_samples(size_t i) const {
+        return i + 1 < words_.size() ? JK_SAMPLES_PER_WORD
+                                     : samples_ - i * JK_SAMPLES_PER_WORD;
+    }
+
+    uint8_t line(size_t i) const {
+        return (words_[i / JK_SAMPLES_PER_WORD] >> (2 * (i % JK_SAMPLES_PER_WORD))) & 3;
+    }
+
+    BusState bus(size_t i) const {
+        static constexpr BusState buses[4] = {BUS_SE0, BUS_J, BUS_K, BUS_INVALID};
+        return buses[line(i)];
+    }
+
+    private:
+    std::vector<uint64_t> words_;
+    size_t samples_ = 0;
+};
+
+enum JKStreamErrorCode {
+    JK_ERR_SYNC,
+    JK_ERR_INVALID_BUS,
+    JK_ERR_FINAL_BITSTUFF,
+    JK_ERR_BITSTUFF
+};
+
+// A decode error, formatted only when asked for. Messages match JKDecoder
+struct JKStreamError {
+    JKStreamErrorCode code;
+    // Sample index in the stream
+    uint64_t sample;
+    // SYNC: the sync bit index
+    uint8_t sync_bit;
+    BusState bus;
+
+    std::string format() const {
+        switch (code) {
+            case JK_ERR_SYNC:
+                return std::format("SYNC: Expected {} at sync byte {}. Found {}",
+                                   (sync_bit == 2 || sync_bit == 4 || sync_bit >= 6) ? "BUS_K" : "BUS_J",
+                                   sync_bit, std::to_underlying(bus));
+            case JK_ERR_INVALID_BUS:
+                return std::format("PAYLOAD: Bus in invalid state. Found {}",
+                                   std::to_underlying(bus));
+            case JK_ERR_FINAL_BITSTUFF:
+                return std::format("PAYLOAD: Expected final bitstuff before EOP");
+            case JK_ERR_BITSTUFF:
+                return std::format("PAYLOAD: Expected bitstuff");
+        }
+        return "";
+    }
+};
+
+// Streaming reference decoder over packed line state samples
+//
+// Decodes with the same sampling as JKDecoder: the bus is sampled every 4th
+// sample from the first K of a packet. Unlike JKDecoder it returns to idle
+// after each EOP, so a stream can carry any number of packets. Packets are
+// appended to a single byte buffer that keeps its capacity across clear().
+//
+// Whole words are consumed 8 bit periods at a time: the 8 sampled line
+// states are gathered with a multiply, NRZI decoded by comparing with the
+// states shifted by one, and appended as a byte unless the group holds an
+// SE0, SE1 or a run of six ones. Those groups, and SYNC and EOP, go through
+// the per-sample state machine. A packet with an error is dropped at its EOP.
+class JKStreamDecoder {
+
+    public:
+    struct Packet {
+        size_t offset;
+        size_t size;
+        // Sample index of the first K of SYNC
+        uint64_t start_sample;
+    };
+
+    JKStreamDecoder() {
+        reset();
+    }
+
+    void reset() {
+        state_ = IDLE;
+        next_sample_ = 0;
+        sample_base_ = 0;
+        pending_ = 0;
+        pending_samples_ = 0;
+        clear();
+    }
+
+    // Drop decoded output, keeping the buffers for reuse
+    void clear() {
+        bytes_.clear();
+        packets_.clear();
+        errors_.clear();
+    }
+
+    // Decode samples samples from the low bits of word
+    void push_word(uint64_t word, unsigned samples = JK_SAMPLES_PER_WORD) {
+        assert(pending_samples_ == 0);
+        decode_word(word, samples);
+        sample_base_ += samples;
+    }
+
+    void push_words(const uint64_t* words, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            push_word(words[i]);
+        }
+    }
+
+    void push_waveform(const JKWaveform& wave) {
+        flush();
+        for (size_t i = 0; i < wave.words().size(); i++) {
+            push_word(wave.words()[i], wave.word_samples(i));
+        }
+    }
+
+    // Sample at a time, e.g. from a model's outputs each clock
+    void push_sample(uint8_t dp, uint8_t dn) {
+        pending_ |= pack_line_state(dp, dn) << (2 * pending_samples_);
+        if (++pending_samples_ == JK_SAMPLES_PER_WORD) {
+            flush();
+        }
+    }
+
+    // Decode any samples held by push_sample()
+    void flush() {
+        if (pending_samples_ > 0) {
+            const unsigned samples = pending_samples_;
+            pending_samples_ = 0;
+            push_word(pending_, samples);
+            pending_ = 0;
+        }
+    }
+
+    size_t packet_count() const {
+        return packets_.size();
+    }
+
+    const Packet& packet_info(size_t i) const {
+        return packets_[i];
+    }
+
+    std::vector<uint8_t> packet(size_t i) const {
+        const Packet& p = packets_[i];
+        return std::vector<uint8_t>(bytes_.begin() + p.offset,
+                                    bytes_.begin() + p.offset + p.size);
+    }
+
+    const uint8_t* packet_data(size_t i) const {
+        return bytes_.data() + packets_[i].offset;
+    }
+
+    // Valid until the decoder is cleared or reset
+    std::span<const uint8_t> packet_bytes(size_t i) const {
+        return {bytes_.data() + packets_[i].offset, packets_[i].size};
+    }
+
+    const std::vector<JKStreamError>& errors() const {
+        return errors_;
+    }
+
+    // A packet has started and not yet completed
+    bool in_packet() const {
+        return state_ != IDLE;
+    }
+
+    private:
+    static constexpr uint64_t SAMPLE_LSB = 0x0101010101010101ull;
+    static constexpr uint64_t GATHER = 0x0102040810204080ull;
+
+    static BusState line_bus(unsigned line) {
+        static constexpr BusState buses[4] = {BUS_SE0, BUS_J, BUS_K, BUS_INVALID};
+        return buses[line & 3];
+    }
+
+    void decode_word(uint64_t word, unsigned samples) {
+        const uint64_t valid = samples == JK_SAMPLES_PER_WORD ? ~0ull : (1ull << (2 * samples)) - 1;
+        // A K has dn set and dp clear
+        const uint64_t k_mask = (word >> 1) & ~word & 0x5555555555555555ull & valid;
+
+        unsigned i = next_sample_;
+        while (i < samples) {
+            if (state_ == IDLE) {
+                const uint64_t k_from = i == 0 ? k_mask : k_mask & (~0ull << (2 * i));
+                if (k_from == 0) {
+                    i = samples;
+                    break;
+                }
+                const unsigned k = std::countr_zero(k_from) / 2;
+                start_packet(sample_base_ + k);
+                i = k + 4;
+                continue;
+            }
+
+            if (state_ == PAYLOAD && i + 28 < samples &&
+                decode_group(word >> (2 * i))) {
+                i += 32;
+                continue;
+            }
+
+            step((word >> (2 * i)) & 3, sample_base_ + i);
+            // Look for the next SYNC from the sample after an EOP
+            i += state_ == IDLE ? 1 : 4;
+        }
+
+        next_sample_ = state_ == IDLE ? 0 : i - samples;
+    }
+
+    // Eight bit periods from the sample in the low bits of s. Returns false,
+    // consuming nothing, when the group needs the per-sample path
+    bool decode_group(uint64_t s) {
+        const uint8_t dp = ((s & SAMPLE_LSB) * GATHER) >> 56;
+        const uint8_t dn = (((s >> 1) & SAMPLE_LSB) * GATHER) >> 56;
+
+        // Only J and K
+        if ((dp ^ dn) != 0xFF) {
+            return false;
+        }
+
+        // J is dp high. A bit is one when the level is unchanged
+        const uint8_t prev = (dp << 1) | last_level_;
+        const uint8_t bits = ~(dp ^ prev);
+
+        const uint32_t run = (uint32_t(bits) << ones_) | ((1u << ones_) - 1);
+        if ((run & (run >> 1) & (run >> 2) & (run >> 3) & (run >> 4) & (run >> 5)) != 0) {
+            return false;
+        }
+
+        byte_in_ |= uint32_t(bits) << bit_cnt_;
+        bytes_.push_back(byte_in_ & 0xFF);
+        byte_in_ >>= 8;
+
+        ones_ = std::countl_one(bits);
+        last_level_ = dp >> 7;
+        last_bus_ = last_level_ ? BUS_J : BUS_K;
+        return true;
+    }
+
+    void start_packet(uint64_t sample) {
+        state_ = SYNC;
+        sync_cnt_ = 0;
+        ones_ = 0;
+        last_bus_ = BUS_K;
+        last_level_ = 0;
+        byte_in_ = 0;
+        bit_cnt_ = 0;
+        packet_error_ = false;
+        packet_start_ = sample;
+        packet_offset_ = bytes_.size();
+    }
+
+    void error(JKStreamErrorCode code, uint64_t sample, BusState bus) {
+        errors_.push_back({code, sample, (uint8_t)sync_cnt_, bus});
+        packet_error_ = true;
+        state_ = bus == BUS_SE0 ? EOP : SKIP;
+    }
+
+    void step(unsigned line, uint64_t sample) {
+        const BusState bus = line_bus(line);
+
+        switch (state_) {
+            case SYNC:
+            {
+                sync_cnt_++;
+                const bool exp_k = sync_cnt_ == 2 || sync_cnt_ == 4 || sync_cnt_ >= 6;
+                if (bus != (exp_k ? BUS_K : BUS_J)) {
+                    error(JK_ERR_SYNC, sample, bus);
+                    return;
+                }
+                ones_ = bus == last_bus_ ? ones_ + 1 : 0;
+                last_bus_ = bus;
+                last_level_ = bus == BUS_J;
+                if (sync_cnt_ == 7) {
+                    state_ = PAYLOAD;
+                }
+            }
+            break;
+
+            case PAYLOAD:
+            {
+                if (bus == BUS_INVALID) {
+                    error(JK_ERR_INVALID_BUS, sample, bus);
+                    return;
+                }
+                if (bus == BUS_SE0) {
+                    if (ones_ == 6) {
+                        error(JK_ERR_FINAL_BITSTUFF, sample, bus);
+                        return;
+                    }
+                    state_ = EOP;
+                    return;
+                }
+
+                const unsigned bit = bus == last_bus_;
+                if (ones_ == 6) {
+                    if (bit) {
+                        error(JK_ERR_BITSTUFF, sample, bus);
+                        return;
+                    }
+                    // Stuffed bit
+                    ones_ = 0;
+                } else {
+                    byte_in_ |= bit << bit_cnt_;
+                    if (++bit_cnt_ == 8) {
+                        bytes_.push_back(byte_in_ & 0xFF);
+                        byte_in_ = 0;
+                        bit_cnt_ = 0;
+                    }
+                    ones_ = bit ? ones_ + 1 : 0;
+                }
+                last_bus_ = bus;
+                last_level_ = bus == BUS_J;
+            }
+            break;
+
+            case SKIP:
+                if (bus == BUS_SE0) {
+                    state_ = EOP;
+                }
+                break;
+
+            case EOP:
+                if (bus == BUS_J) {
+                    finish_packet();
+                }
+                break;
+
+            case IDLE:
+                break;
+        }
+    }
+
+    // Partial bytes at EOP are dropped, as in JKDecoder
+    void finish_packet() {
+        if (packet_error_) {
+            bytes_.resize(packet_offset_);
+        } else {
+            packets_.push_back({packet_offset_, bytes_.size() - packet_offset_, packet_start_});
+        }
+        state_ = IDLE;
+    }
+
+    enum state_t {
+        IDLE,
+        SYNC,
+        PAYLOAD,
+        SKIP,
+        EOP
+    } state_;
+
+    // Offset of the next bus sample into the next word
+    unsigned next_sample_;
+    uint64_t sample_base_;
+    uint64_t pending_;
+    unsigned pending_samples_;
+
+    unsigned sync_cnt_;
+    unsigned ones_;
+    BusState last_bus_;
+    uint8_t last_level_;
+    uint32_t byte_in_;
+    unsigned bit_cnt_;
+    bool packet_error_;
+    uint64_t packet_start_;
+    size_t packet_offset_;
+
+    std::vector<uint8_t> bytes_;
+    std::vector<Packet> packets_;
+    std::vector<JKStreamError> errors_;
+};
+
 class JKEncoder {
 
     public:
@@ -346,8 +1015,7 @@ class JKEncoder {
 
     private:
     static uint8_t get_pid_byte(Pid pid) {
-        uint8_t pid_byte = std::to_underlying(pid);
-        return pid_byte | ((~(pid_byte << 4)) & 0xF0);
+        return pid_byte(pid);
     }
 
     public:
@@ -455,27 +1123,256 @@ class JKEncoder {
     std::optional<std::string> err_;
 };
 
-struct UsbPacket {
+// Batch encoder rendering whole packets into a JKWaveform, sample for
+// sample the same as stepping a JKEncoder until is_complete()
+//
+// A bit period is four samples, so each byte is one full word. For a byte
+// that cannot need a stuffed bit, the NRZI levels are a prefix xor of the
+// inverted bits and the word is a single lookup. Other bytes are encoded a
+// bit at a time. Packets are appended, so several can share a waveform.
+class JKBatchEncoder {
+
+    public:
+    // Encode already formed packet bytes (PID first)
+    static void append_packet(JKWaveform& wave, const uint8_t* data, size_t length) {
+        JKBatchEncoder encoder(wave);
+        encoder.sync();
+        encoder.bytes(data, length);
+        encoder.eop();
+    }
+
+    static void append_packet(JKWaveform& wave, const std::vector<uint8_t>& data) {
+        append_packet(wave, data.data(), data.size());
+    }
+
+    static void append_token_packet(JKWaveform& wave, Pid pid, uint8_t addr, uint8_t endp) {
+        assert(pid == PID_IN ||
+               pid == PID_OUT ||
+               pid == PID_SETUP);
+
+        uint8_t crc5 = crc5usb((endp << 7) | addr);
+
+        const uint8_t data[] = {
+            pid_byte(pid),
+            (uint8_t)((addr & 0x7F) | ((endp & 1) << 7)),
+            (uint8_t)((((endp >> 1) & 0x7) | (crc5 << 3)))
+        };
+        append_packet(wave, data, sizeof(data));
+    }
+
+    static void append_sof_packet(JKWaveform& wave, uint16_t frame) {
+
+        uint8_t crc5 = crc5usb(frame);
+
+        const uint8_t data[] = {
+            pid_byte(PID_SOF),
+            (uint8_t)(frame & 0xFF),
+            (uint8_t)(((frame >> 8) & 0x7) | (crc5 << 3))
+        };
+        append_packet(wave, data, sizeof(data));
+    }
+
+    static void append_handshake_packet(JKWaveform& wave, Pid pid) {
+
+        assert(pid == PID_ACK ||
+               pid == PID_NAK ||
+               pid == PID_STALL);
+
+        const uint8_t data[] = {
+            pid_byte(pid)
+        };
+        append_packet(wave, data, sizeof(data));
+    }
+
+    static void append_data_packet(JKWaveform& wave, Pid pid,
+                                   const uint8_t* data, size_t length) {
+
+        assert(pid == PID_DATA0 ||
+               pid == PID_DATA1);
+
+        uint16_t crc = crc16usb(data, length);
+        const uint8_t pid_bytes[] = {pid_byte(pid)};
+        const uint8_t crc_bytes[] = {(uint8_t)(crc & 0xFF), (uint8_t)(crc >> 8)};
+
+        JKBatchEncoder encoder(wave);
+        encoder.sync();
+        encoder.bytes(pid_bytes, sizeof(pid_bytes));
+        encoder.bytes(data, length);
+        encoder.bytes(crc_bytes, sizeof(crc_bytes));
+        encoder.eop();
+    }
+
+    static void append_data_packet(JKWaveform& wave, Pid pid, const std::vector<uint8_t>& data) {
+        append_data_packet(wave, pid, data.data(), data.size());
+    }
 
     private:
-    UsbPacket() :
+    // Four samples of J for a one level bit, K for a zero, per bit of the index
+    static constexpr std::array<uint64_t, 256> PERIOD_WORDS = [] {
+        std::array<uint64_t, 256> words = {};
+        for (unsigned levels = 0; levels < words.size(); levels++) {
+            for (unsigned i = 0; i < 8; i++) {
+                words[levels] |= uint64_t((levels >> i) & 1 ? 0x55 : 0xAA) << (8 * i);
+            }
+        }
+        return words;
+    }();
+
+    static constexpr uint64_t PERIOD_SE0 = 0x00;
+    static constexpr uint64_t SAMPLE_J = 0x1;
+
+    JKBatchEncoder(JKWaveform& wave) :
+        wave_(wave),
+        level_(0),
+        ones_(0)
+    {}
+
+    // KJKJKJKK. The final KK starts the bitstuff count
+    void sync() {
+        wave_.append(PERIOD_WORDS[0x2A], JK_SAMPLES_PER_WORD);
+        level_ = 0;
+        ones_ = 1;
+    }
+
+    void period(uint8_t level) {
+        wave_.append(level ? 0x55 : 0xAA, 4);
+    }
+
+    void bytes(const uint8_t* data, size_t length) {
+        for (size_t i = 0; i < length; i++) {
+            const uint8_t b = data[i];
+
+            const uint32_t run = (uint32_t(b) << ones_) | ((1u << ones_) - 1);
+            if ((run & (run >> 1) & (run >> 2) & (run >> 3) & (run >> 4) & (run >> 5)) == 0) {
+                // Bit i of levels is the level after bit i
+                uint8_t toggles = ~b;
+                toggles ^= toggles << 1;
+                toggles ^= toggles << 2;
+                toggles ^= toggles << 4;
+                const uint8_t levels = level_ ? ~toggles : toggles;
+
+                wave_.append(PERIOD_WORDS[levels], JK_SAMPLES_PER_WORD);
+                level_ = levels >> 7;
+                ones_ = std::countl_one(b);
+                continue;
+            }
+
+            for (unsigned j = 0; j < 8; j++) {
+                if (ones_ == 6) {
+                    level_ ^= 1;
+                    period(level_);
+                    ones_ = 0;
+                }
+                const unsigned bit = (b >> j) & 1;
+                level_ ^= bit ^ 1;
+                period(level_);
+                ones_ = bit ? ones_ + 1 : 0;
+            }
+        }
+    }
+
+    // Two bit periods of SE0 and a single sample of J
+    void eop() {
+        if (ones_ == 6) {
+            level_ ^= 1;
+            period(level_);
+        }
+        wave_.append(PERIOD_SE0, 8);
+        wave_.append(SAMPLE_J, 1);
+    }
+
+    JKWaveform& wave_;
+    uint8_t level_;
+    unsigned ones_;
+};
+
+// Payload storage for packets kept across a test run
+//
+// Payloads are copied into fixed size blocks that stay allocated across
+// reset(), so a scoreboard that resets the arena between runs stops
+// allocating once it has warmed up. Stored spans are valid until reset().
+class UsbPayloadArena {
+
+    public:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    std::span<const uint8_t> store(std::span<const uint8_t> data) {
+        if (data.empty()) {
+            return {};
+        }
+        if (block_ == blocks_.size() || used_ + data.size() > blocks_[block_].size) {
+            next_block(data.size());
+        }
+        uint8_t* dst = blocks_[block_].data.get() + used_;
+        std::memcpy(dst, data.data(), data.size());
+        used_ += data.size();
+        return {dst, data.size()};
+    }
+
+    // Release every stored payload, keeping the blocks
+    void reset() {
+        block_ = 0;
+        used_ = 0;
+    }
+
+    size_t capacity() const {
+        size_t total = 0;
+        for (const auto& b : blocks_) {
+            total += b.size;
+        }
+        return total;
+    }
+
+    private:
+    struct Block {
+        std::unique_ptr<uint8_t[]> data;
+        size_t size;
+    };
+
+    void next_block(size_t min_size) {
+        if (block_ < blocks_.size() && used_ > 0) {
+            block_++;
+        }
+        // Reuse a block from before the last reset() when it is big enough
+        while (block_ < blocks_.size() && blocks_[block_].size < min_size) {
+            block_++;
+        }
+        if (block_ == blocks_.size()) {
+            const size_t size = std::max(min_size, BLOCK_SIZE);
+            blocks_.push_back({std::make_unique_for_overwrite<uint8_t[]>(size), size});
+        }
+        used_ = 0;
+    }
+
+    std::vector<Block> blocks_;
+    size_t block_ = 0;
+    size_t used_ = 0;
+};
+
+// A decoded packet that refers to its payload instead of owning it
+//
+// decode() works in place, so the payload of a view points into the decoded
+// bytes and is only valid for as long as they are. Copy the payload into a
+// UsbPayloadArena with stored() to keep it past that.
+struct UsbPacketView {
+
+    UsbPacketView() :
         pid(PID_INVALID),
         frame(0),
         payload()
     {}
 
-    public:
-    static std::optional<UsbPacket> decode_packet(std::vector<uint8_t> payload) {
+    static std::optional<UsbPacketView> decode(std::span<const uint8_t> bytes) {
 
-        UsbPacket packet;
+        UsbPacketView packet;
 
-        if (payload.size() < 1) {
+        if (bytes.size() < 1) {
             return std::nullopt;
         }
 
-        uint8_t pid_lo = payload[0] & 0xF;
-        uint8_t pid_hi = ((payload[0] >> 4) & 0xF) ^ 0xF;
-        
+        uint8_t pid_lo = bytes[0] & 0xF;
+        uint8_t pid_hi = ((bytes[0] >> 4) & 0xF) ^ 0xF;
+
         if (pid_lo != pid_hi) {
             return std::nullopt;
         }
@@ -488,13 +1385,13 @@ struct UsbPacket {
         case PID_IN:
         case PID_SETUP:
         {
-            if (payload.size() != 3) {
+            if (bytes.size() != 3) {
                 return std::nullopt;
             }
-            packet.token.addr = payload[1] & 0x7F;
-            packet.token.endp = ((payload[1] & 0x80) >> 7) |
-                                ((payload[2] & 0x07) << 1);
-            uint8_t crc5_payload = (payload[2] & 0xF8) >> 3;
+            packet.token.addr = bytes[1] & 0x7F;
+            packet.token.endp = ((bytes[1] & 0x80) >> 7) |
+                                ((bytes[2] & 0x07) << 1);
+            uint8_t crc5_payload = (bytes[2] & 0xF8) >> 3;
             uint8_t crc5_calc = crc5usb((packet.token.endp << 7) | packet.token.addr);
             if (crc5_calc != crc5_payload) {
                 return std::nullopt;
@@ -503,12 +1400,12 @@ struct UsbPacket {
         break;
         case PID_SOF:
         {
-            if (payload.size() != 3) {
+            if (bytes.size() != 3) {
                 return std::nullopt;
             }
-            packet.frame = (payload[1] & 0x07) << 8 |
-                           (payload[2] & 0xFF);
-            uint8_t crc5_payload = (payload[2] & 0xF8) >> 3;
+            packet.frame = (bytes[2] & 0x07) << 8 |
+                           (bytes[1] & 0xFF);
+            uint8_t crc5_payload = (bytes[2] & 0xF8) >> 3;
             uint8_t crc5_calc = crc5usb(packet.frame);
             if (crc5_calc != crc5_payload) {
                 return std::nullopt;
@@ -518,17 +1415,14 @@ struct UsbPacket {
         case PID_DATA0:
         case PID_DATA1:
         {
-            if (payload.size() < 3) {
+            if (bytes.size() < 3) {
                 return std::nullopt;
             }
 
-            uint32_t idx;
-            for (idx = 1; idx < (payload.size() - 2); idx++) {
-                packet.payload.push_back(payload[idx]);
-            }
+            packet.payload = bytes.subspan(1, bytes.size() - 3);
 
-            uint16_t crc16_payload = payload[idx+1] << 8 |
-                                     payload[idx];
+            uint16_t crc16_payload = bytes[bytes.size() - 1] << 8 |
+                                     bytes[bytes.size() - 2];
             uint16_t crc16_calc = crc16usb(packet.payload.data(), packet.payload.size());
             if (crc16_calc != crc16_payload) {
                 return std::nullopt;
@@ -539,7 +1433,7 @@ struct UsbPacket {
         case PID_NAK:
         case PID_STALL:
         {
-            if (payload.size() != 1) {
+            if (bytes.size() != 1) {
                 return std::nullopt;
             }
         }
@@ -554,79 +1448,78 @@ struct UsbPacket {
         return packet;
     }
 
-    static UsbPacket create_token_packet(Pid pid,
-                                         uint8_t addr,
-                                         uint8_t endp) {
-        assert(pid == PID_IN ||
-               pid == PID_OUT ||
-               pid == PID_SETUP);
-
-        UsbPacket packet;
-
-        packet.pid = pid;
-        packet.token.addr = addr;
-        packet.token.endp = endp;
+    // The same packet with its payload copied into arena
+    UsbPacketView stored(UsbPayloadArena& arena) const {
+        UsbPacketView packet = *this;
+        packet.payload = arena.store(payload);
         return packet;
     }
 
-    static UsbPacket create_sof_packet(Pid pid,
-                                       uint16_t frame) {
-        assert(pid == PID_SOF);
-
-        UsbPacket packet;
-
-        packet.pid = pid;
-        packet.frame = frame;
-        return packet;
+    // Bytes on the bus, from the PID to the CRC
+    size_t byte_size() const {
+        switch (pid) {
+            case PID_OUT:
+            case PID_IN:
+            case PID_SETUP:
+            case PID_SOF:
+                return 3;
+            case PID_DATA0:
+            case PID_DATA1:
+            case PID_DATA2:
+            case PID_MDATA:
+                return 1 + payload.size() + 2;
+            default:
+                return 1;
+        }
     }
 
-    static UsbPacket create_data_packet(Pid pid,
-                                        std::vector<uint8_t> payload) {
-        assert(pid == PID_DATA0 ||
-               pid == PID_DATA1);
-
-        UsbPacket packet;
-
-        packet.pid = pid;
-        packet.payload = payload;
-        return packet;
+    // Writes byte_size() bytes
+    void write_bytes(uint8_t* out) const {
+        out[0] = pid_byte(pid);
+        write_body(out + 1);
     }
 
-    static UsbPacket create_handshake_packet(Pid pid) {
-        assert(pid == PID_ACK ||
-               pid == PID_NAK ||
-               pid == PID_STALL);
-
-        UsbPacket packet;
-
-        packet.pid = pid;
-        return packet;
+    void append_bytes(std::vector<uint8_t>& out) const {
+        const size_t offset = out.size();
+        out.resize(offset + byte_size());
+        write_bytes(out.data() + offset);
     }
 
-    std::vector<uint8_t> get_packet_bytes() {
-        JKEncoder encoded;
+    // The bytes following the PID
+    void write_body(uint8_t* out) const {
         switch (pid) {
             case PID_OUT:
             case PID_IN:
             case PID_SETUP:
-                encoded = JKEncoder::create_token_packet(pid,
-                                                         token.addr,
-                                                         token.endp);
-                break;
+            {
+                uint8_t crc5 = crc5usb((token.endp << 7) | token.addr);
+                out[0] = (token.addr & 0x7F) | ((token.endp & 1) << 7);
+                out[1] = ((token.endp >> 1) & 0x7) | (crc5 << 3);
+            }
+            break;
             case PID_SOF:
-                encoded = JKEncoder::create_sof_packet(frame);
-                break;
+            {
+                uint8_t crc5 = crc5usb(frame);
+                out[0] = frame & 0xFF;
+                out[1] = ((frame >> 8) & 0x7) | (crc5 << 3);
+            }
+            break;
             case PID_DATA0:
             case PID_DATA1:
             case PID_DATA2:
             case PID_MDATA:
-                encoded = JKEncoder::create_data_packet(pid,
-                                                        payload);
-                break;
+            {
+                uint16_t crc = crc16usb(payload.data(), payload.size());
+                if (!payload.empty()) {
+                    std::memcpy(out, payload.data(), payload.size());
+                }
+                out[payload.size()] = crc & 0xFF;
+                out[payload.size() + 1] = crc >> 8;
+            }
+            break;
             case PID_ACK:
             case PID_NAK:
             case PID_STALL:
-                encoded = JKEncoder::create_handshake_packet(pid);
                 break;
             case PID_NYET:
             case PID_ERR:
@@ -634,15 +1527,11 @@ struct UsbPacket {
             case PID_PING:
             default:
                 assert(false);
-                encoded = JKEncoder::create_handshake_packet(PID_INVALID);
+                break;
         }
-
-        auto to_write = encoded.get_to_write();
-        assert(to_write.size() > 0);
-        return std::vector<uint8_t>(to_write.begin() + 1, to_write.end());
     }
 
-    bool operator==(const UsbPacket& rhs) const {
+    bool operator==(const UsbPacketView& rhs) const {
 
         if (pid != rhs.pid) {
             return false;
@@ -663,7 +1552,7 @@ struct UsbPacket {
             case PID_DATA1:
             case PID_DATA2:
             case PID_MDATA:
-                return payload == rhs.payload;
+                return std::ranges::equal(payload, rhs.payload);
             case PID_ACK:
             case PID_NAK:
             case PID_STALL:
@@ -679,6 +1568,131 @@ struct UsbPacket {
         }
     }
 
+    Pid pid;
+    union {
+        struct {
+            uint16_t addr:7;
+            uint8_t endp:4;
+        } token;
+        struct {
+            uint16_t frame:11;
+        };
+    };
+    std::span<const uint8_t> payload;
+};
+
+struct UsbPacket {
+
+    private:
+    UsbPacket() :
+        pid(PID_INVALID),
+        frame(0),
+        payload()
+    {}
+
+    public:
+    static std::optional<UsbPacket> decode_packet(std::span<const uint8_t> bytes) {
+
+        auto view = UsbPacketView::decode(bytes);
+        if (!view.has_value()) {
+            return std::nullopt;
+        }
+        return UsbPacket(*view);
+    }
+
+    // Owning copy of a view
+    explicit UsbPacket(const UsbPacketView& view) :
+        pid(view.pid),
+        frame(0),
+        payload(view.payload.begin(), view.payload.end())
+    {
+        if (pid == PID_SOF) {
+            frame = view.frame;
+        } else {
+            token.addr = view.token.addr;
+            token.endp = view.token.endp;
+        }
+    }
+
+    static UsbPacket create_token_packet(Pid pid,
+                                         uint8_t addr,
+                                         uint8_t endp) {
+        assert(pid == PID_IN ||
+               pid == PID_OUT ||
+               pid == PID_SETUP);
+
+        UsbPacket packet;
+
+        packet.pid = pid;
+        packet.token.addr = addr;
+        packet.token.endp = endp;
+        return packet;
+    }
+
+    static UsbPacket create_sof_packet(Pid pid,
+                                       uint16_t frame) {
+        assert(pid == PID_SOF);
+
+        UsbPacket packet;
+
+        packet.pid = pid;
+        packet.frame = frame;
+        return packet;
+    }
+
+    static UsbPacket create_data_packet(Pid pid,
+                                        std::vector<uint8_t> payload) {
+        assert(pid == PID_DATA0 ||
+               pid == PID_DATA1);
+
+        UsbPacket packet;
+
+        packet.pid = pid;
+        packet.payload = std::move(payload);
+        return packet;
+    }
+
+    static UsbPacket create_handshake_packet(Pid pid) {
+        assert(pid == PID_ACK ||
+               pid == PID_NAK ||
+               pid == PID_STALL);
+
+        UsbPacket packet;
+
+        packet.pid = pid;
+        return packet;
+    }
+
+    // A view of this packet, valid while the packet is
+    UsbPacketView view() const {
+        UsbPacketView v;
+        v.pid = pid;
+        if (pid == PID_SOF) {
+            v.frame = frame;
+        } else {
+            v.token.addr = token.addr;
+            v.token.endp = token.endp;
+        }
+        v.payload = payload;
+        return v;
+    }
+
+    // The bytes following the PID
+    std::vector<uint8_t> get_packet_bytes() const {
+        const UsbPacketView v = view();
+        std::vector<uint8_t> bytes(v.byte_size() - 1);
+        v.write_body(bytes.data());
+        return bytes;
+    }
+
+    bool operator==(const UsbPacket& rhs) const {
+        return view() == rhs.view();
+    }
+
+    bool operator==(const UsbPacketView& rhs) const {
+        return view() == rhs;
+    }
+
     Pid pid;
     union {
         struct {
@@ -692,6 +1706,118 @@ struct UsbPacket {
     std::vector<uint8_t> payload;
 };
 
+// Memoized packet waveforms
+//
+// Keyed by the packet bytes, PID to CRC, so equal packets share one
+// rendering. Entries are kept in least recently used order and evicted from
+// the back once the cache holds more than max_bytes. Cached waveforms are
+// copied out under a lock, so one cache can be shared by every test and
+// regression worker in a process.
+class JKWaveformCache {
+
+    public:
+    static constexpr size_t DEFAULT_MAX_BYTES = 4 * 1024 * 1024;
+
+    explicit JKWaveformCache(size_t max_bytes = DEFAULT_MAX_BYTES) :
+        max_bytes_(max_bytes)
+    {}
+
+    JKWaveformCache(const JKWaveformCache&) = delete;
+    JKWaveformCache& operator=(const JKWaveformCache&) = delete;
+
+    // The cache used by the test harness, alive for the whole process
+    static JKWaveformCache& shared() {
+        static JKWaveformCache cache;
+        return cache;
+    }
+
+    // Append the waveform of packet to wave, as JKBatchEncoder would
+    void append_packet(JKWaveform& wave, const UsbPacketView& packet) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        key_.clear();
+        packet.append_bytes(key_);
+        wave.append(lookup(key_));
+    }
+
+    void append_packet(JKWaveform& wave, const UsbPacket& packet) {
+        append_packet(wave, packet.view());
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        index_.clear();
+        entries_.clear();
+        bytes_ = 0;
+    }
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t entries;
+        size_t bytes;
+    };
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return {hits_, misses_, evictions_, entries_.size(), bytes_};
+    }
+
+    private:
+    struct Entry {
+        std::vector<uint8_t> key;
+        JKWaveform wave;
+        size_t bytes;
+
+        std::string_view key_view() const {
+            return {reinterpret_cast<const char*>(key.data()), key.size()};
+        }
+    };
+
+    const JKWaveform& lookup(const std::vector<uint8_t>& bytes) {
+        const std::string_view key(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            hits_++;
+            entries_.splice(entries_.begin(), entries_, it->second);
+            return it->second->wave;
+        }
+
+        misses_++;
+        Entry& entry = entries_.emplace_front();
+        entry.key = bytes;
+        JKBatchEncoder::append_packet(entry.wave, entry.key);
+        entry.bytes = sizeof(Entry) + entry.key.capacity() +
+                      entry.wave.words().capacity() * sizeof(uint64_t);
+        bytes_ += entry.bytes;
+        index_.emplace(entry.key_view(), entries_.begin());
+
+        // Never evict the entry being returned
+        while (bytes_ > max_bytes_ && entries_.size() > 1) {
+            const Entry& last = entries_.back();
+            bytes_ -= last.bytes;
+            index_.erase(last.key_view());
+            entries_.pop_back();
+            evictions_++;
+        }
+
+        return entry.wave;
+    }
+
+    const size_t max_bytes_;
+    std::mutex mutex_;
+    std::vector<uint8_t> key_;
+
+    // Most recently used first. Index keys point into the entries
+    std::list<Entry> entries_;
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+    size_t bytes_ = 0;
+
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t evictions_ = 0;
+};
 
 }
 
@@ -0,0 +1,285 @@
+#include <filesystem>
+#include <format>
+
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+
+#include "usb_capture.hpp"
+#include "usb_utils.hpp"
+
+static std::vector<uint8_t> bench_payload(size_t len) {
+    std::vector<uint8_t> data(len);
+    for (size_t i = 0; i < len; i++) {
+        data[i] = i * 37;
+    }
+    return data;
+}
+
+static void BM_Crc5Bitwise(benchmark::State& state) {
+    uint16_t token = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(UsbUtils::crc5usb_bitwise(token & 0x7FF));
+        token++;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Crc5Bitwise);
+
+static void BM_Crc5(benchmark::State& state) {
+    uint16_t token = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(UsbUtils::crc5usb(token & 0x7FF));
+        token++;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Crc5);
+
+static void BM_Crc16(benchmark::State& state) {
+    auto data = bench_payload(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(UsbUtils::crc16usb(data.data(), data.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_Crc16)->Arg(8)->Arg(64)->Arg(1023);
+
+static void BM_Crc16Bytewise(benchmark::State& state) {
+    auto data = bench_payload(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(UsbUtils::crc16usb_bytewise(data.data(), data.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_Crc16Bytewise)->Arg(8)->Arg(64)->Arg(1023);
+
+static void BM_Crc16Slice8(benchmark::State& state) {
+    auto data = bench_payload(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(UsbUtils::crc16usb_update_slice8(0xFFFF, data.data(), data.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_Crc16Slice8)->Arg(8)->Arg(64)->Arg(1023);
+
+// Bus states per second through the reference encoder
+static void BM_JKEncoderData(benchmark::State& state) {
+    auto data = bench_payload(state.range(0));
+    uint64_t steps = 0;
+    for (auto _ : state) {
+        auto encoder = UsbUtils::JKEncoder::create_data_packet(UsbUtils::PID_DATA0, data);
+        while (!encoder.is_complete()) {
+            benchmark::DoNotOptimize(encoder.step());
+            steps++;
+        }
+    }
+    state.counters["samples"] = benchmark::Counter(steps, benchmark::Counter::kIsRate);
+    state.counters["packets"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_JKEncoderData)->Arg(8)->Arg(64)->Arg(1023);
+
+static void BM_JKDecoderData(benchmark::State& state) {
+    auto data = bench_payload(state.range(0));
+    std::vector<UsbUtils::BusState> states;
+    auto encoder = UsbUtils::JKEncoder::create_data_packet(UsbUtils::PID_DATA0, data);
+    while (!encoder.is_complete()) {
+        states.push_back(encoder.step());
+    }
+
+    for (auto _ : state) {
+        UsbUtils::JKDecoder decoder;
+        for (auto bus : states) {
+            decoder.step(bus == UsbUtils::BUS_J, bus == UsbUtils::BUS_K);
+        }
+        benchmark::DoNotOptimize(decoder.is_complete());
+    }
+    state.counters["samples"] = benchmark::Counter(state.iterations() * states.size(),
+                                                   benchmark::Counter::kIsRate);
+    state.counters["packets"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_JKDecoderData)->Arg(8)->Arg(64)->Arg(1023);
+
+// The same packets, packed 32 samples per word
+static void BM_JKStreamDecoderData(benchmark::State& state) {
+    auto data = bench_payload(state.range(0));
+    std::vector<uint64_t> words(1, 0);
+    unsigned samples = 0;
+    auto encoder = UsbUtils::JKEncoder::create_data_packet(UsbUtils::PID_DATA0, data);
+    while (!encoder.is_complete() || samples % UsbUtils::JK_SAMPLES_PER_WORD != 0) {
+        auto bus = encoder.is_complete() ? UsbUtils::BUS_J : encoder.step();
+        if (samples > 0 && samples % UsbUtils::JK_SAMPLES_PER_WORD == 0) {
+            words.push_back(0);
+        }
+        words.back() |= UsbUtils::pack_line_state(bus == UsbUtils::BUS_J, bus == UsbUtils::BUS_K)
+                         << (2 * (samples % UsbUtils::JK_SAMPLES_PER_WORD));
+        samples++;
+    }
+
+    UsbUtils::JKStreamDecoder decoder;
+    for (auto _ : state) {
+        decoder.clear();
+        decoder.push_words(words.data(), words.size());
+        benchmark::DoNotOptimize(decoder.packet_count());
+    }
+    state.counters["samples"] = benchmark::Counter(state.iterations() * samples,
+                                                   benchmark::Counter::kIsRate);
+    state.counters["packets"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_JKStreamDecoderData)->Arg(8)->Arg(64)->Arg(1023);
+
+// The same packets rendered in one pass into a reused waveform
+static void BM_JKBatchEncoderData(benchmark::State& state) {
+    auto data = bench_payload(state.range(0));
+    UsbUtils::JKWaveform wave;
+    for (auto _ : state) {
+        wave.clear();
+        UsbUtils::JKBatchEncoder::append_data_packet(wave, UsbUtils::PID_DATA0, data);
+        benchmark::DoNotOptimize(wave.words().data());
+    }
+    state.counters["samples"] = benchmark::Counter(state.iterations() * wave.size(),
+                                                   benchmark::Counter::kIsRate);
+    state.counters["packets"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_JKBatchEncoderData)->Arg(8)->Arg(64)->Arg(1023);
+
+// Token rendering, the common case for the waveform cache
+static void BM_JKEncoderToken(benchmark::State& state) {
+    for (auto _ : state) {
+        auto encoder = UsbUtils::JKEncoder::create_token_packet(UsbUtils::PID_SETUP, 0, 0);
+        while (!encoder.is_complete()) {
+            benchmark::DoNotOptimize(encoder.step());
+        }
+    }
+    state.counters["packets"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_JKEncoderToken);
+
+static void BM_JKBatchEncoderToken(benchmark::State& state) {
+    UsbUtils::JKWaveform wave;
+    for (auto _ : state) {
+        wave.clear();
+        UsbUtils::JKBatchEncoder::append_token_packet(wave, UsbUtils::PID_SETUP, 0, 0);
+        benchmark::DoNotOptimize(wave.words().data());
+    }
+    state.counters["packets"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_JKBatchEncoderToken);
+
+static void BM_JKWaveformCacheToken(benchmark::State& state) {
+    UsbUtils::JKWaveformCache cache;
+    auto packet = UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_SETUP, 0, 0);
+    UsbUtils::JKWaveform wave;
+    for (auto _ : state) {
+        wave.clear();
+        cache.append_packet(wave, packet);
+        benchmark::DoNotOptimize(wave.words().data());
+    }
+    state.counters["packets"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_JKWaveformCacheToken);
+
+static void BM_UsbPacketBytes(benchmark::State& state) {
+    auto packet = UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA1,
+                                                          bench_payload(state.range(0)));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(packet.get_packet_bytes());
+    }
+    state.counters["packets"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed(state.iterations() * packet.payload.size());
+}
+BENCHMARK(BM_UsbPacketBytes)->Arg(8)->Arg(64)->Arg(1023);
+
+static void BM_UsbPacketDecode(benchmark::State& state) {
+    auto to_write = UsbUtils::JKEncoder::create_data_packet(UsbUtils::PID_DATA1,
+                                                            bench_payload(state.range(0))).get_to_write();
+    std::vector<uint8_t> bytes(to_write.begin(), to_write.end());
+    if (!UsbUtils::UsbPacket::decode_packet(bytes).has_value()) {
+        state.SkipWithError("reference packet does not decode");
+        return;
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(UsbUtils::UsbPacket::decode_packet(bytes));
+    }
+    state.counters["packets"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+BENCHMARK(BM_UsbPacketDecode)->Arg(8)->Arg(64)->Arg(1023);
+
+// In place over the same bytes, without copying the payload
+static void BM_UsbPacketViewDecode(benchmark::State& state) {
+    std::vector<uint8_t> bytes;
+    UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA1,
+                                            bench_payload(state.range(0))).view().append_bytes(bytes);
+    if (!UsbUtils::UsbPacketView::decode(bytes).has_value()) {
+        state.SkipWithError("reference packet does not decode");
+        return;
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(UsbUtils::UsbPacketView::decode(bytes));
+    }
+    state.counters["packets"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+BENCHMARK(BM_UsbPacketViewDecode)->Arg(8)->Arg(64)->Arg(1023);
+
+// Serialized into a reused buffer
+static void BM_UsbPacketViewBytes(benchmark::State& state) {
+    auto packet = UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA1,
+                                                          bench_payload(state.range(0)));
+    std::vector<uint8_t> bytes;
+    for (auto _ : state) {
+        bytes.clear();
+        packet.view().append_bytes(bytes);
+        benchmark::DoNotOptimize(bytes.data());
+    }
+    state.counters["packets"] = benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed(state.iterations() * packet.payload.size());
+}
+BENCHMARK(BM_UsbPacketViewBytes)->Arg(8)->Arg(64)->Arg(1023);
+
+// Open a capture and walk every edge, for CSV exports and .ucap files
+static void capture_load(benchmark::State& state, const std::string& fname) {
+    uint64_t edges = 0;
+    for (auto _ : state) {
+        USBCaptureFile capture(fname);
+        if (!capture.is_open()) {
+            state.SkipWithError("capture not found");
+            return;
+        }
+        for (const auto& edge : capture) {
+            benchmark::DoNotOptimize(edge.cycle);
+            edges++;
+        }
+    }
+    state.counters["edges"] = benchmark::Counter(edges, benchmark::Counter::kIsRate);
+}
+
+static const char* BENCH_CAPTURE = "bus_captures/setupin_capture.csv";
+
+static void BM_CaptureLoadCsv(benchmark::State& state) {
+    capture_load(state, BENCH_CAPTURE);
+}
+BENCHMARK(BM_CaptureLoadCsv);
+
+static void BM_CaptureLoadBinary(benchmark::State& state) {
+    const std::filesystem::path fname = std::filesystem::temp_directory_path() /
+                                        std::format("bench_capture.{}.ucap", getpid());
+    auto edges = resample_usb_capture(load_usb_capture(BENCH_CAPTURE));
+    if (edges.empty() || !write_usb_capture(fname, edges)) {
+        state.SkipWithError("capture not found");
+        return;
+    }
+
+    capture_load(state, fname);
+
+    std::error_code ec;
+    std::filesystem::remove(fname, ec);
+}
+BENCHMARK(BM_CaptureLoadBinary);
+
+BENCHMARK_MAIN();
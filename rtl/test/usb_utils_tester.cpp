@@ -0,0 +1,501 @@
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "usb_capture.hpp"
+#include "usb_utils.hpp"
+
+TEST(UsbUtilsCrc, Crc5Table) {
+    for (unsigned short input = 0; input < 2048; input++) {
+        ASSERT_EQ(UsbUtils::crc5usb(input), UsbUtils::crc5usb_bitwise(input)) << input;
+    }
+}
+
+TEST(UsbUtilsCrc, Crc5KnownTokens) {
+    // SETUP to address 0, endpoint 0 (2D 00 10 on the wire)
+    ASSERT_EQ(UsbUtils::crc5usb(0x000), 0x02);
+}
+
+TEST(UsbUtilsCrc, Crc16KnownPayload) {
+    // GET_DESCRIPTOR request from setup_txn_capture.csv
+    std::vector<uint8_t> data = {0x80,0x06,0x00,0x01,0x00,0x00,0x40,0x00};
+    ASSERT_EQ(UsbUtils::crc16usb(data.data(), data.size()), 0x94dd);
+    ASSERT_EQ(UsbUtils::crc16usb(nullptr, 0), 0x0000);
+}
+
+// Every length up to a full isochronous payload and beyond, at every
+// alignment, through each implementation
+TEST(UsbUtilsCrc, Crc16MatchesBytewise) {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist_byte(0,255);
+    std::vector<uint8_t> buf(2048 + 8);
+    for (auto& b : buf) {
+        b = dist_byte(rng);
+    }
+
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t len = 0; len <= 2048; len++) {
+            const uint8_t* data = buf.data() + offset;
+            const uint16_t exp_crc = UsbUtils::crc16usb_bytewise(data, len);
+
+            ASSERT_EQ(UsbUtils::crc16usb(data, len), exp_crc)
+                << "offset " << offset << " len " << len;
+            ASSERT_EQ(UsbUtils::crc16usb_update_slice8(0xFFFF, data, len) ^ 0xFFFF, exp_crc)
+                << "offset " << offset << " len " << len;
+#ifdef USB_UTILS_CRC16_CLMUL
+            if (len >= 16 && UsbUtils::crc16usb_has_clmul()) {
+                ASSERT_EQ(UsbUtils::crc16usb_update_clmul(0xFFFF, data, len) ^ 0xFFFF, exp_crc)
+                    << "offset " << offset << " len " << len;
+            }
+#endif
+        }
+    }
+}
+
+TEST(UsbUtilsCrc, Crc16Constexpr) {
+    constexpr uint8_t data[] = {0x80,0x06,0x00,0x01,0x00,0x00,0x40,0x00};
+    static_assert(UsbUtils::crc16usb_bytewise(data, sizeof(data)) == 0x94dd);
+    static_assert(UsbUtils::crc5usb(0x000) == 0x02);
+}
+
+// Line states of one encoded packet, one per sample
+static std::vector<uint64_t> packet_samples(UsbUtils::JKEncoder encoder) {
+    std::vector<uint64_t> samples;
+    while (!encoder.is_complete()) {
+        UsbUtils::BusState bus = encoder.step();
+        samples.push_back(UsbUtils::pack_line_state(bus == UsbUtils::BUS_J,
+                                                    bus == UsbUtils::BUS_K));
+    }
+    return samples;
+}
+
+// Pack into words, padding the last word with J
+static std::vector<uint64_t> pack_samples(const std::vector<uint64_t>& samples) {
+    const size_t n = UsbUtils::JK_SAMPLES_PER_WORD;
+    std::vector<uint64_t> words((samples.size() + n - 1) / n, 0);
+    for (size_t i = 0; i < words.size() * n; i++) {
+        uint64_t line = i < samples.size() ? samples[i] : UsbUtils::pack_line_state(1, 0);
+        words[i / n] |= line << (2 * (i % n));
+    }
+    return words;
+}
+
+// Random packet streams with idle gaps and the odd corrupted sample. Every
+// packet JKDecoder decodes cleanly must come out of the stream decoder, and
+// nothing else, through both the word and the sample interfaces
+TEST(UsbUtilsJKStream, MatchesJKDecoder) {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist_byte(0,255);
+    std::uniform_int_distribution<int> dist_len(0,80);
+    std::uniform_int_distribution<int> dist_gap(1,40);
+    std::uniform_int_distribution<int> dist_pct(0,99);
+    const uint64_t idle = UsbUtils::pack_line_state(1, 0);
+
+    for (int trial = 0; trial < 2000; trial++) {
+        std::vector<uint64_t> samples(dist_gap(rng), idle);
+        std::vector<std::vector<uint8_t>> exp_pkts;
+        size_t exp_errors = 0;
+
+        for (int p = 0; p < 4; p++) {
+            std::vector<uint8_t> data(dist_len(rng));
+            for (auto& b : data) {
+                // Plenty of 0xFF for bitstuffing
+                b = dist_pct(rng) < 30 ? 0xFF : dist_byte(rng);
+            }
+            auto pkt = packet_samples(UsbUtils::JKEncoder(data));
+            if (dist_pct(rng) < 10) {
+                pkt[32 + rng() % (pkt.size() - 40)] ^= 3;
+            }
+
+            UsbUtils::JKDecoder decoder;
+            for (auto line : pkt) {
+                decoder.step(line & 1, line >> 1);
+            }
+            if (decoder.get_err().has_value()) {
+                exp_errors++;
+            } else {
+                ASSERT_TRUE(decoder.is_complete());
+                exp_pkts.push_back(decoder.get_decoded());
+            }
+
+            samples.insert(samples.end(), pkt.begin(), pkt.end());
+            samples.insert(samples.end(), dist_gap(rng), idle);
+        }
+
+        UsbUtils::JKStreamDecoder word_dec;
+        auto words = pack_samples(samples);
+        word_dec.push_words(words.data(), words.size());
+
+        UsbUtils::JKStreamDecoder sample_dec;
+        for (auto line : samples) {
+            sample_dec.push_sample(line & 1, line >> 1);
+        }
+        sample_dec.flush();
+
+        for (const auto* dec : {&word_dec, &sample_dec}) {
+            ASSERT_EQ(dec->packet_count(), exp_pkts.size()) << "trial " << trial;
+            for (size_t i = 0; i < exp_pkts.size(); i++) {
+                ASSERT_EQ(dec->packet(i), exp_pkts[i]) << "trial " << trial << " packet " << i;
+            }
+            ASSERT_EQ(dec->errors().size() > 0, exp_errors > 0) << "trial " << trial;
+            ASSERT_FALSE(dec->in_packet());
+        }
+    }
+}
+
+TEST(UsbUtilsJKStream, ErrorMessages) {
+    // Break the first J of SYNC
+    auto pkt = packet_samples(UsbUtils::JKEncoder({0xA5, 0xB9, 0x40}));
+    pkt[4] = UsbUtils::pack_line_state(1, 1);
+
+    UsbUtils::JKDecoder decoder;
+    for (auto line : pkt) {
+        decoder.step(line & 1, line >> 1);
+    }
+
+    UsbUtils::JKStreamDecoder stream;
+    auto words = pack_samples(pkt);
+    stream.push_words(words.data(), words.size());
+
+    ASSERT_EQ(stream.packet_count(), 0);
+    ASSERT_EQ(stream.errors().size(), 1);
+    ASSERT_EQ(stream.errors()[0].code, UsbUtils::JK_ERR_SYNC);
+    ASSERT_EQ(stream.errors()[0].sample, 4);
+    ASSERT_TRUE(decoder.get_err().has_value());
+    ASSERT_EQ(stream.errors()[0].format(), decoder.get_err().value());
+}
+
+// Many back to back packets through one decoder, reusing its buffers
+TEST(UsbUtilsJKStream, Unbounded) {
+    std::vector<uint64_t> samples;
+    for (int i = 0; i < 1000; i++) {
+        std::vector<uint8_t> data = {(uint8_t)i, (uint8_t)(i >> 8), 0xFF, 0xFF};
+        auto pkt = packet_samples(UsbUtils::JKEncoder::create_data_packet(UsbUtils::PID_DATA0, data));
+        samples.insert(samples.end(), pkt.begin(), pkt.end());
+        samples.insert(samples.end(), 3 + i % 13, UsbUtils::pack_line_state(1, 0));
+    }
+    auto words = pack_samples(samples);
+
+    UsbUtils::JKStreamDecoder stream;
+    for (int pass = 0; pass < 2; pass++) {
+        stream.reset();
+        stream.push_words(words.data(), words.size());
+
+        ASSERT_EQ(stream.errors().size(), 0);
+        ASSERT_EQ(stream.packet_count(), 1000);
+        for (int i = 0; i < 1000; i++) {
+            auto decoded = UsbUtils::UsbPacket::decode_packet(stream.packet(i));
+            ASSERT_TRUE(decoded.has_value()) << i;
+            ASSERT_EQ(decoded->payload[0], (uint8_t)i);
+            ASSERT_EQ(decoded->payload[1], (uint8_t)(i >> 8));
+        }
+    }
+}
+
+// Clean real world captures, one sample per clock
+static void stream_capture_test(const std::string& capture_fname,
+                                const std::string& decoder_fname) {
+    USBCaptureFile capture(capture_fname);
+    ASSERT_TRUE(capture.is_open());
+
+    UsbUtils::JKStreamDecoder stream;
+    uint64_t clk_cnt = 0;
+    uint8_t dp = 0, dn = 0;
+    for (const auto& edge : capture) {
+        for (; clk_cnt < edge.cycle; clk_cnt++) {
+            stream.push_sample(dp, dn);
+        }
+        dp = edge.dp;
+        dn = edge.dn;
+    }
+    for (int i = 0; i < 64; i++) {
+        stream.push_sample(dp, dn);
+    }
+    stream.flush();
+
+    std::ifstream decoder_f(decoder_fname);
+    std::string line;
+    size_t pkt_idx = 0;
+    while (std::getline(decoder_f, line)) {
+        std::vector<uint8_t> exp_pkt;
+        std::stringstream line_stream(line);
+        std::string val;
+        while (std::getline(line_stream, val, ',')) {
+            exp_pkt.push_back(std::strtol(val.c_str(), NULL, 16));
+        }
+        ASSERT_LT(pkt_idx, stream.packet_count());
+        ASSERT_EQ(stream.packet(pkt_idx), exp_pkt);
+        pkt_idx++;
+    }
+    ASSERT_EQ(pkt_idx, stream.packet_count());
+}
+
+TEST(UsbUtilsJKStream, SofCapture) {
+    stream_capture_test("bus_captures/sof_capture.csv",
+                        "bus_captures/sof_capture_jk.csv");
+}
+
+TEST(UsbUtilsJKStream, AckPoorCapture) {
+    stream_capture_test("bus_captures/ack_poor_capture.csv",
+                        "bus_captures/ack_poor_capture_jk.csv");
+}
+
+// A .ucap whose last varint is cut short must not open
+TEST(UsbCaptureBinary, TruncatedVarint) {
+    const std::string fname = std::format("truncated_varint.{}.ucap", getpid());
+    // A long gap before the last edge takes a multi byte varint
+    ASSERT_TRUE(write_usb_capture(fname, {{10, 0, 1}, {100000, 1, 0}}));
+    {
+        USBCaptureFile capture(fname);
+        ASSERT_TRUE(capture.is_open());
+        ASSERT_EQ(capture.size(), 2);
+    }
+
+    // Set the continuation bit of the last byte
+    std::fstream capture_f(fname, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    capture_f.seekg(-1, std::ios_base::end);
+    char last = capture_f.get();
+    capture_f.seekp(-1, std::ios_base::end);
+    capture_f.put(last | 0x80);
+    capture_f.close();
+
+    USBCaptureFile capture(fname);
+    ASSERT_FALSE(capture.is_open());
+    ASSERT_EQ(capture.begin(), capture.end());
+
+    std::filesystem::remove(fname);
+}
+
+static void expect_waveform(const UsbUtils::JKWaveform& wave, size_t start,
+                            UsbUtils::JKEncoder encoder) {
+    size_t i = start;
+    while (!encoder.is_complete()) {
+        UsbUtils::BusState bus = encoder.step();
+        ASSERT_LT(i, wave.size());
+        ASSERT_EQ(wave.bus(i), bus) << "sample " << i - start;
+        i++;
+    }
+    ASSERT_EQ(i, wave.size());
+}
+
+// Sample for sample against JKEncoder, with packets appended at every
+// alignment within a word
+TEST(UsbUtilsJKBatch, MatchesJKEncoder) {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist_byte(0,255);
+    std::uniform_int_distribution<int> dist_len(0,80);
+    std::uniform_int_distribution<int> dist_pct(0,99);
+
+    UsbUtils::JKWaveform wave;
+    for (int trial = 0; trial < 2000; trial++) {
+        std::vector<uint8_t> data(dist_len(rng));
+        for (auto& b : data) {
+            b = dist_pct(rng) < 30 ? 0xFF : dist_byte(rng);
+        }
+
+        const size_t start = wave.size();
+        UsbUtils::JKBatchEncoder::append_packet(wave, data);
+        expect_waveform(wave, start, UsbUtils::JKEncoder(data));
+    }
+
+    wave.clear();
+    UsbUtils::JKBatchEncoder::append_token_packet(wave, UsbUtils::PID_SETUP, 0x7F, 0xF);
+    expect_waveform(wave, 0, UsbUtils::JKEncoder::create_token_packet(UsbUtils::PID_SETUP, 0x7F, 0xF));
+
+    wave.clear();
+    UsbUtils::JKBatchEncoder::append_sof_packet(wave, 0x7FF);
+    expect_waveform(wave, 0, UsbUtils::JKEncoder::create_sof_packet(0x7FF));
+
+    wave.clear();
+    UsbUtils::JKBatchEncoder::append_handshake_packet(wave, UsbUtils::PID_STALL);
+    expect_waveform(wave, 0, UsbUtils::JKEncoder::create_handshake_packet(UsbUtils::PID_STALL));
+
+    std::vector<uint8_t> data = {0xFF, 0xFF, 0x00, 0x7E, 0xFF};
+    wave.clear();
+    UsbUtils::JKBatchEncoder::append_data_packet(wave, UsbUtils::PID_DATA1, data);
+    expect_waveform(wave, 0, UsbUtils::JKEncoder::create_data_packet(UsbUtils::PID_DATA1, data));
+}
+
+// Back to back packets decode from a single waveform
+TEST(UsbUtilsJKBatch, StreamDecode) {
+    UsbUtils::JKWaveform wave;
+    std::vector<std::vector<uint8_t>> payloads;
+    for (int i = 0; i < 100; i++) {
+        std::vector<uint8_t> data(i % 17, (uint8_t)(i * 29));
+        UsbUtils::JKBatchEncoder::append_data_packet(wave, UsbUtils::PID_DATA0, data);
+        for (int j = 0; j < i % 5; j++) {
+            wave.append(UsbUtils::pack_line_state(1, 0), 1);
+        }
+        payloads.push_back(data);
+    }
+
+    UsbUtils::JKStreamDecoder stream;
+    stream.push_waveform(wave);
+
+    ASSERT_EQ(stream.errors().size(), 0);
+    ASSERT_EQ(stream.packet_count(), payloads.size());
+    for (size_t i = 0; i < payloads.size(); i++) {
+        auto decoded = UsbUtils::UsbPacket::decode_packet(stream.packet(i));
+        ASSERT_TRUE(decoded.has_value()) << i;
+        ASSERT_EQ(decoded->payload, payloads[i]);
+    }
+}
+
+// Serialized bytes decode back to the same packet, for every packet type
+TEST(UsbUtilsPacketView, RoundTrip) {
+    std::vector<uint8_t> data = {0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x40, 0x00};
+    std::vector<UsbUtils::UsbPacket> packets = {
+        UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_SETUP, 0x32, 0x4),
+        UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_IN, 0x7F, 0xF),
+        UsbUtils::UsbPacket::create_sof_packet(UsbUtils::PID_SOF, 0x321),
+        UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0, data),
+        UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA1, {}),
+        UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_NAK)
+    };
+
+    std::vector<uint8_t> bytes;
+    for (const auto& packet : packets) {
+        bytes.clear();
+        packet.view().append_bytes(bytes);
+
+        // The same bytes JKEncoder sends
+        auto jk = packet.get_packet_bytes();
+        ASSERT_EQ(bytes.size(), jk.size() + 1);
+        ASSERT_TRUE(std::equal(jk.begin(), jk.end(), bytes.begin() + 1));
+
+        auto view = UsbUtils::UsbPacketView::decode(bytes);
+        ASSERT_TRUE(view.has_value());
+        ASSERT_EQ(packet, *view);
+        if (!view->payload.empty()) {
+            ASSERT_EQ(view->payload.data(), bytes.data() + 1);
+        }
+
+        auto owned = UsbUtils::UsbPacket::decode_packet(bytes);
+        ASSERT_TRUE(owned.has_value());
+        ASSERT_EQ(*owned, packet);
+    }
+}
+
+TEST(UsbUtilsPacketView, SofCaptureBytes) {
+    const uint8_t bytes[] = {0xA5, 0xB9, 0x40};
+    auto view = UsbUtils::UsbPacketView::decode(bytes);
+    ASSERT_TRUE(view.has_value());
+    ASSERT_EQ(view->pid, UsbUtils::PID_SOF);
+    ASSERT_EQ(view->frame, 0xB9);
+}
+
+TEST(UsbUtilsPacketView, BadCrc) {
+    std::vector<uint8_t> bytes;
+    UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0, {1, 2, 3}).view().append_bytes(bytes);
+    bytes[2] ^= 0x10;
+    ASSERT_FALSE(UsbUtils::UsbPacketView::decode(bytes).has_value());
+}
+
+// Views kept in an arena outlive the decoder buffer, and a reset arena is
+// reused without growing
+TEST(UsbUtilsPacketView, Arena) {
+    UsbUtils::JKWaveform wave;
+    std::vector<std::vector<uint8_t>> payloads;
+    for (int i = 0; i < 500; i++) {
+        std::vector<uint8_t> data(i % 300, (uint8_t)i);
+        UsbUtils::JKBatchEncoder::append_data_packet(wave, UsbUtils::PID_DATA1, data);
+        payloads.push_back(data);
+    }
+
+    UsbUtils::UsbPayloadArena arena;
+    UsbUtils::JKStreamDecoder stream;
+    std::vector<UsbUtils::UsbPacketView> views;
+    size_t capacity = 0;
+
+    for (int pass = 0; pass < 3; pass++) {
+        arena.reset();
+        views.clear();
+
+        stream.reset();
+        stream.push_waveform(wave);
+        ASSERT_EQ(stream.packet_count(), payloads.size());
+        for (size_t i = 0; i < stream.packet_count(); i++) {
+            auto view = UsbUtils::UsbPacketView::decode(stream.packet_bytes(i));
+            ASSERT_TRUE(view.has_value());
+            views.push_back(view->stored(arena));
+        }
+        stream.clear();
+
+        for (size_t i = 0; i < payloads.size(); i++) {
+            ASSERT_EQ(views[i].pid, UsbUtils::PID_DATA1);
+            ASSERT_TRUE(std::ranges::equal(views[i].payload, payloads[i])) << i;
+        }
+
+        if (pass > 0) {
+            ASSERT_EQ(arena.capacity(), capacity);
+        }
+        capacity = arena.capacity();
+    }
+}
+
+TEST(UsbUtilsWaveformCache, MatchesBatchEncoder) {
+    UsbUtils::JKWaveformCache cache;
+    std::vector<uint8_t> data = {0xFF, 0xFF, 0x12, 0x34};
+    std::vector<UsbUtils::UsbPacket> packets = {
+        UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_SETUP, 0, 0),
+        UsbUtils::UsbPacket::create_sof_packet(UsbUtils::PID_SOF, 0x7FF),
+        UsbUtils::UsbPacket::create_data_packet(UsbUtils::PID_DATA0, data),
+        UsbUtils::UsbPacket::create_handshake_packet(UsbUtils::PID_ACK)
+    };
+
+    for (int pass = 0; pass < 3; pass++) {
+        for (const auto& packet : packets) {
+            std::vector<uint8_t> bytes;
+            packet.view().append_bytes(bytes);
+
+            // Appended after a partial word, as between packets on a bus
+            UsbUtils::JKWaveform exp;
+            UsbUtils::JKWaveform act;
+            exp.append(UsbUtils::pack_line_state(1, 0), 5);
+            act.append(UsbUtils::pack_line_state(1, 0), 5);
+            UsbUtils::JKBatchEncoder::append_packet(exp, bytes);
+            cache.append_packet(act, packet);
+            ASSERT_EQ(act.size(), exp.size());
+            ASSERT_EQ(act.words(), exp.words());
+        }
+    }
+
+    auto stats = cache.stats();
+    ASSERT_EQ(stats.misses, packets.size());
+    ASSERT_EQ(stats.hits, 2 * packets.size());
+    ASSERT_EQ(stats.entries, packets.size());
+    ASSERT_EQ(stats.evictions, 0);
+}
+
+// With room for only a few entries, the least recently used one goes first
+TEST(UsbUtilsWaveformCache, LruEviction) {
+    auto token = [](uint8_t addr) {
+        return UsbUtils::UsbPacket::create_token_packet(UsbUtils::PID_IN, addr, 1);
+    };
+
+    UsbUtils::JKWaveform wave;
+    UsbUtils::JKWaveformCache probe;
+    probe.append_packet(wave, token(0));
+    const size_t entry_bytes = probe.stats().bytes;
+
+    UsbUtils::JKWaveformCache cache(3 * entry_bytes);
+    for (uint8_t addr : {1, 2, 3, 1, 4}) {
+        cache.append_packet(wave, token(addr));
+    }
+    auto stats = cache.stats();
+    ASSERT_EQ(stats.entries, 3);
+    ASSERT_EQ(stats.evictions, 1);
+    ASSERT_LE(stats.bytes, 3 * entry_bytes);
+
+    // 2 was evicted, 1 was kept by its second use
+    cache.append_packet(wave, token(1));
+    ASSERT_EQ(cache.stats().misses, 4);
+    cache.append_packet(wave, token(2));
+    ASSERT_EQ(cache.stats().misses, 5);
+}